@@ -21,6 +21,15 @@ var CMD_SET_VBIAS_DAC		= 0x0E;
 var CMD_RESET_STATE			= 0x0F;
 var CMD_SET_EEPROM_VALS     = 0x10;
 var CMD_READ_EEPROM_VALS    = 0x11;
+var CMD_CAP_REPORT_MODE     = 0x12;
+var CMD_CAP_MES_BATCH       = 0x13;
+var CMD_CAP_MES_STREAM      = 0x14;
+var CMD_CAP_RAW_EDGES       = 0x16;
+var CMD_CAP_MES_OPTIONS     = 0x17;
+var CMD_CAP_PRECISION       = 0x18;
+var CMD_CUR_MES_STREAM      = 0x19;
+var CMD_VBIAS_REGULATION    = 0x1A;
+var CMD_OE_CALIB_VERIFY     = 0x1B;
 var CMD_BOOTLOADER_JUMP		= 0xFF;
 
 // Current mode
@@ -45,9 +54,20 @@ var VBIAS_MIN				= 1300			// Minimum vbias voltage we allow
 var VBIAS_CUR_CALIB_ST		= 2000			// Vbias at which we start current calibration
 var NB_GRAPH_POINTS			= 20			// Default number of points for our graph
 var NB_MS_WAIT_VBIAS_MES	= 100			// How many milliseconds we wait before measuring vbias
-var EEPROM_STORED_DATA_SIZE = (1024-50)		// How many bytes we can store in our platform
+var EEPROM_STORED_DATA_SIZE = (935-50)		// How many bytes we can store in our platform
 var EEPROM_READ_NBBYTES 	= 60			// How many bytes we read
 var EEPROM_WRITE_NBBYTES	= 59			// How many bytes we write
+var CALIB_MODE_APPROX	= 1				// Open ended calibration mode: thresholds found by successive approximation
+var OE_CALIB_DATA_SIZE	= 33			// Size of the open ended calibration data (oe_calib_data_t)
+var CAP_BATCH_REPORT_SIZE	= 31			// Size of a compact capacitance report (capacitance_window_report_t)
+var CAP_REPORT_STREAM_FREQ	= 6				// Report frequency bit shift from which we ask for streamed reports
+var STREAM_TAG_CONTEXT		= 0x01			// Stream format context record tag
+var STREAM_TAG_WINDOW		= 0x02			// Stream format window record tag
+var RAW_EDGES_BLOCK_SIZE	= 28			// Number of pulse widths in a raw edges packet
+var RAW_EDGES_HISTORY		= 1024			// Number of raw edges we keep for analysis
+var MES_OPT_RESTART_GATE	= 0x01			// Capacitance measurement option: restart the gate on a range change
+var MES_OPT_RECIPROCAL	= 0x02			// Capacitance measurement option: reciprocal counting, timestamp based counter values
+var MES_OPT_CROSSING_TIMING = 0x04		// Capacitance measurement option: pulse widths from the threshold crossings timing
 
 var device_info = { "vendorId": 0x1209, "productId": 0xdddd };      			// capmeter
 var version       = 'unknown'; 													// connected capmeter version
@@ -59,6 +79,7 @@ var carac_averaging = 8;														// Number of samples for carac averaging
 var current_ampl = 0;															// current measurement amplification
 var current_avg = 14;															// current measurement averaging
 var current_calib_avg = 14;														// current measurement averaging during calibration
+var current_carac_tolerance = 2;												// current caracterization: stop averaging once the mean is known within this many LSB
 var ping_enabled = true;														// know if we send ping requests
 var platform_max_vbias = 10000;													// max vbias the platform can generate
 var capacitance_offset = null;													// Capacitance offset
@@ -71,6 +92,21 @@ var cap_last_value_ind = 0;														// Index to where to store the latest v
 var current_cap_average = 0;													// Current capacitance average
 var current_current = 0;														// Current current (that's an awesome var name)
 var capacitance_report_freq = 3;												// Capacitance report frequency in bit shift
+var capacitance_mes_options = MES_OPT_RESTART_GATE;								// Capacitance measurement options
+var capacitance_precision_ppm = 0;												// Adaptive gate precision target in ppm, 0 to report each window
+var cap_stream_context = null;													// Last context received in stream report mode
+var cap_stream_last_window = null;												// Last window received in stream report mode
+var cap_last_window_index = null;												// Index of the last capacitance measurement window received
+var cap_nb_lost_windows = 0;													// Number of measurement windows lost since measurement start
+var cap_defer_requests = false;													// Set while a packet of several reports is decoded, their requests are sent once it is done
+var cap_deferred_request = null;												// First request made by the reports of that packet
+var cap_raw_edges_enabled = false;												// Ask for the individual pulse widths on top of the reports
+var cap_raw_edges = [];															// Last raw edges received
+var cap_last_edge_block_seq = null;												// Sequence number of the last raw edges block received
+var cap_nb_lost_edge_blocks = 0;												// Number of raw edges blocks lost since measurement start
+var calib_first_thres_up = 0;													// Calibrated first threshold, from the calibration data
+var calib_second_thres_up = 0;													// Calibrated second threshold, from the calibration data
+var calib_osc_low_v = 0;														// Calibrated oscillator low voltage, from the calibration data
 var packetSize = 64;    														// number of bytes in an HID packet
 var waitingForAnswer = false;													// boolean indicating if we are waiting for a packet
 var vbias_mes_capacitance_changed = false;										// boolean indicating that vbias was changed while in mes capacitance mode
@@ -160,7 +196,7 @@ function start_open_ended_calibration()
 	{
 		var d = new Date();
 		console.log("Open Ended Calibration In Progress...");
-		sendRequest(CMD_OE_CALIB_START, [d.getDate(), d.getMonth() + 1, d.getFullYear()%100]);
+		sendRequest(CMD_OE_CALIB_START, [d.getDate(), d.getMonth() + 1, d.getFullYear()%100, CALIB_MODE_APPROX]);
 		current_mode = MODE_OE_CALIB;
 		disable_gui_buttons();
 	}
@@ -438,6 +474,343 @@ capmeter.app.exportAdvancedCalibDataToEeprom = function()
 	}
 }
 
+/**
+ * Decode one capacitance report (see capacitance_report_t)
+ * @param msg the report bytes
+ * @return the decoded report
+ */
+function decodeCapacitanceReport(msg)
+{
+	return {
+		"counter_divider": (msg[1]<<8) + msg[0],
+		"aggregate_fall": msg[5]*16777216 + (msg[4]<<16) + (msg[3]<<8) + msg[2],
+		"counter_val": msg[9]*16777216 + (msg[8]<<16) + (msg[7]<<8) + msg[6],
+		"report_freq": (msg[10] != 0) ? msg[10] : (1 << capacitance_report_freq),
+		"half_res": (msg[12]<<8) + msg[11],
+		"second_threshold": (msg[14]<<8) + msg[13],
+		"first_threshold": (msg[16]<<8) + msg[15],
+		"aggregate_rise": msg[20]*16777216 + (msg[19]<<16) + (msg[18]<<8) + msg[17],
+		"counter_rise": msg[24]*16777216 + (msg[23]<<16) + (msg[22]<<8) + msg[21],
+		"counter_fall": msg[28]*16777216 + (msg[27]<<16) + (msg[26]<<8) + msg[25],
+		"vosc_low": (msg[30]<<8) + msg[29],
+		"window_index": (msg[32]<<8) + msg[31],
+		"timestamp": msg[36]*16777216 + (msg[35]<<16) + (msg[34]<<8) + msg[33]
+	};
+}
+
+/**
+ * Decode one compact capacitance report (see capacitance_window_report_t)
+ * @param msg the report bytes
+ * @return the decoded report
+ */
+function decodeCapacitanceBatchReport(msg)
+{
+	return {
+		"counter_divider": (msg[1]<<8) + msg[0],
+		"aggregate_fall": msg[5]*16777216 + (msg[4]<<16) + (msg[3]<<8) + msg[2],
+		"counter_val": msg[9]*16777216 + (msg[8]<<16) + (msg[7]<<8) + msg[6],
+		"report_freq": 1 << msg[10],
+		"half_res": (msg[12]<<8) + msg[11],
+		"timestamp": msg[16]*16777216 + (msg[15]<<16) + (msg[14]<<8) + msg[13],
+		"aggregate_rise": msg[20]*16777216 + (msg[19]<<16) + (msg[18]<<8) + msg[17],
+		"counter_rise": msg[24]*16777216 + (msg[23]<<16) + (msg[22]<<8) + msg[21],
+		"counter_fall": msg[28]*16777216 + (msg[27]<<16) + (msg[26]<<8) + msg[25],
+		"window_index": (msg[30]<<8) + msg[29],
+		"second_threshold": calib_second_thres_up,
+		"first_threshold": calib_first_thres_up,
+		"vosc_low": calib_osc_low_v
+	};
+}
+
+/**
+ * Decode a stream packet (see stream_capacitance_report() in the firmware)
+ * Context records are only sent on range or calibration changes, window records
+ * contain zigzag varint deltas against the previous window (plus its expected
+ * increment), the window following a context record being encoded against 0.
+ * @param msg the packet payload
+ * @param len the payload length
+ * @return the decoded reports
+ */
+function decodeCapacitanceStream(msg, len)
+{
+	var reports = [];
+	var i = 0;
+	
+	while (i < len)
+	{
+		var tag = msg[i++];
+		if (tag == STREAM_TAG_CONTEXT)
+		{
+			cap_stream_context = {
+				"counter_divider": (msg[i+1]<<8) + msg[i],
+				"report_freq": 1 << msg[i+2],
+				"half_res": (msg[i+4]<<8) + msg[i+3],
+				"second_threshold": (msg[i+6]<<8) + msg[i+5],
+				"first_threshold": (msg[i+8]<<8) + msg[i+7],
+				"vosc_low": (msg[i+10]<<8) + msg[i+9]
+			};
+			cap_stream_last_window = null;
+			i += 11;
+		}
+		else if (tag == STREAM_TAG_WINDOW)
+		{
+			var window = [];
+			// Window index increments by one, timestamp by the gate length in 32MHz ticks
+			var increments = [0, 0, 0, 0, 0, 1, (cap_stream_context != null) ? 32000000 / cap_stream_context.report_freq : 0];
+			for (var field = 0; field < 7; field++)
+			{
+				// Unsigned varint
+				var value = 0;
+				var multiplier = 1;
+				do
+				{
+					value += (msg[i] & 0x7F) * multiplier;
+					multiplier *= 128;
+				}
+				while (msg[i++] & 0x80);
+				// Zigzag, then delta
+				var delta = (value % 2) ? -(value + 1) / 2 : value / 2;
+				var base = (cap_stream_last_window != null) ? cap_stream_last_window[field] + increments[field] : 0;
+				window.push(((base + delta) % 4294967296 + 4294967296) % 4294967296);
+			}
+			cap_stream_last_window = window;
+			
+			if (cap_stream_context != null)
+			{
+				var report = Object.assign({}, cap_stream_context);
+				report.counter_val = window[0];
+				report.aggregate_fall = window[1];
+				report.aggregate_rise = window[2];
+				report.counter_rise = window[3];
+				report.counter_fall = window[4];
+				report.window_index = window[5] & 0xFFFF;
+				report.timestamp = window[6];
+				reports.push(report);
+			}
+		}
+		else
+		{
+			console.log("Unknown stream tag " + tag);
+			break;
+		}
+	}
+	return reports;
+}
+
+/**
+ * Decode a raw edges packet (see process_edge_block() in the firmware)
+ * @param msg the packet payload
+ * @return the decoded block
+ */
+function decodeRawEdges(msg)
+{
+	var block = {
+		"sequence": msg[0],
+		"res_index": msg[1] >> 4,
+		"counter_divider_sel": msg[1] & 0x0F,
+		"edges": []
+	};
+	for (var i = 0; i < RAW_EDGES_BLOCK_SIZE; i++)
+	{
+		block.edges.push({
+			"pulse_width": (msg[7+2*i]<<8) + msg[6+2*i],
+			"rise": (msg[2+(i>>3)] & (1 << (i&0x07))) != 0
+		});
+	}
+	return block;
+}
+
+/**
+ * Process one decoded raw edges block
+ * @param block the decoded block
+ */
+function onRawEdges(block)
+{
+	// Check for lost blocks
+	if((cap_last_edge_block_seq != null) && (block.sequence != ((cap_last_edge_block_seq + 1) & 0xFF)))
+	{
+		var nb_lost = (block.sequence - cap_last_edge_block_seq - 1 + 256) & 0xFF;
+		cap_nb_lost_edge_blocks += nb_lost;
+		if (debug)
+		{
+			console.log("Lost " + nb_lost + " raw edges block(s), " + cap_nb_lost_edge_blocks + " since measurement start");
+		}
+	}
+	cap_last_edge_block_seq = block.sequence;
+	
+	// Keep the last edges for analysis
+	cap_raw_edges = cap_raw_edges.concat(block.edges);
+	if (cap_raw_edges.length > RAW_EDGES_HISTORY)
+	{
+		cap_raw_edges = cap_raw_edges.slice(cap_raw_edges.length - RAW_EDGES_HISTORY);
+	}
+}
+
+/**
+ * Process one decoded capacitance report
+ * @param report the decoded report
+ */
+function onCapacitanceReport(report)
+{
+	// Check for lost measurement windows
+	if((cap_last_window_index != null) && (report.window_index != ((cap_last_window_index + 1) & 0xFFFF)))
+	{
+		var nb_lost = (report.window_index - cap_last_window_index - 1 + 65536) & 0xFFFF;
+		cap_nb_lost_windows += nb_lost;
+		console.log("Lost " + nb_lost + " measurement window(s) before window " + report.window_index + " (" + (report.timestamp/32000000).toFixed(3) + "s), " + cap_nb_lost_windows + " since measurement start");
+	}
+	cap_last_window_index = report.window_index;
+	
+	var counter_divider = report.counter_divider;
+	var aggregate_fall = report.aggregate_fall;
+	var counter_val = report.counter_val;
+	var report_freq = report.report_freq;
+	var resistor_val = 2 * report.half_res;
+	var second_threshold = report.second_threshold;
+	var first_threshold = report.first_threshold;
+	var aggregate_rise = report.aggregate_rise;
+	var counter_rise = report.counter_rise;
+	var counter_fall = report.counter_fall;
+	var osc_lowvoltagemv = report.vosc_low*1.24/4.095;
+	
+	//console.log("Capacitance report - counter_divider: " + counter_divider + " aggregate_fall: " + aggregate_fall +  " aggregate_rise: " + aggregate_rise + " counter_val: " + counter_val + " report freq: " + report_freq + "Hz resistor: " + resistor_val + "Ohms second threshold: " + second_threshold + " first threshold: " + first_threshold);
+	// C =  - counter divider * aggregate / 32M * counter * 2 * half_r * ln(Vt2/Vt1)
+	var capacitance = 0;
+	
+	// If capacitance calibration has been done, remove offset
+	if(capmeter.app.cap_offset != null)
+	{
+		capacitance = -1*((counter_divider * aggregate_fall) / (32000000 * counter_val * resistor_val * Math.log(second_threshold/first_threshold))) - capmeter.app.cap_offset;				
+	}
+	else
+	{
+		capacitance = -1*((counter_divider * aggregate_fall) / (32000000 * counter_val * resistor_val * Math.log(second_threshold/first_threshold)));				
+	}
+	
+	// Don't allow negative capacitances
+	if(capacitance < 0)
+	{
+		//capacitance = 0;
+	}
+	
+	// Log
+	//console.log("Measured capacitance: " + capmeter.util.valueToElectronicString(capacitance, "F") + ", osc. freq.: " + counter_val*report_freq  + "Hz (" + resistor_val + "R)");
+	//console.log("Counter: " + counter_val + ", Counter fall: " + counter_fall + ", Counter rise: " + counter_rise);
+	//console.log("Aggregate fall: " + aggregate_fall + ", Aggregate rise: " + aggregate_rise);
+	
+	// ESR calculation			
+	var capacitance_rise = -1*((counter_divider * aggregate_rise) / (32000000 * counter_val * resistor_val * Math.log((3300-(first_threshold*1.24/4.095))/(3300-(second_threshold*1.24/4.095)))));
+	//console.log("Capacitance (rise): " + capmeter.util.valueToElectronicString(capacitance_rise, "F"));
+	var time_rise = (counter_divider*aggregate_rise)/(32000000*counter_rise);
+	//console.log("Rise time: " + capmeter.util.valueToElectronicString(time_rise, "s"));
+	// Vesr = -1 * ( (3.3V - Vthres1) / exp(-t/RC) - 3.3)
+	var esr_voltage = -1*(((3300-(first_threshold*1.24/4.095))/(Math.exp(-(time_rise)/(resistor_val*capacitance)))) - 3300);
+	//console.log("Vesr: " + esr_voltage);
+	// ESR = (Vesr - Vosclow) * R / (3.3-Vosclow)
+	var esr = ((esr_voltage - osc_lowvoltagemv) * resistor_val / (3300 - osc_lowvoltagemv))/1000;
+	//console.log("ESR: " + capmeter.util.valueToElectronicString(esr, "mOhms"));
+				
+	
+	// Store value in our buffer, compute capmeter.util.average and std deviation
+	cap_last_values[(cap_last_value_ind++)%cap_last_values.length] = capacitance;
+	var cap_standard_deviation = capmeter.util.standardDeviation(cap_last_values);
+	current_cap_average = capmeter.util.average(cap_last_values);
+	
+	// If we switched measured value (new values a lot different than the capmeter.util.average)
+	if(capacitance > current_cap_average*1.1 || capacitance < current_cap_average*0.9)
+	{
+		// set all values to last measured value
+		//console.log("New value measured, resetting last values");
+		for (var i = 0; i < cap_last_values.length; i++) cap_last_values[i] = capacitance;
+		current_cap_average = capacitance;
+		cap_last_value_ind = 0;
+	}
+	current_cap_average -=  null_capacitance_offset;
+	capmeter.measurement._capacitance = capmeter.util.valueToElectronicString(current_cap_average, "F") + "(" + capmeter.util.valueToElectronicString(counter_val*report_freq, "Hz") + ")";
+	
+	if(current_mode == MODE_CAP_CARAC)
+	{
+		var action = capmeter.graphing.newCapValueArrival(capacitance);		
+		
+		if(action[0] == "finished")
+		{
+			sendCapacitanceRequest(CMD_CAP_MES_EXIT, null);
+		}
+		else if(action[0] == "change_vbias")
+		{					
+			sendCapacitanceRequest(CMD_SET_VBIAS, [action[1]%256, Math.floor(action[1]/256)]);
+		}
+		else
+		{
+			// We'll receive a new measurement soon
+		}
+	}
+	else if(current_mode == MODE_CAP_CALIB)
+	{
+		// Store value in array
+		cap_calib_array[(cap_calib_array_ind++)%cap_calib_array.length] = capacitance;
+		// Check if we have enough values to compute offset
+		if(cap_calib_array_ind >= cap_calib_array.length)
+		{
+			cap_standard_deviation = capmeter.util.standardDeviation(cap_calib_array);
+			current_cap_average = capmeter.util.average(cap_calib_array);
+			console.log("Standard Deviation: " + capmeter.util.valueToElectronicString(cap_standard_deviation, "F") + ", Average: " + capmeter.util.valueToElectronicString(current_cap_average, "F"));
+			// Only accept if we are within 1%
+			if(current_cap_average * 0.01 > cap_standard_deviation)
+			{
+				// Store offset and exit
+				sendCapacitanceRequest(CMD_CAP_MES_EXIT, null);
+				capmeter.app.cap_offset = current_cap_average - 1e-12;
+				capmeter.app.cap_offset = current_cap_average;
+				console.log("Capacitance Offset To Store: " + capmeter.util.valueToElectronicString(capmeter.app.cap_offset, "F"));
+				$('#calibrateCapacitance').css('background', 'orange');
+			}
+		}
+	}
+}
+
+/**
+ * Send a request from a capacitance report, deferred until the whole packet is decoded when it holds several reports
+ * @param type the command
+ * @param content the command payload
+ */
+function sendCapacitanceRequest(type, content)
+{
+	if(cap_defer_requests)
+	{
+		// Only the first request of the packet is sent
+		if(cap_deferred_request == null)
+		{
+			cap_deferred_request = [type, content];
+		}
+	}
+	else
+	{
+		sendRequest(type, content);
+	}
+}
+
+/**
+ * Process several decoded capacitance reports from the same packet
+ * @param reports the decoded reports
+ */
+function onCapacitanceReports(reports)
+{
+	cap_defer_requests = true;
+	cap_deferred_request = null;
+	for (var i = 0; i < reports.length; i++)
+	{
+		onCapacitanceReport(reports[i]);
+	}
+	cap_defer_requests = false;
+	
+	if(cap_deferred_request != null)
+	{
+		sendRequest(cap_deferred_request[0], cap_deferred_request[1]);
+		cap_deferred_request = null;
+	}
+}
+
 /**
  * Handler for receiving new data from the device.
  * Decodes the HID message and updates the HTML message divider with
@@ -609,6 +982,7 @@ function onDataReceived(reportId, data)
 				console.log("Couldn't start open ended calibration!");
 				break;
 			}
+			console.log("Open ended calibration done in " + (bytes[2+OE_CALIB_DATA_SIZE] + bytes[3+OE_CALIB_DATA_SIZE]*256) + "ms");
 			// Get back to idle mode
 			current_mode = MODE_IDLE;
 			enable_gui_buttons();
@@ -629,6 +1003,11 @@ function onDataReceived(reportId, data)
 		{
 			// Update max voltage
 			platform_max_vbias = bytes[30] + bytes[31]*256;
+			
+			// Thresholds and oscillator low voltage for the capacitance reports
+			calib_second_thres_up = bytes[20] + bytes[21]*256;
+			calib_first_thres_up = bytes[22] + bytes[23]*256;
+			calib_osc_low_v = bytes[28] + bytes[29]*256;
 			$('#maxVoltage').val(((platform_max_vbias)/1000).toFixed(2));
 			capmeter.visualisation._maxVoltage = ((platform_max_vbias)/1000).toFixed(2);
 			
@@ -659,6 +1038,72 @@ function onDataReceived(reportId, data)
 				else
 				{
 					console.log("Report frequency set");					
+					// Stream reports at high report frequencies
+					if (cap_raw_edges_enabled)
+					{
+						sendRequest(CMD_CAP_REPORT_MODE, [3]);
+					}
+					else
+					{
+						sendRequest(CMD_CAP_REPORT_MODE, [(capacitance_report_freq >= CAP_REPORT_STREAM_FREQ) ? 2 : 0]);
+					}
+				}
+			}
+			break;
+		}
+		
+		case CMD_CAP_REPORT_MODE:
+		{
+			if((current_mode == MODE_CAP_MES_REQ) || (current_mode == MODE_CAP_CARAC_REQ))
+			{
+				if(msg[0] == 0)
+				{
+					console.log("Couldn't set report mode!");
+					current_mode = MODE_IDLE;
+					enable_gui_buttons();
+				}
+				else
+				{
+					console.log("Report mode set");					
+					sendRequest(CMD_CAP_MES_OPTIONS, [capacitance_mes_options]);
+				}
+			}
+			break;
+		}
+		
+		case CMD_CAP_MES_OPTIONS:
+		{
+			if((current_mode == MODE_CAP_MES_REQ) || (current_mode == MODE_CAP_CARAC_REQ))
+			{
+				if(msg[0] == 0)
+				{
+					console.log("Couldn't set measurement options!");
+					current_mode = MODE_IDLE;
+					enable_gui_buttons();
+				}
+				else
+				{
+					console.log("Measurement options set");					
+					// Next step: set precision target
+					sendRequest(CMD_CAP_PRECISION, [capacitance_precision_ppm & 0xFF, capacitance_precision_ppm >> 8]);
+				}
+			}
+			break;
+		}
+		
+		case CMD_CAP_PRECISION:
+		{
+			if((current_mode == MODE_CAP_MES_REQ) || (current_mode == MODE_CAP_CARAC_REQ))
+			{
+				if(msg[0] == 0)
+				{
+					console.log("Couldn't set precision target!");
+					current_mode = MODE_IDLE;
+					enable_gui_buttons();
+				}
+				else
+				{
+					console.log("Precision target set");					
 					// We start capacitance measurement mode
 					sendRequest(CMD_CAP_MES_START, null);
 				}
@@ -668,7 +1113,15 @@ function onDataReceived(reportId, data)
 		
 		case CMD_SET_VBIAS:
 		{
-			console.log("Voltage set to " + (bytes[2] + bytes[3]*256) + "mV, DAC value is " + (bytes[4] + bytes[5]*256))
+			if(len == 1)
+			{
+				// Refused: another voltage change is in progress
+				console.log("Couldn't set voltage, another change is in progress!");
+				current_mode = MODE_IDLE;
+				enable_gui_buttons();
+				break;
+			}
+			console.log("Voltage set to " + (bytes[2] + bytes[3]*256) + "mV, DAC value is " + (bytes[4] + bytes[5]*256) + ", settled in " + (bytes[6] + bytes[7]*256 + bytes[8]*65536 + bytes[9]*16777216) + "us")
 			// Here are the following actions depending on the mode we want
 			if(current_mode == MODE_CUR_MES_REQ)
 			{
@@ -688,7 +1141,7 @@ function onDataReceived(reportId, data)
 			else if(current_mode == MODE_CUR_CARAC_REQ)
 			{
 				// Next step: start current measurement mode
-				sendRequest(CMD_CUR_MES_MODE, [current_ampl, current_avg]);
+				sendRequest(CMD_CUR_MES_MODE, [current_ampl, current_avg, current_carac_tolerance & 0xFF, current_carac_tolerance >> 8]);
 			}
 			else if(current_mode == MODE_CUR_CALIB_REQ)
 			{
@@ -718,13 +1171,21 @@ function onDataReceived(reportId, data)
 			else if(current_mode == MODE_CUR_CARAC)
 			{
 				// Vbias update, ask for next sample
-				sendRequest(CMD_CUR_MES_MODE, [current_ampl, current_avg]);	
+				sendRequest(CMD_CUR_MES_MODE, [current_ampl, current_avg, current_carac_tolerance & 0xFF, current_carac_tolerance >> 8]);	
 			}
 			break;
 		}
 		
 		case CMD_DISABLE_VBIAS:
 		{
+			if(len == 1)
+			{
+				// Refused: another voltage change is in progress
+				console.log("Couldn't disable voltage, another change is in progress!");
+				current_mode = MODE_IDLE;
+				enable_gui_buttons();
+				break;
+			}
 			console.log("Vbias Disabled")
 			// Here are the following actions depending on the mode we want
 			if(current_mode == MODE_CUR_MES_REQ)
@@ -804,6 +1265,15 @@ function onDataReceived(reportId, data)
 			}
 			else
 			{	
+				// New measurement: new stream and window indexes
+				cap_stream_context = null;
+				cap_stream_last_window = null;
+				cap_last_window_index = null;
+				cap_nb_lost_windows = 0;
+				cap_raw_edges = [];
+				cap_last_edge_block_seq = null;
+				cap_nb_lost_edge_blocks = 0;
+				
 				if(current_mode == MODE_CAP_MES_REQ)
 				{
 					ping_enabled = false;
@@ -874,114 +1344,32 @@ function onDataReceived(reportId, data)
 		
 		case CMD_CAP_MES_REPORT:
 		{
-			// Parse answer
-			var counter_divider = (msg[1]<<8) + msg[0];
-			var aggregate_fall = (msg[5]<<8) + (msg[4]<<16) + (msg[3]<<8) + msg[2];
-			var counter_val = (msg[9]<<8) + (msg[8]<<16) + (msg[7]<<8) + msg[6];
-			var report_freq = msg[10];
-			var resistor_val = 2 * ((msg[12]<<8) + msg[11]);
-			var second_threshold = (msg[14]<<8) + msg[13];
-			var first_threshold = (msg[16]<<8) + msg[15];
-			var aggregate_rise = (msg[20]<<8) + (msg[19]<<16) + (msg[18]<<8) + msg[17];
-			var counter_rise = (msg[24]<<8) + (msg[23]<<16) + (msg[22]<<8) + msg[21];
-			var counter_fall = (msg[28]<<8) + (msg[27]<<16) + (msg[26]<<8) + msg[25];
-			var osc_lowvoltagemv = ((msg[30]<<8) + msg[29])*1.24/4.095;
-			
-			//console.log("Capacitance report - counter_divider: " + counter_divider + " aggregate_fall: " + aggregate_fall +  " aggregate_rise: " + aggregate_rise + " counter_val: " + counter_val + " report freq: " + report_freq + "Hz resistor: " + resistor_val + "Ohms second threshold: " + second_threshold + " first threshold: " + first_threshold);
-			// C =  - counter divider * aggregate / 32M * counter * 2 * half_r * ln(Vt2/Vt1)
-			var capacitance = 0;
-			
-			// If capacitance calibration has been done, remove offset
-			if(capmeter.app.cap_offset != null)
-			{
-				capacitance = -1*((counter_divider * aggregate_fall) / (32000000 * counter_val * resistor_val * Math.log(second_threshold/first_threshold))) - capmeter.app.cap_offset;				
-			}
-			else
-			{
-				capacitance = -1*((counter_divider * aggregate_fall) / (32000000 * counter_val * resistor_val * Math.log(second_threshold/first_threshold)));				
-			}
-			
-			// Don't allow negative capacitances
-			if(capacitance < 0)
-			{
-				//capacitance = 0;
-			}
-			
-			// Log
-			//console.log("Measured capacitance: " + capmeter.util.valueToElectronicString(capacitance, "F") + ", osc. freq.: " + counter_val*report_freq  + "Hz (" + resistor_val + "R)");
-			//console.log("Counter: " + counter_val + ", Counter fall: " + counter_fall + ", Counter rise: " + counter_rise);
-			//console.log("Aggregate fall: " + aggregate_fall + ", Aggregate rise: " + aggregate_rise);
-			
-			// ESR calculation			
-			var capacitance_rise = -1*((counter_divider * aggregate_rise) / (32000000 * counter_val * resistor_val * Math.log((3300-(first_threshold*1.24/4.095))/(3300-(second_threshold*1.24/4.095)))));
-			//console.log("Capacitance (rise): " + capmeter.util.valueToElectronicString(capacitance_rise, "F"));
-			var time_rise = (counter_divider*aggregate_rise)/(32000000*counter_rise);
-			//console.log("Rise time: " + capmeter.util.valueToElectronicString(time_rise, "s"));
-			// Vesr = -1 * ( (3.3V - Vthres1) / exp(-t/RC) - 3.3)
-			var esr_voltage = -1*(((3300-(first_threshold*1.24/4.095))/(Math.exp(-(time_rise)/(resistor_val*capacitance)))) - 3300);
-			//console.log("Vesr: " + esr_voltage);
-			// ESR = (Vesr - Vosclow) * R / (3.3-Vosclow)
-			var esr = ((esr_voltage - osc_lowvoltagemv) * resistor_val / (3300 - osc_lowvoltagemv))/1000;
-			//console.log("ESR: " + capmeter.util.valueToElectronicString(esr, "mOhms"));
-						
-			
-			// Store value in our buffer, compute capmeter.util.average and std deviation
-			cap_last_values[(cap_last_value_ind++)%cap_last_values.length] = capacitance;
-			var cap_standard_deviation = capmeter.util.standardDeviation(cap_last_values);
-			current_cap_average = capmeter.util.average(cap_last_values);
-			
-			// If we switched measured value (new values a lot different than the capmeter.util.average)
-			if(capacitance > current_cap_average*1.1 || capacitance < current_cap_average*0.9)
-			{
-				// set all values to last measured value
-				//console.log("New value measured, resetting last values");
-				for (var i = 0; i < cap_last_values.length; i++) cap_last_values[i] = capacitance;
-				current_cap_average = capacitance;
-				cap_last_value_ind = 0;
-			}
-			current_cap_average -=  null_capacitance_offset;
-			capmeter.measurement._capacitance = capmeter.util.valueToElectronicString(current_cap_average, "F") + "(" + capmeter.util.valueToElectronicString(counter_val*report_freq, "Hz") + ")";
-			
-			if(current_mode == MODE_CAP_CARAC)
-			{
-				var action = capmeter.graphing.newCapValueArrival(capacitance);		
-				
-				if(action[0] == "finished")
-				{
-					sendRequest(CMD_CAP_MES_EXIT, null);
-				}
-				else if(action[0] == "change_vbias")
-				{					
-					sendRequest(CMD_SET_VBIAS, [action[1]%256, Math.floor(action[1]/256)]);
-				}
-				else
-				{
-					// We'll receive a new measurement soon
-				}
-			}
-			else if(current_mode == MODE_CAP_CALIB)
+			onCapacitanceReport(decodeCapacitanceReport(msg));
+			break;
+		}
+		
+		case CMD_CAP_MES_BATCH:
+		{
+			// Several reports packed in the same packet
+			var reports = [];
+			for (var i = 0; i + CAP_BATCH_REPORT_SIZE <= len; i += CAP_BATCH_REPORT_SIZE)
 			{
-				// Store value in array
-				cap_calib_array[(cap_calib_array_ind++)%cap_calib_array.length] = capacitance;
-				// Check if we have enough values to compute offset
-				if(cap_calib_array_ind >= cap_calib_array.length)
-				{
-					cap_standard_deviation = capmeter.util.standardDeviation(cap_calib_array);
-					current_cap_average = capmeter.util.average(cap_calib_array);
-					console.log("Standard Deviation: " + capmeter.util.valueToElectronicString(cap_standard_deviation, "F") + ", Average: " + capmeter.util.valueToElectronicString(current_cap_average, "F"));
-					// Only accept if we are within 1%
-					if(current_cap_average * 0.01 > cap_standard_deviation)
-					{
-						// Store offset and exit
-						sendRequest(CMD_CAP_MES_EXIT, null);
-						capmeter.app.cap_offset = current_cap_average - 1e-12;
-						capmeter.app.cap_offset = current_cap_average;
-						console.log("Capacitance Offset To Store: " + capmeter.util.valueToElectronicString(capmeter.app.cap_offset, "F"));
-						$('#calibrateCapacitance').css('background', 'orange');
-					}
-				}
+				reports.push(decodeCapacitanceBatchReport(new Uint8Array(data, 2 + i, CAP_BATCH_REPORT_SIZE)));
 			}
-			
+			onCapacitanceReports(reports);
+			break;
+		}
+		
+		case CMD_CAP_MES_STREAM:
+		{
+			// Several windows in a compact format
+			onCapacitanceReports(decodeCapacitanceStream(msg, len));
+			break;
+		}
+		
+		case CMD_CAP_RAW_EDGES:
+		{
+			onRawEdges(decodeRawEdges(msg));
 			break;
 		}
 		
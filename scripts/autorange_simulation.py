@@ -0,0 +1,177 @@
+# Autoranging simulation: number of measurement windows before the first valid reading in the final range
+# Compares the step by step autoranging (previous firmware) with the single jump one (compute_measurement_range() in
+# source_code/measurement.c) for capacitances from 1pF to 10uF, starting from the 100K resistor as the firmware does
+# Usage: python autorange_simulation.py [report freq bit shift]
+from __future__ import print_function
+import math
+import sys
+
+# Firmware constants
+RESISTORS                       = [470, 1000, 10000, 100000]
+RES_VALUES_DIV5                 = [47, 100, 1000, 10000]
+DIVIDER_BIT_SHIFTS              = [0, 0, 1, 2, 3, 6]
+DIV1, DIV64                     = 1, 5
+DEFAULT_RES_INDEX               = 3
+MIN_OSC_FREQUENCY               = 800
+NB_CONSEQ_FREQ_PB_CHG_RES       = 1
+NB_CONSEQ_TC_ERR_FLAG_CHG_RES   = 3
+# Oscillator model: the fall and rise pulses last R*(C+Cpar)*ln(thresholds ratio) plus a fixed comparator delay
+PARASITIC_CAPACITANCE           = 20e-12
+THRESHOLDS_LN_RATIO             = math.log(2)
+COMPARATOR_DELAY                = 200e-9
+NB_SIMULATED_WINDOWS            = 200
+
+def scale_to_resistor(value, from_index, to_index):
+	if value > 0xFFFFFFFF // RES_VALUES_DIV5[to_index]:
+		return 0xFFFFFFFF
+	return value * RES_VALUES_DIV5[to_index] // RES_VALUES_DIV5[from_index]
+
+class Oscillator(object):
+	def __init__(self, capacitance, bit_shift):
+		self.capacitance = capacitance
+		self.bit_shift = bit_shift
+
+	def window(self, res_index, divider):
+		# Returns the counter value, aggregate fall, counter fall and overflow flag for one gate window
+		pulse_width = RESISTORS[res_index] * (self.capacitance + PARASITIC_CAPACITANCE) * THRESHOLDS_LN_RATIO + COMPARATOR_DELAY
+		counter_value = int((1.0 / (1 << self.bit_shift)) / (2 * pulse_width))
+		pulse_width_ticks = int(pulse_width * 32000000) >> DIVIDER_BIT_SHIFTS[divider]
+		overflow = pulse_width_ticks >= 0x10000 or counter_value == 0
+		return counter_value, pulse_width_ticks * counter_value, counter_value, overflow
+
+class StepAutorange(object):
+	# Previous firmware: one divider or resistor step per window
+	def __init__(self, bit_shift):
+		self.bit_shift = bit_shift
+		self.res_index, self.divider = DEFAULT_RES_INDEX, DIV1
+		self.nb_conseq_freq_pb, self.consec_tc_error_flags = 0, 0
+
+	def set_range(self, res_index, divider):
+		self.res_index, self.divider = res_index, divider
+		return True
+
+	def on_error(self, window):
+		if self.divider < DIV64:
+			return self.set_range(self.res_index, self.divider + 1)
+		elif self.res_index > 0:
+			return self.set_range(self.res_index - 1, DIV1)
+		else:
+			self.consec_tc_error_flags += 1
+			if self.consec_tc_error_flags > NB_CONSEQ_TC_ERR_FLAG_CHG_RES + 1:
+				return self.set_range(self.res_index + 2, DIV1)
+		return False
+
+	def on_window(self, window):
+		counter_value, aggregate_fall, counter_fall, overflow = window
+		osc_freq = counter_value << self.bit_shift
+		hypothetical_new_freq_div = 2 if self.res_index == 0 else 10
+		if osc_freq > MIN_OSC_FREQUENCY * hypothetical_new_freq_div * 2:
+			self.nb_conseq_freq_pb += 1
+			if self.nb_conseq_freq_pb > NB_CONSEQ_FREQ_PB_CHG_RES + 1:
+				self.nb_conseq_freq_pb = 0
+				if self.res_index < len(RESISTORS) - 1:
+					return self.set_range(self.res_index + 1, DIV1)
+		elif aggregate_fall < (counter_fall << 7) and self.divider > DIV1:
+			return self.set_range(self.res_index, self.divider - 1)
+		elif osc_freq < MIN_OSC_FREQUENCY:
+			self.nb_conseq_freq_pb += 1
+			if self.nb_conseq_freq_pb > NB_CONSEQ_FREQ_PB_CHG_RES + 1:
+				self.nb_conseq_freq_pb = 0
+				if self.res_index > 0:
+					return self.set_range(self.res_index - 1, DIV1)
+		else:
+			self.nb_conseq_freq_pb = 0
+		return False
+
+class JumpAutorange(StepAutorange):
+	# Current firmware: jump to the ideal range
+	def __init__(self, bit_shift):
+		StepAutorange.__init__(self, bit_shift)
+		self.counter_divider_estimated = False
+
+	def compute_range(self, window, pulse_width_valid):
+		counter_value, aggregate_fall, counter_fall, overflow = window
+		osc_freq = counter_value << self.bit_shift
+		if pulse_width_valid and counter_fall != 0:
+			pulse_width = (aggregate_fall // counter_fall) << DIVIDER_BIT_SHIFTS[self.divider]
+		elif counter_value != 0:
+			pulse_width = (32000000 >> self.bit_shift) // counter_value
+		else:
+			pulse_width = 0xFFFFFFFF
+		for res_index in reversed(range(len(RESISTORS))):
+			scaled_pulse_width = scale_to_resistor(pulse_width, self.res_index, res_index)
+			divider = DIV1
+			while divider < DIV64 and (scaled_pulse_width >> DIVIDER_BIT_SHIFTS[divider]) >= 0x8000:
+				divider += 1
+			if res_index == 0 or (scale_to_resistor(osc_freq, res_index, self.res_index) >= MIN_OSC_FREQUENCY * 2 and (scaled_pulse_width >> DIVIDER_BIT_SHIFTS[divider]) < 0x8000):
+				return res_index, divider
+
+	def on_error(self, window):
+		res_index, divider = self.compute_range(window, False)
+		if (res_index, divider) != (self.res_index, self.divider):
+			self.counter_divider_estimated = True
+			return self.set_range(res_index, divider)
+		elif self.res_index == 0:
+			self.consec_tc_error_flags += 1
+			if self.consec_tc_error_flags > NB_CONSEQ_TC_ERR_FLAG_CHG_RES + 1:
+				return self.set_range(self.res_index + 2, DIV1)
+		return False
+
+	def on_window(self, window):
+		counter_value, aggregate_fall, counter_fall, overflow = window
+		osc_freq = counter_value << self.bit_shift
+		change_range = False
+		if (aggregate_fall < (counter_fall << 7) or self.counter_divider_estimated) and self.divider > DIV1:
+			change_range = True
+		elif (osc_freq < MIN_OSC_FREQUENCY and self.res_index > 0) or (self.res_index < len(RESISTORS) - 1 and scale_to_resistor(osc_freq, self.res_index + 1, self.res_index) > MIN_OSC_FREQUENCY * 2):
+			self.nb_conseq_freq_pb += 1
+			if self.nb_conseq_freq_pb > NB_CONSEQ_FREQ_PB_CHG_RES + 1:
+				change_range = True
+				self.nb_conseq_freq_pb = 0
+		else:
+			self.nb_conseq_freq_pb = 0
+		self.counter_divider_estimated = False
+		if change_range:
+			res_index, divider = self.compute_range(window, True)
+			if (res_index, divider) != (self.res_index, self.divider):
+				return self.set_range(res_index, divider)
+		return False
+
+def windows_to_first_valid_reading(autorange, oscillator):
+	# Mirrors the gate interrupt: discarded windows, overflow handling, then the main loop logic on valid windows
+	discard_next_mes_cnt = 2
+	valid_windows = []
+	last_change = -1
+	for window_nb in range(NB_SIMULATED_WINDOWS):
+		window = oscillator.window(autorange.res_index, autorange.divider)
+		if discard_next_mes_cnt > 0:
+			discard_next_mes_cnt -= 1
+		elif window[3]:
+			if autorange.on_error(window):
+				discard_next_mes_cnt = 1
+				last_change = window_nb
+		else:
+			valid_windows.append(window_nb)
+			if autorange.on_window(window):
+				discard_next_mes_cnt = 1
+				last_change = window_nb
+	# First valid window once the range settled
+	settled = [w for w in valid_windows if w > last_change]
+	if len(settled) == 0 or last_change >= NB_SIMULATED_WINDOWS - 10:
+		return None, autorange
+	return settled[0] + 1, autorange
+
+if __name__ == '__main__':
+	bit_shift = int(sys.argv[1]) if len(sys.argv) > 1 else 3
+	print("Report frequency: %dHz, windows (seconds) to the first valid reading in the final range" % (1 << bit_shift))
+	print("%10s  %26s  %26s" % ("C", "step by step", "single jump"))
+	capacitances = [mantissa * math.pow(10, decade) for decade in range(-12, -5) for mantissa in [1, 2.2, 4.7]] + [10e-6]
+	for capacitance in capacitances:
+		results = []
+		for autorange_class in [StepAutorange, JumpAutorange]:
+			nb_windows, autorange = windows_to_first_valid_reading(autorange_class(bit_shift), Oscillator(capacitance, bit_shift))
+			if nb_windows is None:
+				results.append("not settled")
+			else:
+				results.append("%3d (%6.3fs) %6dR /%-4d" % (nb_windows, float(nb_windows) / (1 << bit_shift), RESISTORS[autorange.res_index], 1 << DIVIDER_BIT_SHIFTS[autorange.divider]))
+		print("%10s  %26s  %26s" % ("%.3gF" % capacitance, results[0], results[1]))
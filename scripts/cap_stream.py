@@ -0,0 +1,204 @@
+# Reference encoder / decoder for the capacitance report stream format (CMD_CAP_MES_STREAM)
+# Mirrors stream_capacitance_report() in source_code/cap_report.c
+# Run it to check that randomly generated windows survive an encode/decode round trip, with and without dropped packets
+# Run it with "vectors" to check the encoder and decoder against the firmware encoder output in cap_stream_vectors.txt
+import binascii
+import os
+import random
+import struct
+import sys
+
+PAYLOAD_SIZE            = 62
+STREAM_TAG_CONTEXT      = 0x01
+STREAM_TAG_WINDOW       = 0x02
+# counter_divider, report_freq, half_res, second_thres, first_thres, vosc_low
+CONTEXT_FORMAT          = "<HBHHHH"
+CONTEXT_LENGTH          = struct.calcsize(CONTEXT_FORMAT)
+# counter_value, aggregate_fall, aggregate_rise, counter_rise, counter_fall, window_index, timestamp
+NB_WINDOW_FIELDS        = 7
+MAX_WINDOW_LENGTH       = 1 + 5*NB_WINDOW_FIELDS
+
+def window_increments(context):
+	# Expected increments between two windows: window index increments by one, timestamp by the gate length in 32MHz ticks
+	return [0, 0, 0, 0, 0, 1, 32000000 >> context[1]]
+
+def encode_varint(value):
+	encoded = bytearray()
+	while value >= 0x80:
+		encoded.append((value & 0x7F) | 0x80)
+		value >>= 7
+	encoded.append(value)
+	return encoded
+
+def decode_varint(data, index):
+	value = 0
+	shift = 0
+	while True:
+		byte = data[index]
+		index += 1
+		value |= (byte & 0x7F) << shift
+		shift += 7
+		if byte & 0x80 == 0:
+			return value, index
+
+def zigzag_encode(delta):
+	delta &= 0xFFFFFFFF
+	sign = 0xFFFFFFFF if delta & 0x80000000 else 0
+	return ((delta << 1) & 0xFFFFFFFF) ^ sign
+
+def zigzag_decode(value):
+	return ((value >> 1) ^ -(value & 1)) & 0xFFFFFFFF
+
+def encode_window(window, previous_window, increments):
+	record = bytearray([STREAM_TAG_WINDOW])
+	for i in range(NB_WINDOW_FIELDS):
+		delta = window[i]
+		if previous_window is not None:
+			delta -= previous_window[i] + increments[i]
+		record += encode_varint(zigzag_encode(delta))
+	return record
+
+class StreamEncoder:
+	def __init__(self, drop_probability=0):
+		self.packets = []
+		self.packet = bytearray()
+		self.packet_reports = []
+		self.sent_reports = []
+		self.context = None
+		self.last_window = None
+		self.drop_probability = drop_probability
+
+	def send_packet(self):
+		# Simulate a full firmware queue
+		if random.random() < self.drop_probability:
+			self.context = None
+		else:
+			self.packets.append(bytes(self.packet))
+			self.sent_reports += self.packet_reports
+		self.packet = bytearray()
+		self.packet_reports = []
+
+	def append_context(self, context):
+		if len(self.packet) + 1 + CONTEXT_LENGTH > PAYLOAD_SIZE:
+			self.send_packet()
+		self.packet += bytearray([STREAM_TAG_CONTEXT]) + bytearray(struct.pack(CONTEXT_FORMAT, *context))
+		self.context = context
+		self.last_window = None
+
+	def add_report(self, context, window):
+		if context != self.context:
+			self.append_context(context)
+		increments = window_increments(context)
+		record = encode_window(window, self.last_window, increments)
+		if len(self.packet) + len(record) > PAYLOAD_SIZE:
+			self.send_packet()
+			# Dropped packet: the host lost our previous window
+			if self.context is None:
+				self.append_context(context)
+				record = encode_window(window, None, increments)
+		self.packet += record
+		self.packet_reports.append((context, tuple(window)))
+		self.last_window = list(window)
+		if len(self.packet) + len(record) > PAYLOAD_SIZE:
+			self.send_packet()
+
+class StreamDecoder:
+	def __init__(self):
+		self.context = None
+		self.last_window = None
+
+	def decode_packet(self, payload):
+		"""Returns a list of (context, window) tuples"""
+		reports = []
+		index = 0
+		while index < len(payload):
+			tag = payload[index]
+			index += 1
+			if tag == STREAM_TAG_CONTEXT:
+				self.context = struct.unpack(CONTEXT_FORMAT, bytes(payload[index:index+CONTEXT_LENGTH]))
+				self.last_window = None
+				index += CONTEXT_LENGTH
+			elif tag == STREAM_TAG_WINDOW:
+				window = []
+				increments = window_increments(self.context)
+				for i in range(NB_WINDOW_FIELDS):
+					value, index = decode_varint(payload, index)
+					base = self.last_window[i] + increments[i] if self.last_window is not None else 0
+					window.append((base + zigzag_decode(value)) & 0xFFFFFFFF)
+				self.last_window = window
+				reports.append((self.context, tuple(window)))
+			else:
+				raise ValueError("Unknown stream tag " + hex(tag))
+		return reports
+
+def random_reports(nb_reports):
+	reports = []
+	context = (1, 7, 50000, 2400, 1200, 400)
+	counter = 780
+	window_index = 0
+	timestamp = 0
+	for i in range(nb_reports):
+		# Range switch every now and then, the window after it is discarded
+		timestamp += 32000000 >> context[1]
+		if random.randint(0, 200) == 0:
+			context = (random.choice([1, 2, 4, 8, 64]), random.randint(0, 10), random.choice([235, 500, 5000, 50000]), 2400, 1200, 400)
+			counter = random.randint(100, 60000)
+			timestamp += 32000000 >> context[1]
+		# Lost window every now and then
+		window_index = (window_index + random.choice([1]*50 + [2])) & 0xFFFF
+		timestamp &= 0xFFFFFFFF
+		counter = max(0, counter + random.randint(-2, 2))
+		counter_fall = max(0, counter + random.randint(-1, 1))
+		counter_rise = max(0, counter + random.randint(-1, 1))
+		aggregate_fall = counter_fall * 1000 + random.randint(0, 4000)
+		aggregate_rise = counter_rise * 1100 + random.randint(0, 4000)
+		reports.append((context, (counter, aggregate_fall, aggregate_rise, counter_rise, counter_fall, window_index, timestamp)))
+	# Corner cases: wrap arounds and maximum values
+	reports.append((context, (0xFFFFFFFF, 0, 0xFFFFFFFF, 0x80000000, 0x7FFFFFFF, 0xFFFF, 0xFFFFFFFF)))
+	reports.append((context, (0, 0xFFFFFFFF, 0, 0x7FFFFFFF, 0x80000000, 0, 0)))
+	return reports
+
+def check_vectors(path):
+	reports = []
+	packets = []
+	for line in open(path):
+		fields = line.split()
+		if len(fields) == 0 or fields[0] == "#":
+			continue
+		if fields[0] == "R":
+			values = tuple(int(value) for value in fields[1:])
+			reports.append((values[:6], values[6:]))
+		elif fields[0] == "P":
+			packets.append(bytes(binascii.unhexlify(fields[1])))
+	encoder = StreamEncoder()
+	for context, window in reports:
+		encoder.add_report(context, window)
+	if len(encoder.packet) > 0:
+		encoder.send_packet()
+	assert encoder.packets == packets, "Encoder output differs from the firmware one"
+	decoder = StreamDecoder()
+	decoded = []
+	for packet in packets:
+		decoded += decoder.decode_packet(bytearray(packet))
+	assert decoded == reports, "Firmware packets don't decode to the original reports"
+	print("%d windows in %d packets match the firmware encoder output" % (len(reports), len(packets)))
+
+if __name__ == '__main__':
+	if len(sys.argv) > 1 and sys.argv[1] == "vectors":
+		check_vectors(os.path.join(os.path.dirname(os.path.abspath(__file__)), "cap_stream_vectors.txt"))
+		sys.exit(0)
+	random.seed(int(sys.argv[1]) if len(sys.argv) > 1 else 0)
+	reports = random_reports(10000)
+	for drop_probability in [0, 0.05]:
+		encoder = StreamEncoder(drop_probability)
+		for context, window in reports:
+			encoder.add_report(context, window)
+		if len(encoder.packet) > 0:
+			encoder.send_packet()
+		decoder = StreamDecoder()
+		decoded = []
+		for packet in encoder.packets:
+			assert len(packet) <= PAYLOAD_SIZE
+			decoded += decoder.decode_packet(bytearray(packet))
+		assert decoded == encoder.sent_reports, "Round trip mismatch"
+		print("%d%% dropped packets: %d windows in %d packets, %.2f windows per packet" % (drop_probability * 100, len(decoded), len(encoder.packets), float(len(decoded)) / len(encoder.packets)))
@@ -0,0 +1,57 @@
+# Current soak test logger: streams timestamped current readings (command 0x19) to current_stream.csv
+# Raw averaged ADC values are logged, convert them with the current calibration of the capmeter
+# Usage: python current_stream_logger.py [ampl bit shift] [averaging bit shift] [rate bit shift] [duration in seconds]
+from hid_comms import *
+import struct
+import csv
+
+CMD_CUR_MES_MODE_EXIT   = 0x09
+CMD_CUR_MES_STREAM      = 0x19
+CUR_STREAM_HEADER_LEN   = 3
+# timestamp, value
+CUR_REPORT_FORMAT       = "<IH"
+CUR_REPORT_LENGTH       = struct.calcsize(CUR_REPORT_FORMAT)
+TIMESTAMP_FREQ          = 32768
+
+if __name__ == '__main__':
+	ampl = int(sys.argv[1]) if len(sys.argv) > 1 else 0
+	avg_bit_shift = int(sys.argv[2]) if len(sys.argv) > 2 else 8
+	rate_bit_shift = int(sys.argv[3]) if len(sys.argv) > 3 else 4
+	duration = int(sys.argv[4]) if len(sys.argv) > 4 else 60
+
+	hid_device, intf, epin, epout = findHIDDevice(USB_VID, USB_PID, True)
+	if hid_device is None:
+		sys.exit(0)
+
+	sendHidPacket(epout, CMD_CUR_MES_STREAM, 3, [ampl, avg_bit_shift, rate_bit_shift])
+	answer = receiveHidPacket(epin)
+	while answer[CMD_INDEX] != CMD_CUR_MES_STREAM or answer[LEN_INDEX] != 1:
+		answer = receiveHidPacket(epin)
+	if answer[DATA_INDEX] == 0:
+		sys.exit("Couldn't start current stream")
+
+	# Timestamps wrap around every 36 hours, unwrap them
+	last_sequence, nb_lost_packets, nb_readings = None, 0, 0
+	last_timestamp, timestamp_offset = 0, 0
+	with open("current_stream.csv", "w") as csv_file:
+		csv_writer = csv.writer(csv_file)
+		csv_writer.writerow(["time (s)", "adc value", "ampl bit shift", "averaging bit shift"])
+		while float(last_timestamp + timestamp_offset) / TIMESTAMP_FREQ < duration:
+			packet = receiveHidPacket(epin)
+			if packet[CMD_INDEX] != CMD_CUR_MES_STREAM or packet[LEN_INDEX] < CUR_STREAM_HEADER_LEN:
+				continue
+			sequence, packet_ampl, packet_avg = packet[DATA_INDEX], packet[DATA_INDEX+1], packet[DATA_INDEX+2]
+			if last_sequence is not None and sequence != (last_sequence + 1) & 0xFF:
+				nb_lost_packets += (sequence - last_sequence - 1) & 0xFF
+			last_sequence = sequence
+			for offset in range(DATA_INDEX + CUR_STREAM_HEADER_LEN, DATA_INDEX + packet[LEN_INDEX], CUR_REPORT_LENGTH):
+				timestamp, value = struct.unpack(CUR_REPORT_FORMAT, bytearray(packet[offset:offset+CUR_REPORT_LENGTH]))
+				if timestamp < last_timestamp:
+					timestamp_offset += 1 << 32
+				last_timestamp = timestamp
+				csv_writer.writerow(["%.6f" % (float(timestamp + timestamp_offset) / TIMESTAMP_FREQ), value, packet_ampl, packet_avg])
+				nb_readings += 1
+
+	sendHidPacket(epout, CMD_CUR_MES_MODE_EXIT, 0, None)
+	hid_device.reset()
+	print("%d readings logged, %d packets lost" % (nb_readings, nb_lost_packets))
@@ -0,0 +1,74 @@
+# Pulse width capture benchmark
+# Each oscillation gives one fall and one rise pulse width capture while TCC1 counts the oscillations in hardware:
+# comparing both tells how many captures the firmware missed, and at which edge rate it starts missing them.
+# Run it with different capacitors / report frequencies on each firmware to compare (e.g. capture ISR vs DMA),
+# results are appended to edge_rate_benchmark.csv with the given label.
+# Usage: python edge_rate_benchmark.py <label> [report freq bit shift] [number of windows]
+from hid_comms import *
+import struct
+import csv
+
+CMD_CAP_REPORT_FREQ     = 0x0A
+CMD_CAP_MES_START       = 0x0B
+CMD_CAP_MES_REPORT      = 0x0C
+CMD_CAP_MES_EXIT        = 0x0D
+CMD_CAP_REPORT_MODE     = 0x12
+# counter_divider, aggregate_fall, counter_value, report_freq, half_res, second_thres, first_thres, aggregate_rise, counter_rise, counter_fall, vosc_low, window_index, timestamp
+CAP_REPORT_FORMAT       = "<HIIBHHHIIIHHI"
+CAP_REPORT_LENGTH       = struct.calcsize(CAP_REPORT_FORMAT)
+# Ratio of captured edges above which we consider no capture was missed
+MIN_CAPTURE_RATIO       = 0.999
+
+def sendCommand(epin, epout, cmd, data):
+	sendHidPacket(epout, cmd, len(data), data)
+	answer = receiveHidPacket(epin)
+	while answer[CMD_INDEX] != cmd:
+		answer = receiveHidPacket(epin)
+	return answer
+
+if __name__ == '__main__':
+	label = sys.argv[1] if len(sys.argv) > 1 else "unknown"
+	report_freq = int(sys.argv[2]) if len(sys.argv) > 2 else 3
+	nb_windows = int(sys.argv[3]) if len(sys.argv) > 3 else 64
+
+	hid_device, intf, epin, epout = findHIDDevice(USB_VID, USB_PID, True)
+	if hid_device is None:
+		sys.exit(0)
+
+	# One report per packet, then start measuring
+	if sendCommand(epin, epout, CMD_CAP_REPORT_FREQ, [report_freq])[DATA_INDEX] == 0:
+		sys.exit("Couldn't set report frequency")
+	if sendCommand(epin, epout, CMD_CAP_REPORT_MODE, [0])[DATA_INDEX] == 0:
+		sys.exit("Couldn't set report mode")
+	if sendCommand(epin, epout, CMD_CAP_MES_START, [])[DATA_INDEX] == 0:
+		sys.exit("Couldn't start capacitance measurement")
+
+	results = []
+	while len(results) < nb_windows:
+		packet = receiveHidPacket(epin)
+		if packet[CMD_INDEX] != CMD_CAP_MES_REPORT:
+			continue
+		report = struct.unpack(CAP_REPORT_FORMAT, bytearray(packet[DATA_INDEX:DATA_INDEX+CAP_REPORT_LENGTH]))
+		counter_value, half_res, counter_rise, counter_fall = report[2], report[4], report[8], report[9]
+		expected_edges = 2 * counter_value
+		if expected_edges == 0:
+			continue
+		edge_rate = expected_edges << report_freq
+		capture_ratio = float(counter_rise + counter_fall) / expected_edges
+		results.append([label, 2*half_res, report_freq, edge_rate, counter_rise + counter_fall, expected_edges, capture_ratio])
+		print("%dR, %d edges/s: %d/%d edges captured (%.2f%%)" % (2*half_res, edge_rate, counter_rise + counter_fall, expected_edges, capture_ratio*100))
+
+	sendCommand(epin, epout, CMD_CAP_MES_EXIT, [])
+	hid_device.reset()
+
+	# Highest edge rate at which we didn't miss captures, lowest one at which we did
+	complete = [r[3] for r in results if r[6] >= MIN_CAPTURE_RATIO]
+	missed = [r[3] for r in results if r[6] < MIN_CAPTURE_RATIO]
+	print("")
+	print(label + ": max edge rate without missed captures: " + (str(max(complete)) + " edges/s" if complete else "none"))
+	print(label + ": min edge rate with missed captures: " + (str(min(missed)) + " edges/s" if missed else "none"))
+
+	with open("edge_rate_benchmark.csv", "a", newline="") as csv_file:
+		csv_writer = csv.writer(csv_file)
+		for result in results:
+			csv_writer.writerow(result)
@@ -19,7 +19,7 @@ USB_PID                 = 0xdddd
 LEN_INDEX               = 0x00
 CMD_INDEX               = 0x01
 DATA_INDEX              = 0x02
-CMD_PING		= 0x05
+CMD_PING		= 0x01
 
 		
 def receiveHidPacket(epin):
@@ -0,0 +1,74 @@
+# Reciprocal counting resolution model
+# Gated counting counts whole oscillations during the gate: +-1 count, i.e. 1/(f*T) relative resolution.
+# Reciprocal counting (MES_OPT_RECIPROCAL in source_code/measurement.c) counts the oscillations between the first edges
+# following two gates and timestamps these edges at 32MHz: +-1 tick, i.e. 1/(32M*T), a 32M/f improvement.
+# The Monte Carlo part replays the firmware arithmetic (edge offset after the gate, 16-bit TCD0 edge delay) with random phases.
+# TCD0 wraps every 2.048ms: below RECIPROCAL_MIN_OSC_FREQUENCY the firmware doesn't timestamp edges and counts with the gate.
+# Usage: python reciprocal_resolution.py [report freq bit shift]
+from __future__ import print_function
+import random
+import math
+import sys
+
+# Firmware constants
+RESISTORS                       = [470, 1000, 10000, 100000]
+TIMESTAMP_FREQ                  = 32000000
+TIMESTAMP_SPAN                  = 0x10000
+RECIPROCAL_MIN_OSC_FREQUENCY    = 1024
+# Oscillator model, same as autorange_simulation.py
+PARASITIC_CAPACITANCE           = 20e-12
+THRESHOLDS_LN_RATIO             = math.log(2)
+COMPARATOR_DELAY                = 200e-9
+NB_SIMULATED_WINDOWS            = 2000
+# Typical capacitances measured on each resistor
+TYPICAL_CAPACITANCES            = [(3, 10e-12), (3, 1e-9), (2, 10e-9), (1, 100e-9), (0, 1e-6), (0, 3e-6), (0, 10e-6)]
+
+def oscillator_frequency(res_index, capacitance):
+	return 1.0 / (2 * (RESISTORS[res_index] * (capacitance + PARASITIC_CAPACITANCE) * THRESHOLDS_LN_RATIO + COMPARATOR_DELAY))
+
+def simulate(frequency, gate_length):
+	# Returns the worst relative errors of the gated and reciprocal frequency estimates
+	period = 1.0 / frequency
+	phase = random.random() * period
+	gated_error, reciprocal_error = 0.0, 0.0
+	last_gate_count, last_edge_offset, last_edge_timestamp, last_armed = None, 0, None, False
+	for window_nb in range(1, NB_SIMULATED_WINDOWS):
+		gate_time = window_nb * gate_length
+		# TCC1 value at the gate: edges before the gate
+		gate_count = int(math.floor((gate_time - phase) / period)) + 1
+		# Edge following the gate: number of edges from the gate (arm_edge_timestamp()) and 16-bit TCD0 delay
+		# Only armed when the window frequency guarantees the edge comes within the TCD0 span
+		edge_time = phase + gate_count * period
+		armed = last_gate_count is not None and (gate_count - last_gate_count) / gate_length >= RECIPROCAL_MIN_OSC_FREQUENCY
+		if armed:
+			edge_offset = 1
+			edge_delay = (int(edge_time * TIMESTAMP_FREQ) - int(gate_time * TIMESTAMP_FREQ)) % TIMESTAMP_SPAN
+		else:
+			edge_offset = 0
+			edge_delay = 0
+		edge_timestamp = int(gate_time * TIMESTAMP_FREQ) + edge_delay
+		# Oscillations slower than the gate give empty windows, which the firmware discards, as the first windows
+		if last_gate_count is not None and gate_count != last_gate_count and armed == last_armed:
+			counter_value = gate_count - last_gate_count
+			gated_error = max(gated_error, abs(counter_value / gate_length - frequency) / frequency)
+			reciprocal_count = counter_value + edge_offset - last_edge_offset
+			reciprocal_freq = float(reciprocal_count) * TIMESTAMP_FREQ / (edge_timestamp - last_edge_timestamp)
+			reciprocal_error = max(reciprocal_error, abs(reciprocal_freq - frequency) / frequency)
+		last_gate_count, last_edge_offset, last_edge_timestamp, last_armed = gate_count, edge_offset, edge_timestamp, armed
+	return gated_error, reciprocal_error
+
+if __name__ == '__main__':
+	bit_shift = int(sys.argv[1]) if len(sys.argv) > 1 else 3
+	gate_length = 1.0 / (1 << bit_shift)
+	print("Report frequency: %dHz, relative resolution (model / simulated worst case)" % (1 << bit_shift))
+	print("Reciprocal counting reaches 1ppm with a %.3fs gate, above %dHz (TCD0 span)" % (1e6 / TIMESTAMP_FREQ, RECIPROCAL_MIN_OSC_FREQUENCY))
+	print("%8s %10s %12s %24s %24s %10s %14s" % ("R", "C", "f", "gated counting", "reciprocal", "gain", "gated for 1ppm"))
+	for res_index, capacitance in TYPICAL_CAPACITANCES:
+		frequency = oscillator_frequency(res_index, capacitance)
+		gated_error, reciprocal_error = simulate(frequency, gate_length)
+		gated_model = 1.0 / (frequency * gate_length)
+		reciprocal_model = 1.0 / (TIMESTAMP_FREQ * gate_length)
+		if frequency < RECIPROCAL_MIN_OSC_FREQUENCY:
+			# The edge timestamp could wrap, the firmware counts with the gate
+			reciprocal_model = gated_model
+		print("%7dR %10s %11.1fHz %11.2eppm/%-10.2e %11.2eppm/%-10.2e %10.0f %13.3fs" % (RESISTORS[res_index], "%.3gF" % capacitance, frequency, gated_model * 1e6, gated_error * 1e6, reciprocal_model * 1e6, reciprocal_error * 1e6, gated_model / reciprocal_model, 1e6 / frequency))
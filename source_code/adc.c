@@ -6,6 +6,8 @@
  */
 
 #include <avr/pgmspace.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
 #include <avr/io.h>
 #include <string.h>
 #include <stdio.h>
@@ -16,6 +18,22 @@
 uint8_t current_channel;
 // Current ampl
 uint8_t current_ampl;
+// Interrupt driven accumulation: state, see enum adc_acc_state_t
+volatile uint8_t adc_acc_state = ADC_ACC_DONE;
+// Interrupt driven accumulation: first sample, running sums of the deviations from it
+volatile int16_t adc_acc_first_val;
+volatile int32_t adc_acc_sum_dev;
+volatile uint64_t adc_acc_sum_sq_dev;
+// Interrupt driven accumulation: min & max deviations
+volatile int16_t adc_acc_min_dev;
+volatile int16_t adc_acc_max_dev;
+// Interrupt driven accumulation: number of samples, next power of two to check in bit shift
+volatile uint32_t adc_acc_nb_samples;
+volatile uint8_t adc_acc_bit_shift;
+// Interrupt driven accumulation: maximum number of samples in bit shift, tolerance on the mean, max peak to peak
+uint8_t adc_acc_max_bit_shift;
+uint16_t adc_acc_tolerance;
+uint16_t adc_acc_max_pp;
 
 
 /*
@@ -58,14 +76,16 @@ uint8_t get_configured_adc_ampl(void)
 void configure_adc_channel(uint8_t channel, uint8_t ampl, uint8_t debug)
 {
     current_channel = channel;                                                      // Store current channel
+    abort_adc_accumulation();                                                       // Stop background accumulation
     
-    // Wait for a possible conversion to finish
+    // Wait for a possible conversion to finish, channels 1 to 3 may still run after a sweep accumulation
     if (ADCA.CTRLA & ADC_CH0START_bm)
     {
         while(ADCA.CH0.INTFLAGS == 0);
         ADCA.CH0.INTFLAGS = 1;
         ADCA.CH0RES;
-    }    
+    }
+    while (ADCA.CTRLA & ADC_SWEEP_START_gm);
     
     if (channel == ADC_CHANNEL_COMPOUT)
     {
@@ -190,18 +210,12 @@ void disable_adc_channel(uint8_t channel)
 }
 
 /*
- * Start and wait for an ADC conversion to finish
- * @return the ADC value corrected for offsets
+ * Correct an ADC conversion result for offsets
+ * @param   return_value    The conversion result
+ * @return  the ADC value corrected for offsets
  */
-int16_t start_and_wait_for_adc_conversion(void)
+int16_t correct_adc_value(int16_t return_value)
 {
-    int16_t return_value;
-    
-    while(ADCA.CH0.INTFLAGS == 0);                                                  // Wait for conversion to finish
-    return_value = ADCA.CH0RES;                                                     // Store conversion result
-    ADCA.CH0.INTFLAGS = 1;                                                          // Clear conversion flag
-    ADCA.CTRLA |= ADC_CH0START_bm;                                                  // Start channel 0 conversion
-    
     // Depending on input mode, apply correction
     if (((ADCA.CH0.CTRL & ADC_CH_INPUTMODE_gm) == ADC_CH_INPUTMODE_SINGLEENDED_gc) || ((ADCA.CH0.CTRL & ADC_CH_INPUTMODE_gm) == ADC_CH_INPUTMODE_INTERNAL_gc))
     {
@@ -223,25 +237,216 @@ int16_t start_and_wait_for_adc_conversion(void)
 }
 
 /*
- * Get an averaged ADC value
- * @param   avg_bit_shift   Bit shift for our averaging (1 for 2 samples, 2 for 4, etc etc)
+ * Start and wait for an ADC conversion to finish
+ * @return the ADC value corrected for offsets
+ */
+int16_t start_and_wait_for_adc_conversion(void)
+{
+    int16_t return_value;
+    
+    abort_adc_accumulation();
+    while(ADCA.CH0.INTFLAGS == 0);                                                  // Wait for conversion to finish
+    return_value = ADCA.CH0RES;                                                     // Store conversion result
+    ADCA.CH0.INTFLAGS = 1;                                                          // Clear conversion flag
+    ADCA.CTRLA |= ADC_CH0START_bm;                                                  // Start channel 0 conversion
+    return correct_adc_value(return_value);
+}
+
+/*
+ * Add a sample to the accumulation
+ * @param   dev     The sample, corrected for offsets
+ * @return  TRUE if the accumulation is over
+ */
+uint8_t accumulate_adc_sample(int16_t dev)
+{
+    uint8_t done = FALSE;
+    int64_t variance_n2;
+    
+    // Running sums of the deviations from the first sample, keeps them small
+    if (adc_acc_nb_samples == 0)
+    {
+        adc_acc_first_val = dev;
+    }
+    dev -= adc_acc_first_val;
+    adc_acc_sum_dev += dev;
+    if (adc_acc_tolerance != 0)
+    {
+        adc_acc_sum_sq_dev += (int32_t)dev * dev;
+    }
+    if (dev > adc_acc_max_dev)
+    {
+        adc_acc_max_dev = dev;
+    }
+    else if (dev < adc_acc_min_dev)
+    {
+        adc_acc_min_dev = dev;
+    }
+    adc_acc_nb_samples++;
+    
+    if ((uint16_t)(adc_acc_max_dev - adc_acc_min_dev) > adc_acc_max_pp)
+    {
+        // Too noisy
+        adc_acc_state = ADC_ACC_UNSTABLE;
+        done = TRUE;
+    }
+    else if (adc_acc_nb_samples == (1UL << adc_acc_bit_shift))
+    {
+        // Power of two number of samples: check the confidence interval, 4 * var / n <= tol^2 with var * n^2 = n * sum_sq - sum^2
+        if (adc_acc_bit_shift >= adc_acc_max_bit_shift)
+        {
+            done = TRUE;
+        }
+        else if ((adc_acc_tolerance != 0) && (adc_acc_bit_shift >= EARLY_STOP_MIN_AVG_BIT_SHIFT))
+        {
+            variance_n2 = (int64_t)(adc_acc_sum_sq_dev << adc_acc_bit_shift) - (int64_t)adc_acc_sum_dev * adc_acc_sum_dev;
+            if (((uint64_t)variance_n2 << 2) >> (3 * adc_acc_bit_shift) <= (uint32_t)adc_acc_tolerance * adc_acc_tolerance)
+            {
+                done = TRUE;
+            }
+        }
+        
+        // Next check at twice the samples
+        if (done == FALSE)
+        {
+            adc_acc_bit_shift++;
+        }
+    }
+    
+    if ((done == TRUE) && (adc_acc_state == ADC_ACC_RUNNING))
+    {
+        adc_acc_state = ADC_ACC_DONE;
+    }
+    return done;
+}
+
+/*
+ * ADC channel 0 conversion complete: add the sample to the accumulation
+ */
+ISR(ADCA_CH0_vect)
+{
+    int16_t dev = correct_adc_value(ADCA.CH0RES);
+    
+    // Keep one conversion running, as start_and_wait_for_adc_conversion() expects
+    ADCA.CTRLA |= ADC_CH0START_bm;
+    
+    if (accumulate_adc_sample(dev) == TRUE)
+    {
+        ADCA.CH0.INTCTRL = ADC_CH_INTLVL_OFF_gc;
+    }
+}
+
+/*
+ * ADC channel 3 conversion complete: channels 0 to 3 were started together, add their four samples to the accumulation
+ */
+ISR(ADCA_CH3_vect)
+{
+    int16_t samples[4];
+    
+    // Channels complete in order, collect them all before starting the next sweep
+    samples[0] = ADCA.CH0RES;
+    samples[1] = ADCA.CH1RES;
+    samples[2] = ADCA.CH2RES;
+    samples[3] = ADCA.CH3RES;
+    ADCA.CH0.INTFLAGS = 1;
+    ADCA.CH1.INTFLAGS = 1;
+    ADCA.CH2.INTFLAGS = 1;
+    ADCA.CTRLA |= ADC_SWEEP_START_gm;
+    
+    for (uint8_t i = 0; i < sizeof(samples)/sizeof(samples[0]); i++)
+    {
+        if (accumulate_adc_sample(correct_adc_value(samples[i])) == TRUE)
+        {
+            ADCA.CH3.INTCTRL = ADC_CH_INTLVL_OFF_gc;
+            break;
+        }
+    }
+}
+
+/*
+ * Abort the background accumulation, as it would take the conversions of the blocking functions
+ */
+void abort_adc_accumulation(void)
+{
+    if (adc_acc_state == ADC_ACC_RUNNING)
+    {
+        ADCA.CH0.INTCTRL = ADC_CH_INTLVL_OFF_gc;
+        ADCA.CH3.INTCTRL = ADC_CH_INTLVL_OFF_gc;
+        adc_acc_state = ADC_ACC_ABORTED;
+    }
+}
+
+/*
+ * Start accumulating ADC samples in the background, on the configured channel
+ * Long accumulations start the four ADC channels together on the same input: the pipeline converts them back to back
+ * and one interrupt collects the four samples
+ * @param   max_avg_bit_shift   Number of samples in bit shift, maximum one if a tolerance is given
+ * @param   tolerance           Tolerance on the mean in LSB to stop early, 0 to always take 2^max_avg_bit_shift samples
+ * @param   max_pp              Max peak to peak value we accept, the accumulation stops as unstable above it
+ */
+void start_adc_accumulation(uint8_t max_avg_bit_shift, uint16_t tolerance, uint16_t max_pp)
+{
+    ADCA.CH0.INTCTRL = ADC_CH_INTLVL_OFF_gc;
+    ADCA.CH3.INTCTRL = ADC_CH_INTLVL_OFF_gc;
+    adc_acc_max_bit_shift = max_avg_bit_shift;
+    adc_acc_tolerance = tolerance;
+    adc_acc_max_pp = max_pp;
+    adc_acc_nb_samples = 0;
+    adc_acc_bit_shift = 0;
+    adc_acc_sum_dev = 0;
+    adc_acc_sum_sq_dev = 0;
+    adc_acc_min_dev = 0;
+    adc_acc_max_dev = 0;
+    adc_acc_state = ADC_ACC_RUNNING;
+    
+    if (max_avg_bit_shift >= ADC_SWEEP_MIN_AVG_BIT_SHIFT)
+    {
+        // Channels 1 to 3 convert the same input as channel 0, the running channel 0 conversion is the first sample
+        ADCA.CH1.CTRL = ADCA.CH0.CTRL;
+        ADCA.CH1.MUXCTRL = ADCA.CH0.MUXCTRL;
+        ADCA.CH2.CTRL = ADCA.CH0.CTRL;
+        ADCA.CH2.MUXCTRL = ADCA.CH0.MUXCTRL;
+        ADCA.CH3.CTRL = ADCA.CH0.CTRL;
+        ADCA.CH3.MUXCTRL = ADCA.CH0.MUXCTRL;
+        ADCA.CH3.INTFLAGS = 1;
+        ADCA.CH3.INTCTRL = ADC_CH_INTMODE_COMPLETE_gc | ADC_CH_INTLVL_LO_gc;
+        ADCA.CTRLA |= ADC_CH1START_bm | ADC_CH2START_bm | ADC_CH3START_bm;
+    }
+    else
+    {
+        // A conversion is always running: the interrupt fires when it completes, or right away if it did already
+        ADCA.CH0.INTCTRL = ADC_CH_INTMODE_COMPLETE_gc | ADC_CH_INTLVL_LO_gc;
+    }
+}
+
+/*
+ * Get the background accumulation state
+ * @return  see enum adc_acc_state_t
+ */
+uint8_t get_adc_accumulation_state(void)
+{
+    return adc_acc_state;
+}
+
+/*
+ * Get the background accumulation result
+ * @param   avg_bit_shift   Where to store the number of samples used, in bit shift
  * @return  the averaged ADC value
  */
-uint16_t get_averaged_adc_value(uint8_t avg_bit_shift)
+uint16_t get_adc_accumulation_result(uint8_t* avg_bit_shift)
 {
-    uint32_t i = (1UL << avg_bit_shift);
     uint16_t return_value;
-    int32_t avg = 0;
+    uint8_t bit_shift;
+    int32_t sum_dev;
     
-    // Add to avg until we looped enough times
-    while(i--)
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-        avg += start_and_wait_for_adc_conversion();
+        bit_shift = adc_acc_bit_shift;
+        sum_dev = adc_acc_sum_dev;
     }
+    *avg_bit_shift = bit_shift;
     
-    // Add 0.5 of LSB to total, compute return value
-    avg += (1UL << (uint16_t)(avg_bit_shift-1));
-    return_value = (uint16_t)(avg >> avg_bit_shift);
+    // Mean with 0.5 LSB rounding
+    return_value = (uint16_t)(adc_acc_first_val + (int16_t)((sum_dev + (((int32_t)1 << bit_shift) >> 1)) >> bit_shift));
     
     // Don't return a negative value
     if (return_value > MAX_ADC_VAL)
@@ -254,6 +459,35 @@ uint16_t get_averaged_adc_value(uint8_t avg_bit_shift)
     }
 }
 
+/*
+ * Get the background accumulation peak to peak
+ * @return  the peak to peak
+ */
+uint16_t get_adc_accumulation_peak_to_peak(void)
+{
+    uint16_t return_value;
+    
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        return_value = adc_acc_max_dev - adc_acc_min_dev;
+    }
+    return return_value;
+}
+
+/*
+ * Get an averaged ADC value
+ * @param   avg_bit_shift   Bit shift for our averaging (1 for 2 samples, 2 for 4, etc etc)
+ * @return  the averaged ADC value
+ */
+uint16_t get_averaged_adc_value(uint8_t avg_bit_shift)
+{
+    uint8_t used_bit_shift;
+    
+    start_adc_accumulation(avg_bit_shift, 0, 0xFFFF);
+    while (get_adc_accumulation_state() == ADC_ACC_RUNNING);
+    return get_adc_accumulation_result(&used_bit_shift);
+}
+
 /*
  * Wait for a stabilized adc value
  * @param   avg_bit_shift   Bit shift for our averaging (1 for 2 samples, 2 for 4, etc etc, max 15!)
@@ -263,77 +497,29 @@ uint16_t get_averaged_adc_value(uint8_t avg_bit_shift)
  */
 uint16_t get_averaged_stabilized_adc_value(uint8_t avg_bit_shift, uint16_t max_pp, uint8_t debug)
 {
-    int16_t min_val = 0, max_val = 0, temp_val;
-    uint8_t loop_running = TRUE;
     uint16_t return_value;
-    int32_t avg = 0;
+    uint8_t used_bit_shift;
     
     if (debug == TRUE)
     {
         adcdprintf("Getting averaged value for %u samples, with less than %u LSB pp\r\n", (1 << avg_bit_shift), max_pp);
     }
-        
-    while (loop_running == TRUE)
+    
+    // Start over until the peak to peak stays below max_pp for all the samples
+    do 
     {
-        for (uint16_t i = 0; i < (1 << (uint16_t)avg_bit_shift); i++)
-        {
-            // Get one val
-            temp_val = start_and_wait_for_adc_conversion();
-            
-            // If it is the first iteration
-            if (i == 0)
-            {
-                min_val = temp_val;
-                max_val = temp_val;
-                avg = 0;
-            }
-            
-            // Add sample
-            avg += temp_val;
-            
-            // Check min/max
-            if (temp_val > max_val)
-            {
-                max_val = temp_val;
-            }
-            else if (temp_val < min_val)
-            {
-                min_val = temp_val;
-            }
-            
-            // Check current peak to peak, leave loop
-            if ((max_val - min_val) > max_pp)
-            {
-                //adcdprintf("%04u|%04u ", i, (max_val - min_val));
-                break;
-            }
-        }
-        
-        // Loop over, check peak to peak
-        if ((max_val - min_val) <= max_pp)
-        {
-            loop_running = FALSE;
-        }
+        start_adc_accumulation(avg_bit_shift, 0, max_pp);
+        while (get_adc_accumulation_state() == ADC_ACC_RUNNING);
     }
-    
-    // Add 0.5 of LSB to total, compute return value
-    avg += (1 << (uint16_t)(avg_bit_shift-1));
-    return_value = (uint16_t)(avg >> avg_bit_shift);
+    while (get_adc_accumulation_state() == ADC_ACC_UNSTABLE);
+    return_value = get_adc_accumulation_result(&used_bit_shift);
     
     if (debug == TRUE)
     {
-        adcdprintf("Averaged value found: %u, pp of %u LSB\r\n", return_value, (max_val - min_val));
+        adcdprintf("Averaged value found: %u, pp of %u LSB\r\n", return_value, get_adc_accumulation_peak_to_peak());
     }
     
-    // Don't return a negative value
-    if (return_value > MAX_ADC_VAL)
-    {
-        return 0;
-    }
-    else
-    {
-        return return_value;
-    }
+    return return_value;
 }
 
 /*
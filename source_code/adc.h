@@ -22,11 +22,15 @@
 #endif
 
 // enums
+enum adc_acc_state_t   {ADC_ACC_RUNNING = 0, ADC_ACC_DONE = 1, ADC_ACC_UNSTABLE = 2, ADC_ACC_ABORTED = 3};
 enum adc_channel_t     {ADC_CHANNEL_COMPOUT = 0, ADC_CHANNEL_VBIAS = 1, ADC_CHANNEL_GND_EXT = 2, ADC_CHANNEL_CUR = 3, ADC_CHANNEL_AREF = 4, ADC_CHANNEL_GND_EXT_VCCDIV16 = 5, ADC_CHANNEL_AVCCDIV10 = 6, ADC_CHANNEL_AVCCDIV10_VCCDIV16 = 7};
     
 // defines
 #define MAX_ADC_VAL         4095
 #define MAX_DIFF_ADC_VAL    2047    
+#define EARLY_STOP_MIN_AVG_BIT_SHIFT    3   // Minimum number of samples before an early stop, in bit shift
+#define ADC_SWEEP_MIN_AVG_BIT_SHIFT     2   // Accumulations of at least this many samples (bit shift) use the four channels
+#define ADC_SWEEP_START_gm  (ADC_CH0START_bm | ADC_CH1START_bm | ADC_CH2START_bm | ADC_CH3START_bm)
 #define ADCACAL0_offset     0x20
 #define ADCACAL1_offset     0x21
 #define ADCBCAL0_offset     0x24
@@ -35,11 +39,16 @@ enum adc_channel_t     {ADC_CHANNEL_COMPOUT = 0, ADC_CHANNEL_VBIAS = 1, ADC_CHAN
 // prototypes
 uint16_t get_averaged_stabilized_adc_value(uint8_t avg_bit_shift, uint16_t max_pp, uint8_t debug);
 uint8_t measure_peak_to_peak_on_channel(uint8_t nb_bits, uint8_t channel, uint8_t ampl);
+void start_adc_accumulation(uint8_t max_avg_bit_shift, uint16_t tolerance, uint16_t max_pp);
+uint16_t get_adc_accumulation_result(uint8_t* avg_bit_shift);
+uint16_t get_adc_accumulation_peak_to_peak(void);
 void configure_adc_channel(uint8_t channel, uint8_t ampl, uint8_t debug);
 uint16_t get_averaged_adc_value(uint8_t avg_bit_shift);
 void disable_adc_channel(uint8_t channel);
 uint8_t get_configured_adc_channel(void);
 uint8_t get_configured_adc_ampl(void);
+uint8_t get_adc_accumulation_state(void);
+void abort_adc_accumulation(void);
 void init_adc(void);
 
 #endif /* ADC_H_ */
\ No newline at end of file
@@ -6,6 +6,7 @@
  */
 #include <avr/pgmspace.h>
 #include <avr/eeprom.h>
+#include <util/crc16.h>
 #include <util/delay.h>
 #include <avr/io.h>
 #include <string.h>
@@ -15,6 +16,7 @@
 #include "conversions.h"
 #include "calibration.h"
 #include "meas_io.h"
+#include "utils.h"
 #include "vbias.h"
 #include "dac.h"
 #include "adc.h"
@@ -32,6 +34,14 @@
 oe_calib_data_t oe_calib_data;
 // Know if platform is calibrated
 uint8_t calib_ok = FALSE;
+// Vbias measured for DAC values multiple of 1 << VBIAS_LUT_DAC_BIT_SHIFT
+uint16_t vbias_lut[VBIAS_LUT_NB_POINTS];
+// Know if the vbias lookup table is calibrated
+uint8_t vbias_lut_ok = FALSE;
+// Calibration data sections metadata
+calib_section_meta_t calib_sections_meta[NB_CALIB_SECTIONS];
+// Last calibration total and per step durations (ms)
+uint16_t calib_step_timings[NB_CALIB_STEPS];
 
 
 /*
@@ -150,26 +160,104 @@ uint8_t get_openended_calibration_data(uint8_t* buffer)
     return sizeof(oe_calib_data);
 }
 
+/*
+ * Predict the DAC value for a given bias voltage using the vbias lookup table
+ * @param   val_mv  Bias voltage in mV
+ * @return  DAC value, VBIAS_LUT_NO_PREDICTION if out of the table or not calibrated
+ */
+uint16_t get_vbias_lut_dac_value(uint16_t val_mv)
+{
+    if (vbias_lut_ok == FALSE)
+    {
+        return VBIAS_LUT_NO_PREDICTION;
+    }
+    
+    // Vbias decreases when the DAC value increases: look for the first interval containing our voltage, from the lowest one
+    for (uint8_t i = VBIAS_LUT_NB_POINTS-1; i > 0; i--)
+    {
+        if ((vbias_lut[i] < val_mv) && (vbias_lut[i-1] >= val_mv))
+        {
+            // Linear interpolation between the two points
+            return ((uint16_t)i << VBIAS_LUT_DAC_BIT_SHIFT) - (uint16_t)(((uint32_t)(val_mv - vbias_lut[i]) << VBIAS_LUT_DAC_BIT_SHIFT) / (vbias_lut[i-1] - vbias_lut[i]));
+        }
+    }
+    
+    return VBIAS_LUT_NO_PREDICTION;
+}
+
+/*
+ * Start the calibration timebase
+ */
+void start_calibration_timer(void)
+{
+    // RTC: 32kHz crystal divided by 32, 1024 ticks per second
+    CLK.RTCCTRL = CLK_RTCSRC_TOSC32_gc | CLK_RTCEN_bm;
+    RTC.CTRL = RTC_PRESCALER_OFF_gc;
+    while (RTC.STATUS & RTC_SYNCBUSY_bm);
+    RTC.PER = 0xFFFF;
+    RTC.CNT = 0;
+    RTC.CTRL = RTC_PRESCALER_DIV32_gc;
+    while (RTC.STATUS & RTC_SYNCBUSY_bm);
+}
+
+/*
+ * Stop the calibration timebase, measurement modes expect the RTC counter to start from 0
+ */
+void stop_calibration_timer(void)
+{
+    RTC.CTRL = RTC_PRESCALER_OFF_gc;
+    while (RTC.STATUS & RTC_SYNCBUSY_bm);
+    RTC.CNT = 0;
+    while (RTC.STATUS & RTC_SYNCBUSY_bm);
+}
+
+/*
+ * Get the time elapsed since the calibration start
+ * @return  Time in ms, wraps after 64s
+ */
+uint16_t get_calibration_time(void)
+{
+    return (uint16_t)(((uint32_t)RTC.CNT * 1000) >> 10);
+}
+
+/*
+ * Get the durations of the last calibration steps
+ * @param   buffer      Where to store the total duration then the steps durations (ms, see calib_step_t)
+ * @return  Data length
+ */
+uint8_t get_calibration_timings(uint8_t* buffer)
+{
+    memcpy((void*)buffer, (void*)calib_step_timings, sizeof(calib_step_timings));
+    return sizeof(calib_step_timings);
+}
+
 /*
  * Measure the offset for vbias
  */
 void calibrate_single_ended_offset_for_vbias(void)
 {
+    uint16_t settle_start;
+    uint16_t settle_time;
+    
     calibdprintf_P(PSTR("-----------------------\r\n"));
     calibdprintf_P(PSTR("Single Ended Offset Calibration For Vbias...\r\n\r\n"));
     
-    // Configure correct ADC channel, enable vbias quenching
-    disable_bias_voltage();
+    // Configure correct ADC channel, discharge vbias
+    disable_ldo();
+    disable_stepup();
+    disable_vbias_dac();
     enable_vbias_quenching();
     configure_adc_channel(ADC_CHANNEL_VBIAS, 0, TRUE);
     
     // If we're not near the dedicated 0v adc value, add a delay
+    settle_time = VBIAS_0V_SETTLE_MS;
     if (get_averaged_adc_value(4) > 8)
     {
-         while(get_averaged_adc_value(4) > 8);
-        _delay_ms(3210);
-    }        
-    _delay_ms(500);
+        while(get_averaged_adc_value(4) > 8);
+        settle_time = VBIAS_DISCHARGE_SETTLE_MS + VBIAS_0V_SETTLE_MS;
+    }
+    settle_start = get_calibration_time();
+    while ((uint16_t)(get_calibration_time() - settle_start) < settle_time);
     
     // Delete current single ended offset, get vbias offset
     uint16_t calib_0v_value_se_copy = oe_calib_data.calib_0v_value_se;
@@ -219,10 +307,141 @@ void calibrate_cur_measurement_offsets(void)
     disable_feedback_mos();                 // Disable feedback mos
 }
 
+/*
+ * Check if a comparator output toggled since it was reset
+ * @param   port        Comparator output port
+ * @param   pin_bm      Comparator output pin
+ * @param   reset_level Comparator output level after the reset
+ * @return  TRUE if it toggled
+ */
+uint8_t has_comparator_toggled(PORT_t* port, uint8_t pin_bm, uint8_t reset_level)
+{
+    if ((port->IN & pin_bm) != reset_level)
+    {
+        return TRUE;
+    } 
+    else
+    {
+        return FALSE;
+    }
+}
+
+/*
+ * Reset a comparator from one side of its threshold
+ * @param   port        Comparator output port
+ * @param   pin_bm      Comparator output pin
+ * @param   from_low    TRUE to reset it from DAC_MIN_VAL, FALSE from DAC_MAX_VAL
+ * @return  Comparator output level after the reset
+ */
+uint8_t reset_comparator(PORT_t* port, uint8_t pin_bm, uint8_t from_low)
+{
+    if (from_low == TRUE)
+    {
+        update_opampin_dac(DAC_MIN_VAL);
+    } 
+    else
+    {
+        update_opampin_dac(DAC_MAX_VAL);
+    }
+    _delay_us(20);
+    return port->IN & pin_bm;
+}
+
+/*
+ * Find a comparator threshold with a bounded number of DAC probes, each probed value being reached from the same side.
+ * The successive approximation result is then refined by ramps over a few LSBs around it, as the full ramps would do.
+ * @param   port            Comparator output port
+ * @param   pin_bm          Comparator output pin
+ * @param   from_low        TRUE for the threshold crossed ramping up, FALSE for the one crossed ramping down
+ * @param   avg_bit_shift   Number of local ramps to average, in bit shift
+ * @return  The DAC value at which the comparator toggles
+ */
+uint16_t find_threshold_by_approximation(PORT_t* port, uint8_t pin_bm, uint8_t from_low, uint8_t avg_bit_shift)
+{
+    uint16_t not_toggled_val = 0;
+    uint32_t threshold_agg = 0;
+    uint16_t nb_ramps = 0;
+    uint8_t reset_level;
+    uint16_t threshold;
+    uint16_t dac_val;
+    
+    // Successive approximation of the last DAC value before the toggle, on an inverted scale when ramping down
+    for (uint16_t bit = (DAC_MAX_VAL + 1) >> 1; bit != 0; bit >>= 1)
+    {
+        dac_val = not_toggled_val | bit;
+        reset_level = reset_comparator(port, pin_bm, from_low);
+        update_opampin_dac((from_low == TRUE)? dac_val : DAC_MAX_VAL - dac_val);
+        _delay_us(20);
+        if (has_comparator_toggled(port, pin_bm, reset_level) == FALSE)
+        {
+            not_toggled_val = dac_val;
+        }
+    }
+    if (not_toggled_val == DAC_MAX_VAL)
+    {
+        not_toggled_val = DAC_MAX_VAL - 1;
+    }
+    threshold = (from_low == TRUE)? not_toggled_val + 1 : DAC_MAX_VAL - not_toggled_val - 1;
+    calibdprintf("Approximated threshold: %u\r\n", threshold);
+    
+    // Local ramps around it
+    for (uint16_t i = 0; i < (1 << avg_bit_shift); i++)
+    {
+        reset_level = reset_comparator(port, pin_bm, from_low);
+        if (from_low == TRUE)
+        {
+            dac_val = (threshold > THRESHOLD_SCAN_SPAN)? threshold - THRESHOLD_SCAN_SPAN : DAC_MIN_VAL;
+        } 
+        else
+        {
+            dac_val = (threshold < DAC_MAX_VAL - THRESHOLD_SCAN_SPAN)? threshold + THRESHOLD_SCAN_SPAN : DAC_MAX_VAL;
+        }
+        update_opampin_dac(dac_val);
+        _delay_us(20);
+        
+        for (uint16_t j = 0; j < 2*THRESHOLD_SCAN_SPAN; j++)
+        {
+            if (from_low == TRUE)
+            {
+                if (dac_val == DAC_MAX_VAL)
+                {
+                    break;
+                }
+                update_opampin_dac(++dac_val);
+            } 
+            else
+            {
+                if (dac_val == DAC_MIN_VAL)
+                {
+                    break;
+                }
+                update_opampin_dac(--dac_val);
+            }
+            _delay_us(10);
+            if (has_comparator_toggled(port, pin_bm, reset_level) == TRUE)
+            {
+                threshold_agg += dac_val;
+                nb_ramps++;
+                break;
+            }
+        }
+    }
+    
+    // Keep the approximation if the local ramps never saw the toggle
+    if (nb_ramps != 0)
+    {
+        threshold = (uint16_t)((threshold_agg + (nb_ramps >> 1)) / nb_ramps);
+    }
+    calibdprintf("Threshold found after %u local ramps: %u\r\n", nb_ramps, threshold);
+    return threshold;
+}
+
 /*
  * Measure the comparison thresholds
+ * @param   calib_mode      Calibration mode (see calib_mode_t)
+ * @param   charge_wait_ms  How long we leave a possible cap between the terminals charge (ms)
  */
-void calibrate_thresholds(void)
+void calibrate_thresholds(uint8_t calib_mode, uint16_t charge_wait_ms)
 {
     calibdprintf_P(PSTR("-----------------------\r\n"));
     calibdprintf_P(PSTR("Threshold Calibration\r\n\r\n"));
@@ -241,109 +460,124 @@ void calibrate_thresholds(void)
     enable_bias_voltage(4000);
     
     // Leave time for a possible cap to charge
-    _delay_ms(1000);
+    for (uint16_t i = 0; i < charge_wait_ms; i++)
+    {
+        _delay_ms(1);
+    }
     uint16_t dac_val = DAC_MIN_VAL;
     setup_opampin_dac(dac_val);
-    uint32_t calib_second_thres_down_agg = 0;
-    uint32_t calib_first_thres_down_agg = 0;
-    uint32_t calib_second_thres_up_agg = 0;
-    uint32_t calib_first_thres_up_agg = 0;
-    uint8_t temp_bool = TRUE;
     
-    for (uint16_t i = 0; i < (1 << THRESHOLD_AVG_BIT_SHIFT); i++)
-    {        
-        // Reset values
-        oe_calib_data.calib_first_thres_up = 0;
-        oe_calib_data.calib_second_thres_up = 0;
-        oe_calib_data.calib_first_thres_down = 0;
-        oe_calib_data.calib_second_thres_down = 0;
+    if (calib_mode == CALIB_MODE_APPROX)
+    {
+        // First comparator output goes low on the way up, second goes high
+        oe_calib_data.calib_first_thres_down = find_threshold_by_approximation(&PORTE, PIN0_bm, TRUE, THRESHOLD_AVG_BIT_SHIFT);
+        oe_calib_data.calib_second_thres_down = find_threshold_by_approximation(&PORTE, PIN1_bm, TRUE, THRESHOLD_AVG_BIT_SHIFT);
+        oe_calib_data.calib_first_thres_up = find_threshold_by_approximation(&PORTE, PIN0_bm, FALSE, THRESHOLD_AVG_BIT_SHIFT);
+        oe_calib_data.calib_second_thres_up = find_threshold_by_approximation(&PORTE, PIN1_bm, FALSE, THRESHOLD_AVG_BIT_SHIFT);
+    } 
+    else
+    {
+        uint32_t calib_second_thres_down_agg = 0;
+        uint32_t calib_first_thres_down_agg = 0;
+        uint32_t calib_second_thres_up_agg = 0;
+        uint32_t calib_first_thres_up_agg = 0;
+        uint8_t temp_bool = TRUE;
         
-        // Ramp up, wait for all the toggles
-        temp_bool = TRUE;
-        while(dac_val != DAC_MAX_VAL && temp_bool == TRUE)
-        {
-            update_opampin_dac(++dac_val);
-            _delay_us(10);
-            // First threshold crossed
-            if ((oe_calib_data.calib_first_thres_down == 0) && ((PORTE_IN & PIN0_bm) == 0))
+        for (uint16_t i = 0; i < (1 << THRESHOLD_AVG_BIT_SHIFT); i++)
+        {        
+            // Reset values
+            oe_calib_data.calib_first_thres_up = 0;
+            oe_calib_data.calib_second_thres_up = 0;
+            oe_calib_data.calib_first_thres_down = 0;
+            oe_calib_data.calib_second_thres_down = 0;
+            
+            // Ramp up, wait for all the toggles
+            temp_bool = TRUE;
+            while(dac_val != DAC_MAX_VAL && temp_bool == TRUE)
             {
-                if (oe_calib_data.calib_second_thres_down != 0)
+                update_opampin_dac(++dac_val);
+                _delay_us(10);
+                // First threshold crossed
+                if ((oe_calib_data.calib_first_thres_down == 0) && ((PORTE_IN & PIN0_bm) == 0))
                 {
-                    temp_bool = FALSE;
-                }                
-                oe_calib_data.calib_first_thres_down = dac_val;
-                calib_first_thres_down_agg += oe_calib_data.calib_first_thres_down;
-            }
-            // Second threshold crossed
-            if ((oe_calib_data.calib_second_thres_down == 0) && ((PORTE_IN & PIN1_bm) != 0))
-            {
-                if (oe_calib_data.calib_first_thres_down != 0)
+                    if (oe_calib_data.calib_second_thres_down != 0)
+                    {
+                        temp_bool = FALSE;
+                    }                
+                    oe_calib_data.calib_first_thres_down = dac_val;
+                    calib_first_thres_down_agg += oe_calib_data.calib_first_thres_down;
+                }
+                // Second threshold crossed
+                if ((oe_calib_data.calib_second_thres_down == 0) && ((PORTE_IN & PIN1_bm) != 0))
                 {
-                    temp_bool = FALSE;
+                    if (oe_calib_data.calib_first_thres_down != 0)
+                    {
+                        temp_bool = FALSE;
+                    }
+                    oe_calib_data.calib_second_thres_down = dac_val;
+                    calib_second_thres_down_agg += oe_calib_data.calib_second_thres_down;
                 }
-                oe_calib_data.calib_second_thres_down = dac_val;
-                calib_second_thres_down_agg += oe_calib_data.calib_second_thres_down;
             }
-        }
-        
-        // Get a little margin before ramping down
-        if (dac_val < DAC_MAX_VAL - 200)
-        {
-            dac_val += 200;
-        } 
-        else
-        {
-            dac_val = DAC_MAX_VAL;
-        }    
-        update_opampin_dac(dac_val);
-        _delay_us(20);    
-        
-        // Ramp low, wait for toggle
-        temp_bool = TRUE;
-        while(dac_val != DAC_MIN_VAL && temp_bool == TRUE)
-        {
-            update_opampin_dac(--dac_val);
-            _delay_us(10);
-            // First threshold crossed
-            if ((oe_calib_data.calib_first_thres_up == 0) && ((PORTE_IN & PIN0_bm) != 0))
+            
+            // Get a little margin before ramping down
+            if (dac_val < DAC_MAX_VAL - 200)
             {
-                if (oe_calib_data.calib_second_thres_up != 0)
+                dac_val += 200;
+            } 
+            else
+            {
+                dac_val = DAC_MAX_VAL;
+            }    
+            update_opampin_dac(dac_val);
+            _delay_us(20);    
+            
+            // Ramp low, wait for toggle
+            temp_bool = TRUE;
+            while(dac_val != DAC_MIN_VAL && temp_bool == TRUE)
+            {
+                update_opampin_dac(--dac_val);
+                _delay_us(10);
+                // First threshold crossed
+                if ((oe_calib_data.calib_first_thres_up == 0) && ((PORTE_IN & PIN0_bm) != 0))
                 {
-                    temp_bool = FALSE;
+                    if (oe_calib_data.calib_second_thres_up != 0)
+                    {
+                        temp_bool = FALSE;
+                    }
+                    oe_calib_data.calib_first_thres_up = dac_val;
+                    calib_first_thres_up_agg += oe_calib_data.calib_first_thres_up;
                 }
-                oe_calib_data.calib_first_thres_up = dac_val;
-                calib_first_thres_up_agg += oe_calib_data.calib_first_thres_up;
-            }
-            // Second threshold crossed
-            if ((oe_calib_data.calib_second_thres_up == 0) && ((PORTE_IN & PIN1_bm) == 0))
-            {
-                if (oe_calib_data.calib_first_thres_up != 0)
+                // Second threshold crossed
+                if ((oe_calib_data.calib_second_thres_up == 0) && ((PORTE_IN & PIN1_bm) == 0))
                 {
-                    temp_bool = FALSE;
+                    if (oe_calib_data.calib_first_thres_up != 0)
+                    {
+                        temp_bool = FALSE;
+                    }
+                    oe_calib_data.calib_second_thres_up = dac_val;
+                    calib_second_thres_up_agg += oe_calib_data.calib_second_thres_up;
                 }
-                oe_calib_data.calib_second_thres_up = dac_val;
-                calib_second_thres_up_agg += oe_calib_data.calib_second_thres_up;
             }
-        }
-        
-        // Get a little margin before ramping up
-        if (dac_val > 200)
-        {
-            dac_val -= 200;
-        } 
-        else
-        {
-            dac_val = DAC_MIN_VAL;
+            
+            // Get a little margin before ramping up
+            if (dac_val > 200)
+            {
+                dac_val -= 200;
+            } 
+            else
+            {
+                dac_val = DAC_MIN_VAL;
+            }    
+            update_opampin_dac(dac_val);
+            _delay_us(20);   
         }    
-        update_opampin_dac(dac_val);
-        _delay_us(20);   
-    }    
-    
-    // Compute values    
-    oe_calib_data.calib_first_thres_down = (uint16_t)(calib_first_thres_down_agg >> THRESHOLD_AVG_BIT_SHIFT);
-    oe_calib_data.calib_second_thres_down = (uint16_t)(calib_second_thres_down_agg >> THRESHOLD_AVG_BIT_SHIFT);
-    oe_calib_data.calib_first_thres_up = (uint16_t)(calib_first_thres_up_agg >> THRESHOLD_AVG_BIT_SHIFT);
-    oe_calib_data.calib_second_thres_up = (uint16_t)(calib_second_thres_up_agg >> THRESHOLD_AVG_BIT_SHIFT);
+        
+        // Compute values    
+        oe_calib_data.calib_first_thres_down = (uint16_t)(calib_first_thres_down_agg >> THRESHOLD_AVG_BIT_SHIFT);
+        oe_calib_data.calib_second_thres_down = (uint16_t)(calib_second_thres_down_agg >> THRESHOLD_AVG_BIT_SHIFT);
+        oe_calib_data.calib_first_thres_up = (uint16_t)(calib_first_thres_up_agg >> THRESHOLD_AVG_BIT_SHIFT);
+        oe_calib_data.calib_second_thres_up = (uint16_t)(calib_second_thres_up_agg >> THRESHOLD_AVG_BIT_SHIFT);
+    }
     calibdprintf("First thres found: %u, approx %umV\r\n", oe_calib_data.calib_first_thres_down, compute_voltage_from_se_adc_val(oe_calib_data.calib_first_thres_down));
     calibdprintf("Second thres found: %u, approx %umV\r\n", oe_calib_data.calib_second_thres_down, compute_voltage_from_se_adc_val(oe_calib_data.calib_second_thres_down));
     calibdprintf("First thres found: %u, approx %umV\r\n", oe_calib_data.calib_first_thres_up, compute_voltage_from_se_adc_val(oe_calib_data.calib_first_thres_up));
@@ -356,8 +590,10 @@ void calibrate_thresholds(void)
 
 /*
  * Measure the oscillator low voltage
+ * @param   calib_mode      Calibration mode (see calib_mode_t)
+ * @param   charge_wait_ms  How long we leave a possible cap between the terminals charge (ms)
  */
-void calibrate_osc_low_v(void)
+void calibrate_osc_low_v(uint8_t calib_mode, uint16_t charge_wait_ms)
 {
     calibdprintf_P(PSTR("-----------------------\r\n"));
     calibdprintf_P(PSTR("Oscillator Low Voltage Calibration\r\n\r\n"));
@@ -368,16 +604,27 @@ void calibrate_osc_low_v(void)
     enable_bias_voltage(4000);
     
     // Leave time for a possible cap to charge
-    _delay_ms(1000);
+    for (uint16_t i = 0; i < charge_wait_ms; i++)
+    {
+        _delay_ms(1);
+    }
     uint16_t dac_val = DAC_MAX_VAL;
     opampin_as_input();
     setup_opampin_dac(dac_val);
     
-    // Wait for compout toggle
-    while (((PORTA_IN & PIN6_bm) == 0) && (dac_val != 0))
+    if (calib_mode == CALIB_MODE_APPROX)
     {
-        update_opampin_dac(--dac_val);
-        _delay_us(20);
+        // Compout toggles on the way down
+        dac_val = find_threshold_by_approximation(&PORTA, PIN6_bm, FALSE, 0);
+    } 
+    else
+    {
+        // Wait for compout toggle
+        while (((PORTA_IN & PIN6_bm) == 0) && (dac_val != 0))
+        {
+            update_opampin_dac(--dac_val);
+            _delay_us(20);
+        }
     }
     
     // Store result
@@ -389,50 +636,458 @@ void calibrate_osc_low_v(void)
     set_opampin_low();
 }  
 
+/*
+ * Update a CRC16 with a data block
+ * @param   crc     Current CRC
+ * @param   data    Data block
+ * @param   size    Data block size
+ * @return  Updated CRC
+ */
+uint16_t update_crc16_with_block(uint16_t crc, void* data, uint8_t size)
+{
+    for (uint8_t i = 0; i < size; i++)
+    {
+        crc = _crc16_update(crc, ((uint8_t*)data)[i]);
+    }
+    return crc;
+}
+
+/*
+ * Check that vbias decreases when the DAC value increases in the lookup table, it would predict wrong DAC values otherwise
+ * @return  Boolean
+ */
+uint8_t is_vbias_lut_monotonic(void)
+{
+    for (uint8_t i = 1; i < VBIAS_LUT_NB_POINTS; i++)
+    {
+        if (vbias_lut[i] > vbias_lut[i-1])
+        {
+            return FALSE;
+        }
+    }
+    
+    if (vbias_lut[VBIAS_LUT_NB_POINTS-1] < vbias_lut[0])
+    {
+        return TRUE;
+    } 
+    else
+    {
+        return FALSE;
+    }
+}
+
+/*
+ * Find the max voltage, ramping up in closed loop to the highest voltage the platform can generate
+ */
+void calibrate_max_voltage(void)
+{
+    calibdprintf_P(PSTR("-----------------------\r\n"));
+    calibdprintf_P(PSTR("Max Voltage Measure\r\n\r\n"));
+    oe_calib_data.max_voltage = enable_bias_voltage(33333);
+    calibdprintf("Max voltage found: %dmV\r\n", oe_calib_data.max_voltage);
+    disable_bias_voltage();
+}
+
+/*
+ * Measure the DAC to vbias lookup table
+ */
+void calibrate_vbias_lut(void)
+{
+    calibdprintf_P(PSTR("-----------------------\r\n"));
+    calibdprintf_P(PSTR("Vbias Lookup Table Measure\r\n\r\n"));
+    
+    // Ramp up from the lowest voltage, force_vbias_dac_change() enables the stepup below STEPUP_ACTIV_DAC_V as update_bias_voltage() does
+    enable_bias_voltage(VBIAS_MIN_V);
+    for (uint8_t i = VBIAS_LUT_NB_POINTS; i > 0; i--)
+    {
+        vbias_lut[i-1] = force_vbias_dac_change((uint16_t)(i-1) << VBIAS_LUT_DAC_BIT_SHIFT, VBIAS_LUT_SETTLE_MS);
+        calibdprintf("DAC %u: %umV\r\n", (i-1) << VBIAS_LUT_DAC_BIT_SHIFT, vbias_lut[i-1]);
+    }
+    disable_bias_voltage();
+    
+    // Store it with its CRC if it is usable
+    vbias_lut_ok = is_vbias_lut_monotonic();
+    if (vbias_lut_ok == TRUE)
+    {
+        eeprom_write_block((void*)vbias_lut, (void*)EEP_VBIAS_LUT, sizeof(vbias_lut));
+        eeprom_write_word((uint16_t*)EEP_VBIAS_LUT_CRC, update_crc16_with_block(0xFFFF, (void*)vbias_lut, sizeof(vbias_lut)));
+        eeprom_write_byte((uint8_t*)EEP_VBIAS_LUT_VERSION, VBIAS_LUT_VERSION);
+    } 
+    else
+    {
+        calibdprintf_P(PSTR("Vbias lookup table not monotonic\r\n"));
+        eeprom_write_byte((uint8_t*)EEP_VBIAS_LUT_VERSION, 0);
+    }
+}
+
+/*
+ * Compute the CRC of a calibration data section
+ * @param   section     The section (see calib_section_t)
+ * @return  The CRC
+ */
+uint16_t compute_calib_section_crc(uint8_t section)
+{
+    uint16_t crc = 0xFFFF;
+    
+    switch (section)
+    {
+        case CALIB_SECTION_OFFSETS:
+        {
+            crc = update_crc16_with_block(crc, (void*)oe_calib_data.cur_measurement_offsets, sizeof(oe_calib_data.cur_measurement_offsets));
+            crc = update_crc16_with_block(crc, (void*)&oe_calib_data.calib_0v_value_vbias, sizeof(oe_calib_data.calib_0v_value_vbias));
+            crc = update_crc16_with_block(crc, (void*)&oe_calib_data.calib_0v_value_se, sizeof(oe_calib_data.calib_0v_value_se));
+            break;
+        }
+        case CALIB_SECTION_THRESHOLDS:
+        {
+            crc = update_crc16_with_block(crc, (void*)&oe_calib_data.calib_second_thres_down, sizeof(oe_calib_data.calib_second_thres_down));
+            crc = update_crc16_with_block(crc, (void*)&oe_calib_data.calib_first_thres_down, sizeof(oe_calib_data.calib_first_thres_down));
+            crc = update_crc16_with_block(crc, (void*)&oe_calib_data.calib_second_thres_up, sizeof(oe_calib_data.calib_second_thres_up));
+            crc = update_crc16_with_block(crc, (void*)&oe_calib_data.calib_first_thres_up, sizeof(oe_calib_data.calib_first_thres_up));
+            break;
+        }
+        case CALIB_SECTION_OSC_LOW_V:
+        {
+            crc = update_crc16_with_block(crc, (void*)&oe_calib_data.calib_osc_low_v, sizeof(oe_calib_data.calib_osc_low_v));
+            break;
+        }
+        case CALIB_SECTION_MAX_VOLTAGE:
+        {
+            crc = update_crc16_with_block(crc, (void*)&oe_calib_data.max_voltage, sizeof(oe_calib_data.max_voltage));
+            break;
+        }
+        default: break;
+    }
+    
+    return crc;
+}
+
+/*
+ * Get the current format version of a calibration data section
+ * @param   section     The section (see calib_section_t)
+ * @return  The version
+ */
+uint8_t get_calib_section_version(uint8_t section)
+{
+    switch (section)
+    {
+        case CALIB_SECTION_OFFSETS: return CALIB_OFFSETS_VERSION;
+        case CALIB_SECTION_THRESHOLDS: return CALIB_THRESHOLDS_VERSION;
+        case CALIB_SECTION_OSC_LOW_V: return CALIB_OSC_LOW_V_VERSION;
+        case CALIB_SECTION_MAX_VOLTAGE: return CALIB_MAX_VOLTAGE_VERSION;
+        default: return 0;
+    }
+}
+
+/*
+ * Update a calibration data section metadata after it was (re)calibrated
+ * @param   section     The section (see calib_section_t)
+ * @param   day         Calibration day
+ * @param   month       Calibration month
+ * @param   year        Calibration year
+ */
+void update_calib_section_meta(uint8_t section, uint8_t day, uint8_t month, uint8_t year)
+{
+    calib_sections_meta[section].version = get_calib_section_version(section);
+    calib_sections_meta[section].day = day;
+    calib_sections_meta[section].month = month;
+    calib_sections_meta[section].year = year;
+    calib_sections_meta[section].crc = compute_calib_section_crc(section);
+}
+
+/*
+ * Know if a calibration data section is stale: stored with another format version or corrupted
+ * @param   section     The section (see calib_section_t)
+ * @return  TRUE if stale
+ */
+uint8_t is_calib_section_stale(uint8_t section)
+{
+    if ((calib_sections_meta[section].version != get_calib_section_version(section)) || (calib_sections_meta[section].crc != compute_calib_section_crc(section)))
+    {
+        return TRUE;
+    } 
+    else
+    {
+        return FALSE;
+    }
+}
+
 /*
  * Start open terminal calibration
+ * @param   calib_mode  Calibration mode (see calib_mode_t)
  */  
-void start_openended_calibration(uint8_t day, uint8_t month, uint8_t year)
+void start_openended_calibration(uint8_t day, uint8_t month, uint8_t year, uint8_t calib_mode)
 {
+    uint16_t step_start;
+    
     calibdprintf_P(PSTR("-----------------------\r\n"));
     calibdprintf_P(PSTR("Calibration Start\r\n\r\n"));
+    start_calibration_timer();
     
     // Store date
     oe_calib_data.day = day;
     oe_calib_data.month = month;
     oe_calib_data.year = year;
     
-    // Calibrate single ended offset
+    // Start discharging vbias, disable_bias_voltage() would wait for it
+    disable_ldo();
+    disable_stepup();
+    disable_vbias_dac();
+    enable_vbias_quenching();
+    
+    // Calibrate single ended offset while vbias discharges
+    step_start = get_calibration_time();
     calibrate_single_ended_offset();
+    calib_step_timings[CALIB_STEP_SE_OFFSET] = get_calibration_time() - step_start;
     
     // Calibrate single ended offset for vbias
+    step_start = get_calibration_time();
     calibrate_single_ended_offset_for_vbias();
+    calib_step_timings[CALIB_STEP_VBIAS_OFFSET] = get_calibration_time() - step_start;
     
     // Calibrate current measurement offsets
+    step_start = get_calibration_time();
     calibrate_cur_measurement_offsets();
-    
-    // Wait for 0V bias
-    wait_for_0v4_bias();
+    calib_step_timings[CALIB_STEP_CUR_OFFSETS] = get_calibration_time() - step_start;
     
     // Calibrate thresholds
-    calibrate_thresholds();
+    step_start = get_calibration_time();
+    calibrate_thresholds(calib_mode, CALIB_CHARGE_WAIT_MS);
+    calib_step_timings[CALIB_STEP_THRESHOLDS] = get_calibration_time() - step_start;
     
     // Calibrate low oscillator value
-    calibrate_osc_low_v();
+    step_start = get_calibration_time();
+    calibrate_osc_low_v(calib_mode, CALIB_CHARGE_WAIT_MS);
+    calib_step_timings[CALIB_STEP_OSC_LOW_V] = get_calibration_time() - step_start;
+    
+    // Measure the vbias lookup table
+    step_start = get_calibration_time();
+    calibrate_vbias_lut();
+    calib_step_timings[CALIB_STEP_VBIAS_LUT] = get_calibration_time() - step_start;
     
     // Find max voltage
-    calibdprintf_P(PSTR("-----------------------\r\n"));
-    calibdprintf_P(PSTR("Max Voltage Measure\r\n\r\n"));
-    oe_calib_data.max_voltage = enable_bias_voltage(33333);
-    calibdprintf("Max voltage found: %dmV\r\n", oe_calib_data.max_voltage);
-    disable_bias_voltage();   
+    step_start = get_calibration_time();
+    calibrate_max_voltage();
+    calib_step_timings[CALIB_STEP_MAX_VOLTAGE] = get_calibration_time() - step_start;
     
-    // Store calib flag
+    // Store calib flag, all the sections were calibrated now
+    for (uint8_t section = 0; section < NB_CALIB_SECTIONS; section++)
+    {
+        update_calib_section_meta(section, day, month, year);
+    }
+    eeprom_write_block((void*)calib_sections_meta, (void*)EEP_CALIB_SECTIONS_META, sizeof(calib_sections_meta));
     eeprom_write_block((void*)&oe_calib_data, (void*)EEP_OE_CALIB_DATA, sizeof(oe_calib_data));
     eeprom_write_byte((uint8_t*)EEP_OE_CALIB_DONE_BOOL, EEPROM_BOOL_OK_VAL);
+    calib_step_timings[CALIB_STEP_TOTAL] = get_calibration_time();
+    calibdprintf("Calibration done in %ums\r\n", calib_step_timings[CALIB_STEP_TOTAL]);
+    stop_calibration_timer();
     calib_ok = TRUE; 
 }
 
+/*
+ * Check that a value re-measured during the verification is close enough to the stored one
+ * @param   measured    Re-measured value
+ * @param   stored      Stored value
+ * @param   tolerance   Tolerance
+ * @return  TRUE if within tolerance
+ */
+uint8_t is_calib_value_within_tolerance(uint16_t measured, uint16_t stored, uint16_t tolerance)
+{
+    uint16_t min_val = (stored > tolerance)? stored - tolerance : 0;
+    uint16_t max_val = (stored < 0xFFFF - tolerance)? stored + tolerance : 0xFFFF;
+    return check_value_range(measured, min_val, max_val);
+}
+
+/*
+ * Quickly re-measure the offsets with less averaging
+ * @return  TRUE if one of them drifted beyond tolerance
+ */
+uint8_t verify_offsets(void)
+{
+    oe_calib_data_t stored_calib_data = oe_calib_data;
+    uint8_t drifted = FALSE;
+    
+    calibdprintf_P(PSTR("-----------------------\r\n"));
+    calibdprintf_P(PSTR("Offsets Verification...\r\n\r\n"));
+    
+    // Measurements are done without offsets, as the calibration does
+    oe_calib_data.calib_0v_value_se = 0;
+    oe_calib_data.calib_0v_value_vbias = 0;
+    delete_cur_measurement_offsets();
+    
+    // Single ended offset
+    configure_adc_channel(ADC_CHANNEL_GND_EXT, 0, FALSE);
+    _delay_ms(10);
+    if (is_calib_value_within_tolerance(get_averaged_adc_value(CALIB_VERIFY_AVG_BIT_SHIFT), stored_calib_data.calib_0v_value_se, CALIB_OFFSET_TOLERANCE) == FALSE)
+    {
+        drifted = TRUE;
+    }
+    
+    // Current measurement offsets
+    enable_feedback_mos();
+    enable_cur_meas_mos();
+    for (uint8_t i = CUR_MES_1X; i < CUR_MES_4X; i++)
+    {
+        configure_adc_channel(ADC_CHANNEL_CUR, i, FALSE);
+        if (is_calib_value_within_tolerance(get_averaged_adc_value(CALIB_VERIFY_AVG_BIT_SHIFT), stored_calib_data.cur_measurement_offsets[i], CALIB_OFFSET_TOLERANCE) == FALSE)
+        {
+            drifted = TRUE;
+        }
+    }
+    disable_cur_meas_mos();
+    disable_feedback_mos();
+    
+    // Vbias offset, only if vbias already sits at 0V: it needs seconds to settle otherwise
+    disable_ldo();
+    disable_stepup();
+    disable_vbias_dac();
+    enable_vbias_quenching();
+    configure_adc_channel(ADC_CHANNEL_VBIAS, 0, FALSE);
+    if (get_averaged_adc_value(4) <= 8)
+    {
+        if (is_calib_value_within_tolerance(get_averaged_adc_value(CALIB_VERIFY_AVG_BIT_SHIFT), stored_calib_data.calib_0v_value_vbias, CALIB_OFFSET_TOLERANCE) == FALSE)
+        {
+            drifted = TRUE;
+        }
+    }
+    
+    oe_calib_data = stored_calib_data;
+    calibdprintf("Offsets drifted: %u\r\n", drifted);
+    return drifted;
+}
+
+/*
+ * Recalibrate a calibration data section
+ * @param   section     The section (see calib_section_t)
+ * @param   calib_mode  Calibration mode (see calib_mode_t)
+ */
+void recalibrate_section(uint8_t section, uint8_t calib_mode)
+{
+    switch (section)
+    {
+        case CALIB_SECTION_OFFSETS:
+        {
+            calibrate_single_ended_offset();
+            calibrate_single_ended_offset_for_vbias();
+            calibrate_cur_measurement_offsets();
+            break;
+        }
+        case CALIB_SECTION_THRESHOLDS:
+        {
+            calibrate_thresholds(calib_mode, CALIB_CHARGE_WAIT_MS);
+            break;
+        }
+        case CALIB_SECTION_OSC_LOW_V:
+        {
+            calibrate_osc_low_v(calib_mode, CALIB_CHARGE_WAIT_MS);
+            break;
+        }
+        case CALIB_SECTION_MAX_VOLTAGE:
+        {
+            calibrate_vbias_lut();
+            calibrate_max_voltage();
+            break;
+        }
+        default: break;
+    }
+}
+
+/*
+ * Quick calibration verification: stale sections are recalibrated, the others are re-measured quickly
+ * (successive approximation, less averaging, max voltage ramp without the lookup table) and their new values kept if they drifted beyond tolerance
+ * @param   day         Verification day, stored for the recalibrated sections
+ * @param   month       Verification month
+ * @param   year        Verification year
+ * @param   calib_mode  Calibration mode for the recalibrations (see calib_mode_t)
+ * @return  Bitmask of the recalibrated sections
+ */
+uint8_t verify_openended_calibration(uint8_t day, uint8_t month, uint8_t year, uint8_t calib_mode)
+{
+    oe_calib_data_t stored_calib_data;
+    uint8_t recalibrated_sections = 0;
+    uint8_t drifted;
+    
+    calibdprintf_P(PSTR("-----------------------\r\n"));
+    calibdprintf_P(PSTR("Calibration Verification Start\r\n\r\n"));
+    start_calibration_timer();
+    
+    for (uint8_t section = 0; section < NB_CALIB_SECTIONS; section++)
+    {
+        if (is_calib_section_stale(section) == TRUE)
+        {
+            calibdprintf("Section %u stale\r\n", section);
+            recalibrate_section(section, calib_mode);
+        }
+        else
+        {
+            // Quick re-measurement, keeping the stored values if they are still within tolerance
+            stored_calib_data = oe_calib_data;
+            switch (section)
+            {
+                case CALIB_SECTION_OFFSETS:
+                {
+                    drifted = verify_offsets();
+                    break;
+                }
+                case CALIB_SECTION_THRESHOLDS:
+                {
+                    calibrate_thresholds(CALIB_MODE_APPROX, CALIB_VERIFY_CHARGE_WAIT_MS);
+                    drifted = !(is_calib_value_within_tolerance(oe_calib_data.calib_first_thres_down, stored_calib_data.calib_first_thres_down, CALIB_THRESHOLD_TOLERANCE) &&
+                                is_calib_value_within_tolerance(oe_calib_data.calib_second_thres_down, stored_calib_data.calib_second_thres_down, CALIB_THRESHOLD_TOLERANCE) &&
+                                is_calib_value_within_tolerance(oe_calib_data.calib_first_thres_up, stored_calib_data.calib_first_thres_up, CALIB_THRESHOLD_TOLERANCE) &&
+                                is_calib_value_within_tolerance(oe_calib_data.calib_second_thres_up, stored_calib_data.calib_second_thres_up, CALIB_THRESHOLD_TOLERANCE));
+                    break;
+                }
+                case CALIB_SECTION_OSC_LOW_V:
+                {
+                    calibrate_osc_low_v(CALIB_MODE_APPROX, CALIB_VERIFY_CHARGE_WAIT_MS);
+                    drifted = !is_calib_value_within_tolerance(oe_calib_data.calib_osc_low_v, stored_calib_data.calib_osc_low_v, CALIB_THRESHOLD_TOLERANCE);
+                    break;
+                }
+                default:
+                {
+                    // Same closed loop ramp as the calibration
+                    calibrate_max_voltage();
+                    drifted = !is_calib_value_within_tolerance(oe_calib_data.max_voltage, stored_calib_data.max_voltage, CALIB_MAX_VOLTAGE_TOLERANCE);
+                    break;
+                }
+            }
+            calibdprintf("Section %u drifted: %u\r\n", section, drifted);
+            
+            if (drifted == FALSE)
+            {
+                oe_calib_data = stored_calib_data;
+                continue;
+            }
+            
+            // The drifted values were just measured and are kept, except the offsets: their verification uses less averaging and may skip the vbias offset
+            if (section == CALIB_SECTION_OFFSETS)
+            {
+                recalibrate_section(section, calib_mode);
+            }
+            else if (section == CALIB_SECTION_MAX_VOLTAGE)
+            {
+                // The vbias lookup table belongs to the max voltage section, it most likely drifted as well
+                calibrate_vbias_lut();
+            }
+        }
+        update_calib_section_meta(section, day, month, year);
+        recalibrated_sections |= (1 << section);
+    }
+    
+    // Store the recalibrated sections
+    if (recalibrated_sections != 0)
+    {
+        eeprom_write_block((void*)&oe_calib_data, (void*)EEP_OE_CALIB_DATA, sizeof(oe_calib_data));
+        eeprom_write_block((void*)calib_sections_meta, (void*)EEP_CALIB_SECTIONS_META, sizeof(calib_sections_meta));
+    }
+    calib_step_timings[CALIB_STEP_TOTAL] = get_calibration_time();
+    calibdprintf("Verification done in %ums, recalibrated sections: %02x\r\n", calib_step_timings[CALIB_STEP_TOTAL], recalibrated_sections);
+    stop_calibration_timer();
+    
+    return recalibrated_sections;
+}
+
 /*
  * Init calibration part
  */
@@ -441,6 +1096,16 @@ void init_calibration(void)
     calibdprintf_P(PSTR("-----------------------\r\n"));
     calibdprintf_P(PSTR("Calibration Init\r\n\r\n"));
     
+    // First boot after the eeprom layout change: the calibration sections metadata and vbias lookup table are old application data
+    if (eeprom_read_byte((uint8_t*)EEP_LAYOUT_VERSION) != EEPROM_LAYOUT_VERSION)
+    {
+        calibdprintf_P(PSTR("Eeprom layout change\r\n"));
+        memset((void*)calib_sections_meta, 0x00, sizeof(calib_sections_meta));
+        eeprom_write_block((void*)calib_sections_meta, (void*)EEP_CALIB_SECTIONS_META, sizeof(calib_sections_meta));
+        eeprom_write_byte((uint8_t*)EEP_VBIAS_LUT_VERSION, 0);
+        eeprom_write_byte((uint8_t*)EEP_LAYOUT_VERSION, EEPROM_LAYOUT_VERSION);
+    }
+    
     // Check if we stored calibration values in the eeprom
     if (eeprom_read_byte((uint8_t*)EEP_OE_CALIB_DONE_BOOL) == EEPROM_BOOL_OK_VAL)
     {        
@@ -461,10 +1126,31 @@ void init_calibration(void)
         {
             calibdprintf("Offset for ampl %u : %u\r\n", 1 << i, oe_calib_data.cur_measurement_offsets[i]);
         }
+        
+        // Sections metadata, the stale sections will be recalibrated by the next verification
+        eeprom_read_block((void*)calib_sections_meta, (void*)EEP_CALIB_SECTIONS_META, sizeof(calib_sections_meta));
+        for (uint8_t section = 0; section < NB_CALIB_SECTIONS; section++)
+        {
+            calibdprintf("Section %u from %d/%d/%d, stale: %u\r\n", section, calib_sections_meta[section].day, calib_sections_meta[section].month, calib_sections_meta[section].year, is_calib_section_stale(section));
+        }
         calib_ok = TRUE;
     }
     else
     {
         calibdprintf_P(PSTR("Platform not calibrated\r\n"));
     }
+    
+    // Check if we stored the vbias lookup table in the eeprom, only use it if it is intact and monotonic
+    if (eeprom_read_byte((uint8_t*)EEP_VBIAS_LUT_VERSION) == VBIAS_LUT_VERSION)
+    {
+        eeprom_read_block((void*)vbias_lut, (void*)EEP_VBIAS_LUT, sizeof(vbias_lut));
+        if ((eeprom_read_word((uint16_t*)EEP_VBIAS_LUT_CRC) == update_crc16_with_block(0xFFFF, (void*)vbias_lut, sizeof(vbias_lut))) && (is_vbias_lut_monotonic() == TRUE))
+        {
+            vbias_lut_ok = TRUE;
+        }
+        else
+        {
+            calibdprintf_P(PSTR("Vbias lookup table corrupted\r\n"));
+        }
+    }
 }
\ No newline at end of file
@@ -21,8 +21,31 @@
     #define calibdprintf_P
 #endif
 
+// enums
+enum calib_mode_t           {CALIB_MODE_RAMP = 0, CALIB_MODE_APPROX = 1};
+enum calib_section_t        {CALIB_SECTION_OFFSETS = 0, CALIB_SECTION_THRESHOLDS, CALIB_SECTION_OSC_LOW_V, CALIB_SECTION_MAX_VOLTAGE, NB_CALIB_SECTIONS};
+enum calib_step_t           {CALIB_STEP_TOTAL = 0, CALIB_STEP_SE_OFFSET, CALIB_STEP_VBIAS_OFFSET, CALIB_STEP_CUR_OFFSETS, CALIB_STEP_THRESHOLDS, CALIB_STEP_OSC_LOW_V, CALIB_STEP_VBIAS_LUT, CALIB_STEP_MAX_VOLTAGE, NB_CALIB_STEPS};
+
 // Defines
 #define THRESHOLD_AVG_BIT_SHIFT     6
+#define THRESHOLD_SCAN_SPAN         16      // Local ramps span this many DAC LSBs on each side of the approximated threshold
+#define VBIAS_DISCHARGE_SETTLE_MS   3210    // How long vbias takes to settle once discharged near 0V
+#define VBIAS_0V_SETTLE_MS          500     // How long we leave vbias at 0V before measuring its offset
+#define CALIB_OFFSETS_VERSION       1       // Offsets section format version
+#define CALIB_THRESHOLDS_VERSION    1       // Thresholds section format version
+#define CALIB_OSC_LOW_V_VERSION     1       // Oscillator low voltage section format version
+#define CALIB_MAX_VOLTAGE_VERSION   1       // Max voltage section format version
+#define VBIAS_LUT_VERSION           1       // Vbias lookup table format version
+#define CALIB_VERIFY_AVG_BIT_SHIFT  10      // Bit averaging for the offsets verification
+#define CALIB_OFFSET_TOLERANCE      4       // Offsets drift tolerance during the verification (LSB)
+#define CALIB_THRESHOLD_TOLERANCE   8       // Thresholds and oscillator low voltage drift tolerance during the verification (DAC LSB)
+#define CALIB_MAX_VOLTAGE_TOLERANCE 100     // Max voltage drift tolerance during the verification (mV)
+#define CALIB_CHARGE_WAIT_MS        1000    // How long we leave a possible cap between the terminals charge before measuring the thresholds
+#define CALIB_VERIFY_CHARGE_WAIT_MS 100     // Same, during the verification (terminals are expected open, as for the calibration)
+#define VBIAS_LUT_DAC_BIT_SHIFT     7       // DAC step between two vbias lookup table points, in bit shift
+#define VBIAS_LUT_NB_POINTS         32      // Number of points in the vbias lookup table
+#define VBIAS_LUT_SETTLE_MS         10      // How long we wait before measuring a vbias lookup table point
+#define VBIAS_LUT_NO_PREDICTION     0xFFFF  // Returned when the vbias lookup table can't predict a DAC value
 
 // Typedefs
 typedef struct oe_calib_data_struct
@@ -41,16 +64,29 @@ typedef struct oe_calib_data_struct
     uint8_t day;                            // Calibration data day
 } oe_calib_data_t;
 
+typedef struct calib_section_meta_struct
+{
+    uint8_t version;                        // Section format version
+    uint8_t year;                           // Section calibration year
+    uint8_t month;                          // Section calibration month
+    uint8_t day;                            // Section calibration day
+    uint16_t crc;                           // CRC16 of the section data
+} calib_section_meta_t;
+
 // Prototypes
-void start_openended_calibration(uint8_t day, uint8_t month, uint8_t year);
+uint8_t verify_openended_calibration(uint8_t day, uint8_t month, uint8_t year, uint8_t calib_mode);
+void start_openended_calibration(uint8_t day, uint8_t month, uint8_t year, uint8_t calib_mode);
 uint16_t get_offset_for_current_measurement(uint8_t ampl);
+uint16_t get_vbias_lut_dac_value(uint16_t val_mv);
 uint16_t get_single_ended_offset(uint8_t current_channel);
 uint8_t get_openended_calibration_data(uint8_t* buffer);
+uint8_t get_calibration_timings(uint8_t* buffer);
 uint16_t get_calib_second_thres_down(void);
 uint16_t get_calib_first_thres_down(void);
 uint16_t get_calib_second_thres_up(void);
 uint16_t get_calib_first_thres_up(void);
 void delete_cur_measurement_offsets(void);
+void calibrate_cur_measurement_offsets(void);
 void calibrate_single_ended_offset(void);
 void delete_single_ended_offset(void);
 uint8_t is_platform_calibrated(void);
@@ -0,0 +1,251 @@
+/*
+ * cap_report.c
+ *
+ * Created: 16/10/2026 20:12:33
+ *  Author: agent
+ */
+#include <string.h>
+#include <avr/io.h>
+#include "calibration.h"
+#include "cap_report.h"
+#include "usb.h"
+// Current report mode
+uint8_t cur_cap_report_mode = REPORT_MODE_SINGLE;
+// Last context sent in stream mode
+cap_stream_context_t last_stream_context;
+// Boolean to know if the host knows about our context
+uint8_t stream_context_valid = FALSE;
+// Last window sent in stream mode
+uint32_t last_stream_window[NB_STREAM_WINDOW_FIELDS];
+// Boolean to know if the next window can be encoded against the last one
+uint8_t stream_delta_valid = FALSE;
+
+
+/*
+ * Set the way capacitance reports are sent to the host
+ * @param   mode    Report mode (see enum cap_report_mode_t)
+ * @return  TRUE if the mode is supported
+ */
+uint8_t set_capacitance_report_mode(uint8_t mode)
+{
+    if (mode > REPORT_MODE_LAST)
+    {
+        return FALSE;
+    }
+    
+    cur_cap_report_mode = mode;
+    reset_capacitance_reports();
+    return TRUE;
+}
+
+/*
+ * Get the way capacitance reports are sent to the host
+ * @return  Report mode (see enum cap_report_mode_t)
+ */
+uint8_t get_capacitance_report_mode(void)
+{
+    return cur_cap_report_mode;
+}
+
+/*
+ * Discard the reports that weren't sent yet, reset the dropped reports counter
+ */
+void reset_capacitance_reports(void)
+{
+    usb_reset_dropped_packets();
+    report_packet.length = 0;
+    stream_context_valid = FALSE;
+}
+
+/*
+ * Send the pending report packet
+ * @param   command_id  Packet command ID
+ */
+void send_capacitance_report_packet(uint8_t command_id)
+{
+    report_packet.command_id = command_id;
+    if (usb_try_send_data((uint8_t*)&report_packet) == FALSE)
+    {
+        // Packet dropped, the host may have missed a context record
+        stream_context_valid = FALSE;
+    }
+    report_packet.length = 0;
+}
+
+/*
+ * Encode a value as an unsigned LEB128 varint (7 bits per byte, LSB first, MSB set if more bytes follow)
+ * @param   buffer  Where to store the varint, at least 5 bytes
+ * @param   value   The value to encode
+ * @return  Number of bytes written
+ */
+uint8_t encode_varint(uint8_t* buffer, uint32_t value)
+{
+    uint8_t nb_bytes = 0;
+    
+    while (value >= 0x80)
+    {
+        buffer[nb_bytes++] = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    buffer[nb_bytes++] = (uint8_t)value;
+    return nb_bytes;
+}
+
+/*
+ * Encode a stream window record: each field is the zigzag varint of its difference with the previous window field plus its expected increment
+ * @param   buffer          Where to store the record, at least STREAM_MAX_WINDOW_LENGTH bytes
+ * @param   window          The window fields
+ * @param   previous_window The previous window fields, NULL to encode against 0
+ * @param   increments      Expected increment of each field between two windows
+ * @return  Record length
+ */
+uint8_t encode_stream_window(uint8_t* buffer, uint32_t* window, uint32_t* previous_window, uint32_t* increments)
+{
+    uint8_t record_length = 0;
+    uint32_t delta;
+    
+    buffer[record_length++] = STREAM_TAG_WINDOW;
+    for (uint8_t i = 0; i < NB_STREAM_WINDOW_FIELDS; i++)
+    {
+        delta = window[i];
+        if (previous_window != 0)
+        {
+            delta -= previous_window[i] + increments[i];
+        }
+        // Zigzag: small negative deltas become small positive values
+        delta = (delta << 1) ^ (uint32_t)(((int32_t)delta) >> 31);
+        record_length += encode_varint(&buffer[record_length], delta);
+    }
+    return record_length;
+}
+
+/*
+ * Append a context record to the stream packet, the next window will be encoded against 0
+ * @param   context     Pointer to the context
+ */
+void append_stream_context(cap_stream_context_t* context)
+{
+    if (report_packet.length + 1 + sizeof(cap_stream_context_t) > sizeof(report_packet.payload))
+    {
+        send_capacitance_report_packet(CMD_CAP_MES_STREAM);
+    }
+    report_packet.payload[report_packet.length++] = STREAM_TAG_CONTEXT;
+    memcpy((void*)&report_packet.payload[report_packet.length], (void*)context, sizeof(cap_stream_context_t));
+    report_packet.length += sizeof(cap_stream_context_t);
+    memcpy((void*)&last_stream_context, (void*)context, sizeof(cap_stream_context_t));
+    stream_context_valid = TRUE;
+    stream_delta_valid = FALSE;
+}
+
+/*
+ * Send a capacitance report in the compact stream format.
+ * A context record is only sent when the range or calibration changes or after a dropped packet.
+ * The window following a context record is encoded against 0, the next ones against their
+ * previous window: the window index is expected to increment by one and the timestamp by the gate length.
+ * @param   cap_report  Pointer to the capacitance measurement report
+ */
+void stream_capacitance_report(capacitance_window_report_t* cap_report)
+{
+    uint32_t window[NB_STREAM_WINDOW_FIELDS] = {cap_report->counter_value, cap_report->aggregate_fall, cap_report->aggregate_rise, cap_report->counter_rise, cap_report->counter_fall, cap_report->window_index, cap_report->timestamp};
+    uint32_t increments[NB_STREAM_WINDOW_FIELDS] = {0, 0, 0, 0, 0, 1, 32000000UL >> cap_report->report_freq};
+    uint8_t record[STREAM_MAX_WINDOW_LENGTH];
+    cap_stream_context_t context;
+    uint8_t record_length;
+    
+    // Context for this window
+    context.counter_divider = cap_report->counter_divider;
+    context.report_freq = cap_report->report_freq;
+    context.half_res = cap_report->half_res;
+    context.second_thres = get_calib_second_thres_up();
+    context.first_thres = get_calib_first_thres_up();
+    context.vosc_low = get_calib_osc_low_v();
+    
+    // Send the context if it changed
+    if ((stream_context_valid == FALSE) || (memcmp((void*)&context, (void*)&last_stream_context, sizeof(context)) != 0))
+    {
+        append_stream_context(&context);
+    }
+    
+    // Encode the window, start a new packet if it doesn't fit
+    record_length = encode_stream_window(record, window, (stream_delta_valid == FALSE)? 0 : last_stream_window, increments);
+    if (report_packet.length + record_length > sizeof(report_packet.payload))
+    {
+        send_capacitance_report_packet(CMD_CAP_MES_STREAM);
+        
+        // If the packet got dropped the host lost our previous window
+        if (stream_context_valid == FALSE)
+        {
+            append_stream_context(&context);
+            record_length = encode_stream_window(record, window, 0, increments);
+        }
+    }
+    memcpy((void*)&report_packet.payload[report_packet.length], (void*)record, record_length);
+    memcpy((void*)last_stream_window, (void*)window, sizeof(window));
+    report_packet.length += record_length;
+    stream_delta_valid = TRUE;
+    
+    // Don't wait for the next window if it likely won't fit
+    if (report_packet.length + record_length > sizeof(report_packet.payload))
+    {
+        send_capacitance_report_packet(CMD_CAP_MES_STREAM);
+    }
+}
+
+/*
+ * Fill a legacy capacitance report (0x0C) from a compact one
+ * @param   report      Pointer to the legacy report
+ * @param   cap_report  Pointer to the compact capacitance measurement report
+ */
+void fill_legacy_capacitance_report(capacitance_report_t* report, capacitance_window_report_t* cap_report)
+{
+    report->counter_divider = cap_report->counter_divider;
+    report->aggregate_fall = cap_report->aggregate_fall;
+    report->counter_value = cap_report->counter_value;
+    // Hz as it always was, the faster rates don't fit in a byte
+    if (cap_report->report_freq <= LEGACY_REPORT_MAX_SHIFT)
+    {
+        report->report_freq = 1 << cap_report->report_freq;
+    } 
+    else
+    {
+        report->report_freq = 0;
+    }
+    report->half_res = cap_report->half_res;
+    report->second_thres = get_calib_second_thres_up();
+    report->first_thres = get_calib_first_thres_up();
+    report->aggregate_rise = cap_report->aggregate_rise;
+    report->counter_rise = cap_report->counter_rise;
+    report->counter_fall = cap_report->counter_fall;
+    report->vosc_low = get_calib_osc_low_v();
+    report->window_index = cap_report->window_index;
+    report->timestamp = cap_report->timestamp;
+}
+
+/*
+ * Send a capacitance report to the host, depending on the report mode
+ * @param   cap_report  Pointer to the capacitance measurement report
+ */
+void send_capacitance_report(capacitance_window_report_t* cap_report)
+{
+    if (cur_cap_report_mode == REPORT_MODE_STREAM)
+    {
+        stream_capacitance_report(cap_report);
+    }
+    else if (cur_cap_report_mode == REPORT_MODE_BATCH)
+    {
+        // Append the compact report to the pending packet, send it once full
+        memcpy((void*)&report_packet.payload[report_packet.length], (void*)cap_report, sizeof(capacitance_window_report_t));
+        report_packet.length += sizeof(capacitance_window_report_t);
+        if (report_packet.length >= NB_CAP_REPORTS_PER_BATCH*sizeof(capacitance_window_report_t))
+        {
+            send_capacitance_report_packet(CMD_CAP_MES_BATCH);
+        }
+    } 
+    else
+    {
+        // One legacy report per packet, also used in raw mode next to the raw edges packets
+        report_packet.length = sizeof(capacitance_report_t);
+        fill_legacy_capacitance_report((capacitance_report_t*)report_packet.payload, cap_report);
+        send_capacitance_report_packet(CMD_CAP_MES_REPORT);
+    }
+}
@@ -0,0 +1,53 @@
+/*
+ * cap_report.h
+ *
+ * Created: 16/10/2026 20:12:41
+ *  Author: agent
+ */ 
+
+
+#ifndef CAP_REPORT_H_
+#define CAP_REPORT_H_
+
+#include "measurement.h"
+#include "defines.h"
+
+// Number of compact capacitance reports we can fit inside one USB packet payload
+#define NB_CAP_REPORTS_PER_BATCH    (sizeof(((usb_message_t*)0)->payload) / sizeof(capacitance_window_report_t))
+// Highest report frequency the legacy report can hold in Hz, in bit shift (128Hz)
+#define LEGACY_REPORT_MAX_SHIFT     7
+// Stream format record tags
+#define STREAM_TAG_CONTEXT          0x01
+#define STREAM_TAG_WINDOW           0x02
+// Number of per window fields in the stream format
+#define NB_STREAM_WINDOW_FIELDS     7
+// Maximum length of a stream window record: tag + 5 bytes varint per field
+#define STREAM_MAX_WINDOW_LENGTH    (1 + 5*NB_STREAM_WINDOW_FIELDS)
+
+// typedefs
+typedef struct cap_stream_context_struct
+{
+    uint16_t counter_divider;                   // 32M time counter divider
+    uint8_t report_freq;                        // Report frequency bit shift
+    uint16_t half_res;                          // Resistor value / 2
+    uint16_t second_thres;                      // Second comparison threshold
+    uint16_t first_thres;                       // First comparison threshold
+    uint16_t vosc_low;                          // Oscillator low voltage
+} cap_stream_context_t;
+
+// enums
+enum cap_report_mode_t  {REPORT_MODE_SINGLE = 0, REPORT_MODE_BATCH = 1, REPORT_MODE_STREAM = 2, REPORT_MODE_RAW = 3, REPORT_MODE_LAST = REPORT_MODE_RAW};
+
+// prototypes
+void fill_legacy_capacitance_report(capacitance_report_t* report, capacitance_window_report_t* cap_report);
+uint8_t encode_stream_window(uint8_t* buffer, uint32_t* window, uint32_t* previous_window, uint32_t* increments);
+void stream_capacitance_report(capacitance_window_report_t* cap_report);
+void append_stream_context(cap_stream_context_t* context);
+void send_capacitance_report(capacitance_window_report_t* cap_report);
+void send_capacitance_report_packet(uint8_t command_id);
+uint8_t encode_varint(uint8_t* buffer, uint32_t value);
+uint8_t set_capacitance_report_mode(uint8_t mode);
+uint8_t get_capacitance_report_mode(void);
+void reset_capacitance_reports(void);
+
+#endif /* CAP_REPORT_H_ */
@@ -140,6 +140,9 @@ uint16_t get_val_for_freq_define(uint16_t define)
         case FREQ_32HZ:     return 32;
         case FREQ_64HZ:     return 64;
         case FREQ_128HZ:    return 128;
+        case FREQ_256HZ:    return 256;
+        case FREQ_512HZ:    return 512;
+        case FREQ_1KHZ:     return 1024;
     }
     return 0;
 }
@@ -156,11 +159,14 @@ uint8_t get_bit_shift_for_freq_define(uint16_t define)
         case FREQ_1HZ:      return 0;
         case FREQ_2HZ:      return 1;
         case FREQ_4HZ:      return 2;
-        case FREQ_8HZ:      return 4;
-        case FREQ_16HZ:     return 5;
-        case FREQ_32HZ:     return 6;
-        case FREQ_64HZ:     return 7;
-        case FREQ_128HZ:    return 8;
+        case FREQ_8HZ:      return 3;
+        case FREQ_16HZ:     return 4;
+        case FREQ_32HZ:     return 5;
+        case FREQ_64HZ:     return 6;
+        case FREQ_128HZ:    return 7;
+        case FREQ_256HZ:    return 8;
+        case FREQ_512HZ:    return 9;
+        case FREQ_1KHZ:     return 10;
     }
     return 0;    
 }
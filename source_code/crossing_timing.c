@@ -0,0 +1,207 @@
+/*
+ * crossing_timing.c
+ *
+ * Created: 16/10/2026 15:12:21
+ *  Author: agent
+ */
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <avr/io.h>
+#include "crossing_timing.h"
+#include "measurement.h"
+// TCE0 value captured at the last threshold crossing
+uint16_t last_crossing_capture;
+// Comparator that triggered the last threshold crossing
+uint8_t last_crossing_comparator = CROSSING_NONE;
+// Captures we may still process in the current window, bounds the interrupt load
+uint16_t crossing_captures_left;
+// Boolean set when the capture interrupts were stopped for the rest of the window
+uint8_t crossing_timing_overloaded = FALSE;
+// Threshold crossing aggregates & counters of the current window, kept apart from the T_FALL ones
+volatile uint32_t crossing_agg_fall;
+volatile uint32_t crossing_agg_rise;
+volatile uint32_t crossing_counter_fall;
+volatile uint32_t crossing_counter_rise;
+
+
+/*
+ * Add a threshold crossing to the current aggregates
+ * Going from the first to the second threshold is the t in C = -t / (R.ln(Vt2/Vt1)), aggregated as a fall
+ * Consecutive crossings of the same comparator (overshoot when the oscillator switches) are ignored
+ * @param   comparator  Comparator that triggered the capture
+ * @param   capture     TCE0 value captured at the crossing
+ */
+void add_threshold_crossing(uint8_t comparator, uint16_t capture)
+{
+    // The gate interrupt mustn't fire in the middle of the additions
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if ((comparator == CROSSING_AN2) && (last_crossing_comparator == CROSSING_AN1))
+        {
+            crossing_agg_fall += (uint16_t)(capture - last_crossing_capture);
+            crossing_counter_fall++;
+        }
+        else if ((comparator == CROSSING_AN1) && (last_crossing_comparator == CROSSING_AN2))
+        {
+            crossing_agg_rise += (uint16_t)(capture - last_crossing_capture);
+            crossing_counter_rise++;
+        }
+    }
+    last_crossing_capture = capture;
+    last_crossing_comparator = comparator;
+}
+
+/*
+ * Process the pending AN1_COMPOUT & AN2_COMPOUT captures in chronological order
+ */
+void process_threshold_crossings(void)
+{
+    uint8_t an1_pending = FALSE, an2_pending = FALSE;
+    uint16_t an1_capture = 0, an2_capture = 0;
+    uint16_t now;
+    
+    while (TRUE)
+    {
+        // Reading a capture pops it from the buffer, the flag stays set while captures are left
+        if ((an1_pending == FALSE) && (TCE0.INTFLAGS & TC0_CCAIF_bm))
+        {
+            an1_capture = TCE0.CCA;
+            an1_pending = TRUE;
+        }
+        if ((an2_pending == FALSE) && (TCE0.INTFLAGS & TC0_CCBIF_bm))
+        {
+            an2_capture = TCE0.CCB;
+            an2_pending = TRUE;
+        }
+        if ((an1_pending == FALSE) && (an2_pending == FALSE))
+        {
+            return;
+        }
+        
+        // Oscillating too fast for one interrupt per crossing: stop until the next window (the gate interrupt resets the budget)
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            if (crossing_captures_left == 0)
+            {
+                TCE0.INTCTRLB = TC_CCAINTLVL_OFF_gc | TC_CCBINTLVL_OFF_gc;
+                crossing_timing_overloaded = TRUE;
+                return;
+            }
+            crossing_captures_left--;
+        }
+        
+        // Oldest capture first
+        now = TCE0.CNT;
+        if ((an1_pending == TRUE) && ((an2_pending == FALSE) || ((uint16_t)(now - an1_capture) >= (uint16_t)(now - an2_capture))))
+        {
+            add_threshold_crossing(CROSSING_AN1, an1_capture);
+            an1_pending = FALSE;
+        }
+        else
+        {
+            add_threshold_crossing(CROSSING_AN2, an2_capture);
+            an2_pending = FALSE;
+        }
+    }
+}
+
+/*
+ * Channel A capture interrupt on TE0: AN1_COMPOUT edge
+ */
+ISR(TCE0_CCA_vect)
+{
+    process_threshold_crossings();
+}
+
+/*
+ * Channel B capture interrupt on TE0: AN2_COMPOUT edge
+ */
+ISR(TCE0_CCB_vect)
+{
+    process_threshold_crossings();
+}
+
+/*
+ * Report the crossings of the window that just ended and start timing the crossings of a new one, called by the gate interrupt
+ * Each oscillation gives 4 crossings: a window may take up to CROSSING_TIMING_MAX_OSC_FREQUENCY worth of them.
+ * A window stopped for taking too many keeps the T_FALL pulse widths already copied in it
+ * @param   window          The window that just ended
+ * @param   gate_bit_shift  Gate of the new window, 1Hz division bit shift
+ * @return  TRUE if the window was stopped for taking too many crossings
+ */
+uint8_t start_crossing_timing_window(volatile measurement_window_t* window, uint8_t gate_bit_shift)
+{
+    uint8_t return_value = crossing_timing_overloaded;
+    
+    if (crossing_timing_overloaded == FALSE)
+    {
+        window->aggregate_fall = crossing_agg_fall;
+        window->aggregate_rise = crossing_agg_rise;
+        window->counter_fall = crossing_counter_fall;
+        window->counter_rise = crossing_counter_rise;
+    }
+    crossing_agg_fall = 0;
+    crossing_agg_rise = 0;
+    crossing_counter_fall = 0;
+    crossing_counter_rise = 0;
+    crossing_captures_left = (CROSSING_TIMING_MAX_OSC_FREQUENCY * 4) >> gate_bit_shift;
+    if (crossing_timing_overloaded == TRUE)
+    {
+        // Empty the capture buffers, start over from the next crossing
+        (void)TCE0.CCA;
+        (void)TCE0.CCA;
+        (void)TCE0.CCB;
+        (void)TCE0.CCB;
+        TCE0.INTFLAGS = TC0_CCAIF_bm | TC0_CCBIF_bm | TC0_ERRIF_bm;
+        last_crossing_comparator = CROSSING_NONE;
+        crossing_timing_overloaded = FALSE;
+        TCE0.INTCTRLB = TC_CCAINTLVL_MED_gc | TC_CCBINTLVL_MED_gc;
+    }
+    return return_value;
+}
+
+/*
+ * Change the threshold crossing timer divider, must match the pulse width counter one
+ * @param   counter_divider Timer clock selection
+ */
+void set_crossing_timing_divider(uint8_t counter_divider)
+{
+    if (TCE0.CTRLA != TC_CLKSEL_OFF_gc)
+    {
+        TCE0.CTRLA = counter_divider;
+        last_crossing_comparator = CROSSING_NONE;
+    }
+}
+
+/*
+ * Time the threshold crossings with TE0: AN1_COMPOUT (event line 3) captured on A, AN2_COMPOUT (event line 4) on B
+ * @param   counter_divider Timer clock selection, same as the pulse width counter
+ */
+void enable_crossing_timing(uint8_t counter_divider)
+{
+    TCE0.CTRLA = TC_CLKSEL_OFF_gc;                                  // Stop timer
+    TCE0.CNT = 0;                                                   // Reset counter
+    TCE0.PER = 0xFFFF;                                              // Set max period
+    TCE0.CTRLB = TC0_CCAEN_bm | TC0_CCBEN_bm;                       // Enable compare A & B
+    TCE0.CTRLD = TC_EVACT_CAPT_gc | TC_EVSEL_CH3_gc;                // Capture event lines 3 & 4
+    TCE0.INTFLAGS = TC0_CCAIF_bm | TC0_CCBIF_bm | TC0_ERRIF_bm;     // Clear flags
+    TCE0.INTCTRLB = TC_CCAINTLVL_MED_gc | TC_CCBINTLVL_MED_gc;      // Medium level interrupts, below the gate one
+    last_crossing_comparator = CROSSING_NONE;                       // No crossing yet
+    crossing_captures_left = CROSSING_TIMING_MAX_OSC_FREQUENCY * 4; // Until the first gate
+    crossing_timing_overloaded = FALSE;                             // Not stopped
+    crossing_agg_fall = 0;                                          // Reset agg
+    crossing_agg_rise = 0;                                          // Reset agg
+    crossing_counter_fall = 0;                                      // Reset counter
+    crossing_counter_rise = 0;                                      // Reset counter
+    TCE0.CTRLA = counter_divider;                                   // Start timer
+}
+
+/*
+ * Stop timing the threshold crossings
+ */
+void disable_crossing_timing(void)
+{
+    TCE0.INTCTRLB = 0x00;                                           // Disable interrupts
+    TCE0.CTRLA = TC_CLKSEL_OFF_gc;                                  // Stop timer
+    TCE0.CTRLD = 0x00;                                              // Disable captures
+}
@@ -0,0 +1,27 @@
+/*
+ * crossing_timing.h
+ *
+ * Created: 16/10/2026 15:12:37
+ *  Author: agent
+ */ 
+
+
+#ifndef CROSSING_TIMING_H_
+#define CROSSING_TIMING_H_
+
+#include "measurement.h"
+#include "defines.h"
+
+// enums
+enum crossing_comparator_t  {CROSSING_NONE = 0, CROSSING_AN1 = 1, CROSSING_AN2 = 2};
+
+// defines
+#define CROSSING_TIMING_MAX_OSC_FREQUENCY   5000UL  // Above this oscillation frequency the crossing interrupts would take too much CPU
+
+// prototypes
+uint8_t start_crossing_timing_window(volatile measurement_window_t* window, uint8_t gate_bit_shift);
+void set_crossing_timing_divider(uint8_t counter_divider);
+void enable_crossing_timing(uint8_t counter_divider);
+void disable_crossing_timing(void);
+
+#endif /* CROSSING_TIMING_H_ */
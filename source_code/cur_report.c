@@ -0,0 +1,190 @@
+/*
+ * cur_report.c
+ *
+ * Created: 16/10/2026 17:03:31
+ *  Author: agent
+ */
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <avr/io.h>
+#include "measurement.h"
+#include "cur_report.h"
+#include "adc.h"
+#include "usb.h"
+// Boolean set while streaming current measurements
+uint8_t cur_stream_running = FALSE;
+// Averaging and reading rate, in bit shift
+uint8_t cur_stream_avg_bit_shift;
+uint8_t cur_stream_rate_bit_shift;
+// Number of readings per packet
+uint8_t cur_stream_nb_reports_per_packet;
+// Number of RTC periods since the stream start, counted by the RTC overflow interrupt
+volatile uint32_t cur_stream_tick;
+// Last tick handled by the stream loop
+uint32_t cur_stream_handled_tick;
+// Tick at which the running averaging started
+uint32_t cur_stream_averaging_tick;
+// Boolean set while an averaging is running, its result once collected
+uint8_t cur_stream_averaging;
+uint16_t cur_stream_value;
+// Packet sequence number
+uint8_t cur_stream_sequence;
+
+
+/*
+ * RTC overflow interrupt: one per current stream period
+ * Counted here rather than polled by the main loop so that periods aren't lost when it stalls (USB, vbias change...)
+ */
+ISR(RTC_OVF_vect)
+{
+    cur_stream_tick++;
+}
+
+/*
+ * Start streaming current measurements, current measurement mode must be set
+ * Every RTC period, the last averaging is reported and a new one started. If it isn't done yet, the period is skipped.
+ * Readings are timestamped in 32768Hz RTC ticks, which wrap around every 36 hours
+ * @param   avg_bit_shift   Bit shift for averaging
+ * @param   rate_bit_shift  Reading rate (0 is 1Hz, 1 is 2Hz, 2 is 4Hz... up to 10 for 1024Hz)
+ * @return  TRUE if the rate is supported
+ */
+uint8_t start_current_stream(uint8_t avg_bit_shift, uint8_t rate_bit_shift)
+{
+    if (rate_bit_shift > MAX_REPORT_FREQ_BIT_SHIFT)
+    {
+        return FALSE;
+    }
+    
+    cur_stream_avg_bit_shift = avg_bit_shift;
+    cur_stream_rate_bit_shift = rate_bit_shift;
+    if (rate_bit_shift <= CUR_STREAM_SINGLE_BIT_SHIFT)
+    {
+        cur_stream_nb_reports_per_packet = 1;
+    } 
+    else
+    {
+        cur_stream_nb_reports_per_packet = NB_CUR_REPORTS_PER_PACKET;
+    }
+    RTC.INTCTRL = 0;                            // The stream may be restarted, stop counting periods meanwhile
+    cur_stream_tick = 0;
+    cur_stream_handled_tick = 0;
+    cur_stream_sequence = 0;
+    report_packet.length = CUR_STREAM_HEADER_LENGTH;
+    
+    // RTC: 32kHz crystal, one overflow per reading
+    CLK.RTCCTRL = CLK_RTCSRC_TOSC32_gc | CLK_RTCEN_bm;
+    RTC.CTRL = RTC_PRESCALER_DIV1_gc;
+    while (RTC.STATUS & RTC_SYNCBUSY_bm);
+    RTC.CNT = 0;
+    while (RTC.STATUS & RTC_SYNCBUSY_bm);
+    RTC.PER = (32768 >> rate_bit_shift) - 1;
+    RTC.INTFLAGS = RTC_OVFIF_bm;
+    RTC.INTCTRL = RTC_OVFINTLVL_LO_gc;
+    
+    // First averaging starts now
+    start_cur_measurement(avg_bit_shift, 0);
+    cur_stream_averaging_tick = 0;
+    cur_stream_averaging = TRUE;
+    cur_stream_running = TRUE;
+    return TRUE;
+}
+
+/*
+ * Add a reading to the packet, send it when full
+ * @param   timestamp   Start of the averaging, 32768Hz ticks
+ * @param   value       Averaged ADC value
+ */
+void append_current_report(uint32_t timestamp, uint16_t value)
+{
+    cur_report_t* report = (cur_report_t*)&report_packet.payload[report_packet.length];
+    
+    report->timestamp = timestamp;
+    report->value = value;
+    report_packet.length += sizeof(cur_report_t);
+    
+    if (report_packet.length >= CUR_STREAM_HEADER_LENGTH + cur_stream_nb_reports_per_packet * sizeof(cur_report_t))
+    {
+        report_packet.command_id = CMD_CUR_MES_STREAM;
+        report_packet.payload[0] = cur_stream_sequence++;
+        report_packet.payload[1] = get_configured_adc_ampl();
+        report_packet.payload[2] = cur_stream_avg_bit_shift;
+        usb_try_send_data((uint8_t*)&report_packet);
+        report_packet.length = CUR_STREAM_HEADER_LENGTH;
+    }
+}
+
+/*
+ * Know if a stream averaging is using the ADC
+ * @return  TRUE if an averaging is running
+ */
+uint8_t is_current_stream_averaging(void)
+{
+    if ((cur_stream_running == TRUE) && (cur_stream_averaging == TRUE))
+    {
+        return TRUE;
+    } 
+    else
+    {
+        return FALSE;
+    }
+}
+
+/*
+ * Current stream loop, to be called from the main loop
+ */
+void current_stream_loop(void)
+{
+    uint8_t used_bit_shift;
+    uint32_t tick;
+    
+    if (cur_stream_running == FALSE)
+    {
+        return;
+    }
+    
+    // Collect the averaging once done, the ADC is then free for other users (vbias regulation) until the next period
+    if ((cur_stream_averaging == TRUE) && (get_cur_measurement_result(&cur_stream_value, &used_bit_shift) == TRUE))
+    {
+        cur_stream_averaging = FALSE;
+    }
+    
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        tick = cur_stream_tick;
+    }
+    if (tick == cur_stream_handled_tick)
+    {
+        return;
+    }
+    
+    // Periods missed while the main loop stalled are simply skipped, the timestamps stay right
+    cur_stream_handled_tick = tick;
+    
+    // Report the last averaging if it is done, skip this period if it is still running
+    if (cur_stream_averaging == FALSE)
+    {
+        append_current_report(cur_stream_averaging_tick << (15 - cur_stream_rate_bit_shift), cur_stream_value);
+    }
+    else if (get_adc_accumulation_state() == ADC_ACC_RUNNING)
+    {
+        return;
+    }
+    
+    // An averaging interrupted by another ADC user (vbias change...) is simply not reported
+    start_cur_measurement(cur_stream_avg_bit_shift, 0);
+    cur_stream_averaging_tick = tick;
+    cur_stream_averaging = TRUE;
+}
+
+/*
+ * Stop streaming current measurements
+ */
+void stop_current_stream(void)
+{
+    if (cur_stream_running == TRUE)
+    {
+        RTC.INTCTRL = 0;
+        abort_adc_accumulation();
+    }
+    cur_stream_running = FALSE;
+}
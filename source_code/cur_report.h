@@ -0,0 +1,34 @@
+/*
+ * cur_report.h
+ *
+ * Created: 16/10/2026 17:03:48
+ *  Author: agent
+ */ 
+
+
+#ifndef CUR_REPORT_H_
+#define CUR_REPORT_H_
+
+#include "defines.h"
+
+// Current stream packet header: sequence number + amplification + averaging bit shift
+#define CUR_STREAM_HEADER_LENGTH        3
+// Number of current reports we can fit inside one USB packet payload
+#define NB_CUR_REPORTS_PER_PACKET       ((sizeof(((usb_message_t*)0)->payload) - CUR_STREAM_HEADER_LENGTH) / sizeof(cur_report_t))
+// Up to this rate (in bit shift, 8Hz) each reading is sent in its own packet
+#define CUR_STREAM_SINGLE_BIT_SHIFT     3
+
+// typedefs
+typedef struct cur_report_struct
+{
+    uint32_t timestamp;                         // Start of the averaging, 32768Hz ticks since the stream start
+    uint16_t value;                             // Averaged ADC value
+} cur_report_t;
+
+// prototypes
+uint8_t start_current_stream(uint8_t avg_bit_shift, uint8_t rate_bit_shift);
+uint8_t is_current_stream_averaging(void);
+void current_stream_loop(void);
+void stop_current_stream(void);
+
+#endif /* CUR_REPORT_H_ */
@@ -0,0 +1,289 @@
+/*
+ * edge_capture.c
+ *
+ * Created: 16/10/2026 10:40:52
+ *  Author: agent
+ */
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <avr/io.h>
+#include "edge_capture.h"
+#include "measurement.h"
+#include "usb.h"
+// Pulse width captures, double buffered by DMA channels 0 & 1
+volatile uint16_t edge_captures[2][EDGE_BLOCK_SIZE];
+// COMPOUT state for each capture, double buffered by DMA channels 2 & 3
+// It is read right after the capture channel transfer, a few cycles after the capture: way shorter than the next pulse
+volatile uint8_t edge_directions[2][EDGE_BLOCK_SIZE];
+// Number of captures of each buffer already added to the aggregates
+volatile uint8_t edge_captures_aggregated[2];
+// Boolean set to stream the raw edges to the host
+uint8_t raw_edges_streaming = FALSE;
+// Raw edges packet to be sent by the main loop
+usb_message_t raw_edges_packet;
+// Boolean set when the raw edges packet is ready to be sent
+volatile uint8_t raw_edges_packet_ready = FALSE;
+// Block sequence number
+uint8_t edge_block_sequence = 0;
+
+
+/*
+ * Set up a DMA channel to store a block of captures
+ * @param   channel     The DMA channel
+ * @param   src_addr    Address to copy from
+ * @param   dest_addr   Buffer to copy to
+ * @param   burst_len   Number of bytes copied per capture
+ */
+void setup_edge_capture_dma_channel(volatile DMA_CH_t* channel, uint16_t src_addr, uint16_t dest_addr, uint8_t burst_len)
+{
+    channel->CTRLA = 0;                                                                 // Disable channel
+    channel->REPCNT = 0;                                                                // Unlimited repeats
+    channel->TRFCNT = EDGE_BLOCK_SIZE * burst_len;                                      // Block size
+    channel->TRIGSRC = DMA_CH_TRIGSRC_TCC0_CCA_gc;                                      // Triggered by a pulse width capture
+    channel->SRCADDR0 = (uint8_t)src_addr;                                              // Source address
+    channel->SRCADDR1 = (uint8_t)(src_addr >> 8);                                       // Source address
+    channel->SRCADDR2 = 0;                                                              // Source address
+    channel->DESTADDR0 = (uint8_t)dest_addr;                                            // Buffer address
+    channel->DESTADDR1 = (uint8_t)(dest_addr >> 8);                                     // Buffer address
+    channel->DESTADDR2 = 0;                                                             // Buffer address
+    if (burst_len == 2)
+    {
+        channel->ADDRCTRL = DMA_CH_SRCRELOAD_BURST_gc | DMA_CH_SRCDIR_INC_gc | DMA_CH_DESTRELOAD_BLOCK_gc | DMA_CH_DESTDIR_INC_gc;
+        channel->CTRLA = DMA_CH_REPEAT_bm | DMA_CH_SINGLE_bm | DMA_CH_BURSTLEN_2BYTE_gc;
+    } 
+    else
+    {
+        channel->ADDRCTRL = DMA_CH_SRCRELOAD_NONE_gc | DMA_CH_SRCDIR_FIXED_gc | DMA_CH_DESTRELOAD_BLOCK_gc | DMA_CH_DESTDIR_INC_gc;
+        channel->CTRLA = DMA_CH_REPEAT_bm | DMA_CH_SINGLE_bm | DMA_CH_BURSTLEN_1BYTE_gc;
+    }
+}
+
+/*
+ * Add the captures of a buffer that weren't aggregated yet to the current aggregates
+ * Must be called with interrupts disabled
+ * @param   buffer_index    Index of the buffer
+ * @param   nb_captures     Number of captures available in the buffer
+ */
+void aggregate_edge_captures(uint8_t buffer_index, uint8_t nb_captures)
+{
+    uint32_t agg_fall = 0, agg_rise = 0;
+    uint8_t nb_fall = 0, nb_rise = 0;
+    
+    for (uint8_t i = edge_captures_aggregated[buffer_index]; i < nb_captures; i++)
+    {
+        // Aggregate depending if the voltage is rising / falling
+        if ((edge_directions[buffer_index][i] & PIN6_bm) == 0)
+        {
+            agg_fall += edge_captures[buffer_index][i];
+            nb_fall++;
+        }
+        else
+        {
+            agg_rise += edge_captures[buffer_index][i];
+            nb_rise++;
+        }
+    }
+    
+    if (nb_captures > edge_captures_aggregated[buffer_index])
+    {
+        add_pulse_width_block(agg_fall, nb_fall, agg_rise, nb_rise);
+        edge_captures_aggregated[buffer_index] = nb_captures;
+    }
+}
+
+/*
+ * Get the number of captures or directions a DMA channel stored in its buffer
+ * @param   channel     The DMA channel
+ * @param   burst_len   Number of bytes copied per capture
+ * @return  the number of captures in the buffer
+ */
+uint8_t get_edge_buffer_fill(volatile DMA_CH_t* channel, uint8_t burst_len)
+{
+    if (channel->CTRLB & DMA_CH_TRNIF_bm)
+    {
+        return EDGE_BLOCK_SIZE;
+    }
+    return EDGE_BLOCK_SIZE - channel->TRFCNT / burst_len;
+}
+
+/*
+ * Check that the capture and direction channels of a buffer are in step
+ * Both are triggered by the TCC0 CCA capture: each DMA channel latches the trigger in its own pending flag, so the capture
+ * channel reading TCC0.CCA first (fixed priority) doesn't cancel the direction transfer. At most one direction may lag
+ * while the DMA serves the capture channel, more means a capture lost its direction
+ * @param   capture_channel     Capture DMA channel of the buffer
+ * @param   direction_channel   Direction DMA channel of the buffer
+ * @return  TRUE if in step
+ */
+uint8_t are_edge_buffer_channels_in_step(volatile DMA_CH_t* capture_channel, volatile DMA_CH_t* direction_channel)
+{
+    uint8_t nb_captures = get_edge_buffer_fill(capture_channel, 2);
+    uint8_t nb_directions = get_edge_buffer_fill(direction_channel, 1);
+    
+    if ((nb_captures > nb_directions + 1) || (nb_directions > nb_captures))
+    {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Add the captures collected by the DMA since the last block completion to the current aggregates
+ * Called by the gate interrupt so the captures are accounted in the window they belong to
+ */
+void aggregate_pending_edge_captures(void)
+{
+    // Both blocks complete: the block interrupt came too late and the DMA is rewriting a buffer that wasn't aggregated
+    if (((DMA.CH2.CTRLB & DMA_CH_TRNIF_bm) && (DMA.CH3.CTRLB & DMA_CH_TRNIF_bm)) || (are_edge_buffer_channels_in_step(&DMA.CH0, &DMA.CH2) == FALSE) || (are_edge_buffer_channels_in_step(&DMA.CH1, &DMA.CH3) == FALSE))
+    {
+        discard_corrupted_cap_measurements();
+    }
+    
+    // Direction channels are served last: a capture is complete once its direction is stored
+    if (DMA.CH2.CTRLB & DMA_CH_TRNIF_bm)
+    {
+        aggregate_edge_captures(0, EDGE_BLOCK_SIZE);
+    }
+    else
+    {
+        aggregate_edge_captures(0, EDGE_BLOCK_SIZE - DMA.CH2.TRFCNT);
+    }
+    if (DMA.CH3.CTRLB & DMA_CH_TRNIF_bm)
+    {
+        aggregate_edge_captures(1, EDGE_BLOCK_SIZE);
+    }
+    else
+    {
+        aggregate_edge_captures(1, EDGE_BLOCK_SIZE - DMA.CH3.TRFCNT);
+    }
+}
+
+/*
+ * Process a complete block of captures: add it to the window aggregates and prepare the raw edges packet
+ * @param   buffer_index    Index of the complete buffer
+ */
+void process_edge_block(uint8_t buffer_index)
+{
+    uint16_t cur_pulse_width;
+    
+    // The gate interrupt may have aggregated part of the block already, and mustn't see the flag set once it's fully aggregated
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        // Other block complete as well: the DMA went back to this buffer before we aggregated it, captures were lost or will be counted twice
+        if (((buffer_index == 0) && (DMA.CH3.CTRLB & DMA_CH_TRNIF_bm)) || ((buffer_index == 1) && (DMA.CH2.CTRLB & DMA_CH_TRNIF_bm)))
+        {
+            discard_corrupted_cap_measurements();
+        }
+        
+        aggregate_edge_captures(buffer_index, EDGE_BLOCK_SIZE);
+        edge_captures_aggregated[buffer_index] = 0;
+        if (buffer_index == 0)
+        {
+            DMA.CH0.CTRLB |= DMA_CH_TRNIF_bm;
+            DMA.CH2.CTRLB |= DMA_CH_TRNIF_bm;
+        } 
+        else
+        {
+            DMA.CH1.CTRLB |= DMA_CH_TRNIF_bm;
+            DMA.CH3.CTRLB |= DMA_CH_TRNIF_bm;
+        }
+    }
+    
+    // Only overwrite the raw edges packet if the main loop sent the previous one
+    if ((raw_edges_streaming == TRUE) && (raw_edges_packet_ready == FALSE))
+    {
+        raw_edges_packet.payload[0] = edge_block_sequence;
+        raw_edges_packet.payload[1] = get_measurement_range();
+        raw_edges_packet.payload[2] = 0;
+        raw_edges_packet.payload[3] = 0;
+        raw_edges_packet.payload[4] = 0;
+        raw_edges_packet.payload[5] = 0;
+        for (uint8_t i = 0; i < EDGE_BLOCK_SIZE; i++)
+        {
+            cur_pulse_width = edge_captures[buffer_index][i];
+            raw_edges_packet.payload[6 + 2*i] = (uint8_t)cur_pulse_width;
+            raw_edges_packet.payload[7 + 2*i] = (uint8_t)(cur_pulse_width >> 8);
+            if ((edge_directions[buffer_index][i] & PIN6_bm) != 0)
+            {
+                raw_edges_packet.payload[2 + (i >> 3)] |= (1 << (i & 0x07));
+            }
+        }
+        raw_edges_packet_ready = TRUE;
+    }
+    edge_block_sequence++;
+}
+
+/*
+ * DMA channel 2 transaction complete: first buffer is full
+ * Direction channels have the lowest priority, so the capture channel is done as well
+ */
+ISR(DMA_CH2_vect)
+{
+    process_edge_block(0);
+}
+
+/*
+ * DMA channel 3 transaction complete: second buffer is full
+ */
+ISR(DMA_CH3_vect)
+{
+    process_edge_block(1);
+}
+
+/*
+ * Choose if the raw edges are streamed to the host
+ * @param   enable  TRUE to send the raw edges packets
+ */
+void set_raw_edges_streaming(uint8_t enable)
+{
+    raw_edges_streaming = enable;
+}
+
+/*
+ * Let the DMA collect the pulse width captures
+ */
+void enable_edge_capture(void)
+{
+    DMA.CTRL = 0;                                                                       // Disable DMA
+    DMA.CTRL = DMA_RESET_bm;                                                            // Reset DMA
+    while (DMA.CTRL & DMA_RESET_bm);                                                    // Wait for reset
+    DMA.CTRL = DMA_DBUFMODE_CH01CH23_gc | DMA_PRIMODE_CH0123_gc;                        // Double buffering, fixed priority: captures first
+    setup_edge_capture_dma_channel(&DMA.CH0, (uint16_t)&TCC0.CCA, (uint16_t)edge_captures[0], 2);
+    setup_edge_capture_dma_channel(&DMA.CH1, (uint16_t)&TCC0.CCA, (uint16_t)edge_captures[1], 2);
+    setup_edge_capture_dma_channel(&DMA.CH2, (uint16_t)&PORTA.IN, (uint16_t)edge_directions[0], 1);
+    setup_edge_capture_dma_channel(&DMA.CH3, (uint16_t)&PORTA.IN, (uint16_t)edge_directions[1], 1);
+    DMA.CH2.CTRLB = DMA_CH_TRNINTLVL_LO_gc;                                             // Low level interrupt on block complete
+    DMA.CH3.CTRLB = DMA_CH_TRNINTLVL_LO_gc;                                             // Low level interrupt on block complete
+    raw_edges_packet_ready = FALSE;                                                     // Nothing to send yet
+    edge_captures_aggregated[0] = 0;                                                    // Nothing aggregated yet
+    edge_captures_aggregated[1] = 0;                                                    // Nothing aggregated yet
+    edge_block_sequence = 0;                                                            // Reset sequence
+    DMA.CH0.CTRLA |= DMA_CH_ENABLE_bm;                                                  // Enable capture channel, second one enabled by double buffering
+    DMA.CH2.CTRLA |= DMA_CH_ENABLE_bm;                                                  // Enable direction channel, second one enabled by double buffering
+    DMA.CTRL |= DMA_ENABLE_bm;                                                          // Enable DMA
+}
+
+/*
+ * Stop collecting captures through the DMA
+ */
+void disable_edge_capture(void)
+{
+    DMA.CTRL = 0;                                                                       // Disable DMA
+    DMA.CH2.CTRLB = 0;                                                                  // Disable interrupts
+    DMA.CH3.CTRLB = 0;                                                                  // Disable interrupts
+    raw_edges_packet_ready = FALSE;                                                     // Discard pending packet
+}
+
+/*
+ * Send the raw edges packet when one is ready
+ */
+void edge_capture_loop(void)
+{
+    if (raw_edges_packet_ready == TRUE)
+    {
+        raw_edges_packet.length = 2 + 4 + 2*EDGE_BLOCK_SIZE;
+        raw_edges_packet.command_id = CMD_CAP_RAW_EDGES;
+        usb_try_send_data((uint8_t*)&raw_edges_packet);
+        raw_edges_packet_ready = FALSE;
+    }
+}
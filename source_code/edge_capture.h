@@ -0,0 +1,24 @@
+/*
+ * edge_capture.h
+ *
+ * Created: 16/10/2026 10:41:07
+ *  Author: agent
+ */ 
+
+
+#ifndef EDGE_CAPTURE_H_
+#define EDGE_CAPTURE_H_
+
+#include "defines.h"
+
+// Number of captures in a DMA block: sequence + range + 4 bytes direction bitmap + 28 * 2 bytes = 62 bytes payload
+#define EDGE_BLOCK_SIZE     28
+
+// prototypes
+void set_raw_edges_streaming(uint8_t enable);
+void aggregate_pending_edge_captures(void);
+void enable_edge_capture(void);
+void disable_edge_capture(void);
+void edge_capture_loop(void);
+
+#endif /* EDGE_CAPTURE_H_ */
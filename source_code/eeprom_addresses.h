@@ -11,14 +11,21 @@
 
 // Bool define
 #define EEPROM_BOOL_OK_VAL          0xDD
+// Eeprom layout version, the calibration sections metadata and vbias lookup table took over the end of the application data
+#define EEPROM_LAYOUT_VERSION       1
 
 // Address defines
 #define EEP_OE_CALIB_DONE_BOOL      0
 #define EEP_OE_CALIB_DATA           1
 #define EEP_FUNC_TEST_DONE_BOOL     34
+#define EEP_LAYOUT_VERSION          35
 #define EEP_APP_STORED_DATA         50
+#define EEP_CALIB_SECTIONS_META     933
+#define EEP_VBIAS_LUT_VERSION       957
+#define EEP_VBIAS_LUT_CRC           958
+#define EEP_VBIAS_LUT               960
 
 // Size defines
-#define APP_STORED_DATA_MAX_SIZE    (1024-EEP_APP_STORED_DATA)
+#define APP_STORED_DATA_MAX_SIZE    (EEP_CALIB_SECTIONS_META-EEP_APP_STORED_DATA)
 
 #endif /* EEPROM_ADDRESSES_H_ */
\ No newline at end of file
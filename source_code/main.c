@@ -15,8 +15,11 @@
 #include "automated_testing.h"
 #include "eeprom_addresses.h"
 #include "conversions.h"
+#include "edge_capture.h"
 #include "measurement.h"
 #include "calibration.h"
+#include "cap_report.h"
+#include "cur_report.h"
 #include "interrupts.h"
 #include "meas_io.h"
 #include "serial.h"
@@ -35,7 +38,7 @@ uint16_t bootloader_start_var __attribute__ ((section (".noinit")));
 #define RCOSC32M_offset  0x03
 #define RCOSC32MA_offset 0x04
 // Capacitance report
-capacitance_report_t cap_report;
+capacitance_window_report_t cap_report;
 // USB message
 usb_message_t usb_packet;
 
@@ -93,19 +96,90 @@ int main(void)
     functional_test();                              // Functional test if started for the first time
 
     uint8_t current_fw_mode = MODE_IDLE;
+    uint8_t cur_measurement_pending = FALSE;
+    uint8_t vbias_reply_pending = 0;
+    uint8_t vbias_settling;
     while(1)
     {
+        // Step the vbias state machine, answer the vbias command once the bias voltage settled
+        vbias_settling = vbias_state_machine_step();
+        if ((vbias_settling == FALSE) && (vbias_reply_pending != 0))
+        {
+            usb_packet.command_id = vbias_reply_pending;
+            if (vbias_reply_pending == CMD_SET_VBIAS)
+            {
+                uint16_t set_vbias = get_last_measured_vbias();
+                uint16_t cur_dacv = get_current_vbias_dac_value();
+                uint32_t settling_time = get_last_vbias_settling_time();
+                usb_packet.length = 8;
+                memcpy((void*)usb_packet.payload, (void*)&set_vbias, sizeof(set_vbias));
+                memcpy((void*)&usb_packet.payload[2], (void*)&cur_dacv, sizeof(cur_dacv));
+                memcpy((void*)&usb_packet.payload[4], (void*)&settling_time, sizeof(settling_time));
+                usb_send_data((uint8_t*)&usb_packet);
+                
+                // If we are measuring anything, resume measurements
+                if (current_fw_mode == MODE_CAP_MES)
+                {
+                    resume_capacitance_measurement_mode();
+                }
+            } 
+            else
+            {
+                usb_packet.length = 0;
+                usb_send_data((uint8_t*)&usb_packet);
+            }
+            vbias_reply_pending = 0;
+        }
+        
+        if ((current_fw_mode == MODE_CURRENT_MES) && (cur_measurement_pending == TRUE))
+        {
+            // Send the current measurement once the ADC accumulation is done
+            uint16_t return_value;
+            uint8_t used_bitshift;
+            if (get_cur_measurement_result(&return_value, &used_bitshift) == TRUE)
+            {
+                cur_measurement_pending = FALSE;
+                usb_packet.command_id = CMD_CUR_MES_MODE;
+                memcpy((void*)usb_packet.payload, (void*)&return_value, sizeof(return_value));
+                usb_packet.payload[2] = used_bitshift;
+                usb_packet.length = 3;
+                usb_send_data((uint8_t*)&usb_packet);
+            }
+        }
+        
+        // Trim the bias voltage in the background, when no current measurement uses the ADC, at a gate during capacitance measurements
+        if ((vbias_settling == FALSE) && (cur_measurement_pending == FALSE) && (is_current_stream_averaging() == FALSE))
+        {
+            if (current_fw_mode == MODE_CAP_MES)
+            {
+                vbias_regulation_loop(TRUE);
+            } 
+            else
+            {
+                vbias_regulation_loop(FALSE);
+            }
+        }
+        
+        // Stream the current measurements, the ADC is used by the vbias state machine while the bias voltage settles
+        if ((current_fw_mode == MODE_CURRENT_MES) && (vbias_settling == FALSE))
+        {
+            current_stream_loop();
+        }
+        
         if (current_fw_mode == MODE_CAP_MES)
         {
             // If we are in cap measurement mode and have a report to send
             if(cap_measurement_loop(&cap_report) == TRUE)
             {
                 maindprintf_P(PSTR("*"));
-                usb_packet.length = sizeof(cap_report);
-                usb_packet.command_id = CMD_CAP_MES_REPORT;
-                memcpy((void*)usb_packet.payload, (void*)&cap_report, sizeof(cap_report));
-                usb_send_data((uint8_t*)&usb_packet);
+                send_capacitance_report(&cap_report);
+                
+                // Right after a window: the regulation trim only corrupts the window in progress, which is discarded
+                trim_vbias_at_gate();
             }
+            
+            // Send the raw edges collected by the DMA
+            edge_capture_loop();
         }
         
         // USB command parser
@@ -157,12 +231,18 @@ int main(void)
                 case CMD_OE_CALIB_START:
                 {
                     maindprintf_P(PSTR("USB- Calib start\r\n"));
-                    // Check if we are in idle mode
-                    if (current_fw_mode == MODE_IDLE)
+                    // Check if we are in idle mode, and not in the middle of a vbias change
+                    if ((current_fw_mode == MODE_IDLE) && (vbias_settling == FALSE) && (vbias_reply_pending == 0))
                     {
-                        // Calibration start
-                        start_openended_calibration(usb_packet.payload[0], usb_packet.payload[1], usb_packet.payload[2]);
+                        // Calibration start, optional fourth byte for the calibration mode
+                        uint8_t calib_mode = CALIB_MODE_RAMP;
+                        if (usb_packet.length >= 4)
+                        {
+                            calib_mode = usb_packet.payload[3];
+                        }
+                        start_openended_calibration(usb_packet.payload[0], usb_packet.payload[1], usb_packet.payload[2], calib_mode);
                         usb_packet.length = get_openended_calibration_data(usb_packet.payload);
+                        usb_packet.length += get_calibration_timings(&usb_packet.payload[usb_packet.length]);
                     }
                     else
                     {
@@ -172,6 +252,32 @@ int main(void)
                     usb_send_data((uint8_t*)&usb_packet);    
                     break;                
                 }
+                case CMD_OE_CALIB_VERIFY:
+                {
+                    maindprintf_P(PSTR("USB- Calib verify\r\n"));
+                    // Check if we are in idle mode, not in the middle of a vbias change and have a calibration to verify
+                    if ((current_fw_mode == MODE_IDLE) && (vbias_settling == FALSE) && (vbias_reply_pending == 0) && (is_platform_calibrated() == TRUE))
+                    {
+                        // Verification start, optional fourth byte for the recalibrations mode
+                        uint8_t calib_mode = CALIB_MODE_RAMP;
+                        if (usb_packet.length >= 4)
+                        {
+                            calib_mode = usb_packet.payload[3];
+                        }
+                        usb_packet.payload[1] = verify_openended_calibration(usb_packet.payload[0], usb_packet.payload[1], usb_packet.payload[2], calib_mode);
+                        usb_packet.payload[0] = USB_RETURN_OK;
+                        // Only keep the total duration, the first of the timings
+                        get_calibration_timings(&usb_packet.payload[2]);
+                        usb_packet.length = 4;
+                    }
+                    else
+                    {
+                        usb_packet.length = 1;
+                        usb_packet.payload[0] = USB_RETURN_ERROR;
+                    }
+                    usb_send_data((uint8_t*)&usb_packet);
+                    break;
+                }
                 case CMD_GET_OE_CALIB:
                 {
                     maindprintf_P(PSTR("USB- Calib data\r\n"));
@@ -182,39 +288,64 @@ int main(void)
                 }
                 case CMD_SET_VBIAS:
                 {
+                    // Refuse the command while another vbias change or a current measurement (the ADC would be taken from it) is in progress
+                    if ((vbias_settling == TRUE) || (vbias_reply_pending != 0) || (cur_measurement_pending == TRUE))
+                    {
+                        usb_packet.length = 1;
+                        usb_packet.payload[0] = USB_RETURN_ERROR;
+                        usb_send_data((uint8_t*)&usb_packet);
+                        break;
+                    }
+                    
                     // Check that we are not measuring anything and if so, skip samples and stop oscillation
                     if (current_fw_mode == MODE_CAP_MES)
                     {
                         pause_capacitance_measurement_mode();
                     }
                     
-                    // Enable and set vbias... can also be called to update it
+                    // Enable and set vbias... can also be called to update it, answer is sent once the voltage settled
                     uint16_t* temp_vbias = (uint16_t*)usb_packet.payload;
-                    uint16_t set_vbias = enable_bias_voltage(*temp_vbias);
-                    uint16_t cur_dacv = get_current_vbias_dac_value();
-                    usb_packet.length = 4;
-                    memcpy((void*)usb_packet.payload, (void*)&set_vbias, sizeof(set_vbias));
-                    memcpy((void*)&usb_packet.payload[2], (void*)&cur_dacv, sizeof(cur_dacv));
-                    usb_send_data((uint8_t*)&usb_packet);
-                    
-                    // If we are measuring anything, resume measurements
-                    if (current_fw_mode == MODE_CAP_MES)
+                    start_bias_voltage_enable(*temp_vbias);
+                    vbias_reply_pending = CMD_SET_VBIAS;
+                    break;
+                }
+                case CMD_VBIAS_REGULATION:
+                {
+                    // Set the regulation band if given, answer with the regulation report
+                    if (usb_packet.length >= 2)
                     {
-                        resume_capacitance_measurement_mode();
-                    }                    
+                        uint16_t* band_mv = (uint16_t*)usb_packet.payload;
+                        set_vbias_regulation(*band_mv);
+                    }
+                    usb_packet.payload[0] = USB_RETURN_OK;
+                    usb_packet.length = 1 + get_vbias_regulation_report(&usb_packet.payload[1]);
+                    usb_send_data((uint8_t*)&usb_packet);
                     break;
                 }
                 case CMD_DISABLE_VBIAS:
                 {
-                    // Disable vbias
-                    usb_packet.length = 0;
-                    disable_bias_voltage();
-                    usb_send_data((uint8_t*)&usb_packet);
+                    // Disable vbias, answer is sent once the voltage is low enough, refused while another vbias change or a current measurement is in progress
+                    if ((vbias_settling == TRUE) || (vbias_reply_pending != 0) || (cur_measurement_pending == TRUE))
+                    {
+                        usb_packet.length = 1;
+                        usb_packet.payload[0] = USB_RETURN_ERROR;
+                        usb_send_data((uint8_t*)&usb_packet);
+                        break;
+                    }
+                    start_bias_voltage_disable();
+                    vbias_reply_pending = CMD_DISABLE_VBIAS;
                     break;
                 }
                 case CMD_CUR_MES_MODE:
                 {
-                    // Enable current measurement or start another measurement
+                    // Enable current measurement or start another measurement, the ADC is used by the vbias state machine while the bias voltage settles
+                    if (vbias_settling == TRUE)
+                    {
+                        usb_packet.length = 1;
+                        usb_packet.payload[0] = USB_RETURN_ERROR;
+                        usb_send_data((uint8_t*)&usb_packet);
+                        break;
+                    }
                     if (current_fw_mode == MODE_IDLE)
                     {
                         set_current_measurement_mode(usb_packet.payload[0]);
@@ -229,11 +360,15 @@ int main(void)
                             // If the amplification isn't the same one as requested
                             set_current_measurement_mode(usb_packet.payload[0]);
                         }
-                        // Start measurement
-                        usb_packet.length = 2;
-                        uint16_t return_value = cur_measurement_loop(usb_packet.payload[1]);
-                        memcpy((void*)usb_packet.payload, (void*)&return_value, sizeof(return_value));
-                        usb_send_data((uint8_t*)&usb_packet);
+                        // Start measurement in the background, with an optional tolerance to stop averaging early, answer sent once done
+                        uint16_t tolerance = 0;
+                        if (usb_packet.length >= 4)
+                        {
+                            tolerance = usb_packet.payload[2] | ((uint16_t)usb_packet.payload[3] << 8);
+                        }
+                        stop_current_stream();
+                        start_cur_measurement(usb_packet.payload[1], tolerance);
+                        cur_measurement_pending = TRUE;
                     }
                     else
                     {
@@ -248,6 +383,9 @@ int main(void)
                     if (current_fw_mode == MODE_CURRENT_MES)
                     {
                         usb_packet.payload[0] = USB_RETURN_OK;
+                        abort_adc_accumulation();
+                        stop_current_stream();
+                        cur_measurement_pending = FALSE;
                         disable_current_measurement_mode();
                         current_fw_mode = MODE_IDLE;
                     }
@@ -259,11 +397,93 @@ int main(void)
                     usb_send_data((uint8_t*)&usb_packet);
                     break;                    
                 }
+                case CMD_CUR_MES_STREAM:
+                {
+                    // Stream current measurements: amplification, averaging and rate in bit shift
+                    if (vbias_settling == TRUE)
+                    {
+                        usb_packet.length = 1;
+                        usb_packet.payload[0] = USB_RETURN_ERROR;
+                        usb_send_data((uint8_t*)&usb_packet);
+                        break;
+                    }
+                    if (current_fw_mode == MODE_IDLE)
+                    {
+                        set_current_measurement_mode(usb_packet.payload[0]);
+                        current_fw_mode = MODE_CURRENT_MES;
+                    }
+                    if (current_fw_mode == MODE_CURRENT_MES)
+                    {
+                        if (get_configured_adc_ampl() != usb_packet.payload[0])
+                        {
+                            set_current_measurement_mode(usb_packet.payload[0]);
+                        }
+                        cur_measurement_pending = FALSE;
+                        if (start_current_stream(usb_packet.payload[1], usb_packet.payload[2]) == TRUE)
+                        {
+                            usb_packet.payload[0] = USB_RETURN_OK;
+                        } 
+                        else
+                        {
+                            usb_packet.payload[0] = USB_RETURN_ERROR;
+                        }
+                    }
+                    else
+                    {
+                        usb_packet.payload[0] = USB_RETURN_ERROR;
+                    }
+                    usb_packet.length = 1;
+                    usb_send_data((uint8_t*)&usb_packet);
+                    break;
+                }
                 case CMD_CAP_REPORT_FREQ:
+                {
+                    if ((current_fw_mode == MODE_IDLE) && (set_capacitance_report_frequency(usb_packet.payload[0]) == TRUE))
+                    {
+                        usb_packet.payload[0] = USB_RETURN_OK;
+                    }
+                    else
+                    {
+                        usb_packet.payload[0] = USB_RETURN_ERROR;
+                    }
+                    usb_packet.length = 1;
+                    usb_send_data((uint8_t*)&usb_packet);
+                    break;
+                }
+                case CMD_CAP_REPORT_MODE:
+                {
+                    if ((current_fw_mode == MODE_IDLE) && (set_capacitance_report_mode(usb_packet.payload[0]) == TRUE))
+                    {
+                        usb_packet.payload[0] = USB_RETURN_OK;
+                    }
+                    else
+                    {
+                        usb_packet.payload[0] = USB_RETURN_ERROR;
+                    }
+                    usb_packet.length = 1;
+                    usb_send_data((uint8_t*)&usb_packet);
+                    break;
+                }
+                case CMD_CAP_MES_OPTIONS:
+                {
+                    if ((current_fw_mode == MODE_IDLE) && (set_capacitance_measurement_options(usb_packet.payload[0]) == TRUE))
+                    {
+                        usb_packet.payload[0] = USB_RETURN_OK;
+                    }
+                    else
+                    {
+                        usb_packet.payload[0] = USB_RETURN_ERROR;
+                    }
+                    usb_packet.length = 1;
+                    usb_send_data((uint8_t*)&usb_packet);
+                    break;
+                }
+                case CMD_CAP_PRECISION:
                 {
                     if (current_fw_mode == MODE_IDLE)
                     {
-                        set_capacitance_report_frequency(usb_packet.payload[0]);
+                        uint16_t* target_ppm = (uint16_t*)usb_packet.payload;
+                        set_capacitance_precision_target(*target_ppm);
                         usb_packet.payload[0] = USB_RETURN_OK;
                     }
                     else
@@ -274,11 +494,23 @@ int main(void)
                     usb_send_data((uint8_t*)&usb_packet);
                     break;
                 }
+                case CMD_GET_DROPPED_REPORTS:
+                {
+                    // Number of report packets dropped since the measurement start
+                    uint16_t nb_dropped = usb_get_nb_dropped_packets();
+                    usb_packet.length = sizeof(nb_dropped);
+                    memcpy((void*)usb_packet.payload, (void*)&nb_dropped, sizeof(nb_dropped));
+                    usb_send_data((uint8_t*)&usb_packet);
+                    break;
+                }
                 case CMD_CAP_MES_START:
                 {
-                    if (current_fw_mode == MODE_IDLE)
+                    // Refused in the middle of a vbias change, the measurement would start on a moving bias voltage
+                    if ((current_fw_mode == MODE_IDLE) && (vbias_settling == FALSE) && (vbias_reply_pending == 0))
                     {
                         current_fw_mode = MODE_CAP_MES;
+                        reset_capacitance_reports();
+                        set_raw_edges_streaming(get_capacitance_report_mode() == REPORT_MODE_RAW);
                         set_capacitance_measurement_mode();
                         usb_packet.payload[0] = USB_RETURN_OK;
                     }
@@ -311,8 +543,9 @@ int main(void)
                     uint16_t* requested_dac_val = (uint16_t*)usb_packet.payload;
                     uint16_t* requested_wait = (uint16_t*)&usb_packet.payload[2];
                     
+                    // Refused while a vbias change or a current measurement (the ADC would be taken from it) is in progress
                     usb_packet.length = 2;
-                    if (is_ldo_enabled() == TRUE)
+                    if ((is_ldo_enabled() == TRUE) && (vbias_settling == FALSE) && (vbias_reply_pending == 0) && (cur_measurement_pending == FALSE))
                     {
                         uint16_t set_vbias = force_vbias_dac_change(*requested_dac_val, *requested_wait);
                         memcpy((void*)usb_packet.payload, (void*)&set_vbias, sizeof(set_vbias));
@@ -330,9 +563,16 @@ int main(void)
                     maindprintf_P(PSTR("USB- Reset\r\n"));
                     usb_packet.length = 1;
                     current_fw_mode = MODE_IDLE;
+                    
+                    // Drop the pending answers and background current measurements
+                    vbias_reply_pending = 0;
+                    cur_measurement_pending = FALSE;
+                    stop_current_stream();
+                    abort_adc_accumulation();
                     if(is_platform_calibrated() == TRUE)
                     {
                         disable_bias_voltage();
+                        vbias_settling = FALSE;
                         disable_current_measurement_mode();
                         disable_capacitance_measurement_mode();
                         usb_packet.payload[0] = USB_RETURN_OK;                        
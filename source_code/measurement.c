@@ -6,12 +6,16 @@
  */
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <util/atomic.h>
 #include <util/delay.h>
+#include <string.h>
 #include <avr/io.h>
 #include <stdio.h>
 #include "conversions.h"
 #include "measurement.h"
 #include "calibration.h"
+#include "crossing_timing.h"
+#include "edge_capture.h"
 #include "meas_io.h"
 #include "vbias.h"
 #include "dac.h"
@@ -19,6 +23,10 @@
 // Resistor mux modes in order of value
 uint8_t res_mux_modes[] = {RES_470, RES_1K, RES_10K, RES_100K};
 uint8_t digital_filter_for_res[] = {8, 8, 6, 4};
+// Resistor values divided by 5 in the same order, to scale frequencies and pulse widths from one resistor to another
+uint16_t res_values_div5[] = {47, 100, 1000, 10000};
+// Bit shift for each counter divider clock selection (TC_CLKSEL_OFF_gc to TC_CLKSEL_DIV64_gc)
+uint8_t counter_divider_bit_shifts[] = {0, 0, 1, 2, 3, 6};
 #define DEFAULT_RES_INDEX   3
 // Error flag
 volatile uint8_t tc_error_flag = FALSE;
@@ -28,29 +36,69 @@ volatile uint32_t current_counter_fall;
 // Current aggregate for the fall/rise
 volatile uint32_t current_agg_rise;
 volatile uint32_t current_agg_fall;
-// Last counter for the fall/rise
-volatile uint32_t last_counter_rise;
-volatile uint32_t last_counter_fall;
-// Last aggregate for the fall/rise
-volatile uint32_t last_agg_rise;
-volatile uint32_t last_agg_fall;
-// Frequency counter current value
-volatile uint32_t cur_freq_counter_val;
+// Last measurement windows, double buffered: the gate interrupt fills one while the main loop may read the other
+volatile measurement_window_t measurement_windows[2];
+// Incremented each time a new valid window is published, its LSB is the index of the last window
+volatile uint8_t measurement_window_generation;
+// Generation of the last window read by the main loop
+uint8_t last_read_window_generation;
 // Last frequency counter value
 volatile uint16_t last_counter_val;
 // Number of freq timer overflows
 volatile uint8_t nb_freq_overflows;
+// Number of freq timer overflows that happened while a capture was pending
+volatile uint8_t nb_pending_freq_overflows;
 // Current resistor for measure
 volatile uint8_t cur_resistor_index;
 // Counter to discard next measure
 volatile uint8_t discard_next_mes_cnt;
+// Boolean set when the counter divider was set without knowing the pulse width
+volatile uint8_t counter_divider_estimated;
+// Last window with a pulse width counter overflow, for the main loop to change the range
+measurement_window_t tc_error_window;
+// Boolean set when tc_error_window wasn't handled by the main loop yet
+volatile uint8_t tc_error_window_pending = FALSE;
 // Consecutive tc_error_flags seen on smaller R
 volatile uint8_t consec_tc_error_flags;
 // Current measurement frequency
 uint8_t cur_freq_meas_bit_shift = 1;
 uint16_t cur_freq_meas = FREQ_2HZ;
-// New measurement value
-volatile uint8_t new_val_flag;
+// Current gate window length in 32MHz ticks, and 1Hz division bit shift
+volatile uint32_t cur_gate_length = 32000000UL >> 1;
+volatile uint8_t cur_gate_bit_shift = 1;
+// Capacitance measurement options
+uint8_t cur_measurement_options = 0;
+// Adaptive gate: target relative precision in ppm, 0 when disabled
+uint16_t adaptive_gate_target_ppm = 0;
+// Adaptive gate: windows accumulated for the next report
+measurement_window_t adaptive_window;
+// Adaptive gate: number of windows accumulated, and next power of two to check in bit shift
+uint16_t adaptive_nb_windows;
+uint8_t adaptive_nb_windows_bit_shift;
+// Adaptive gate: boolean set when the spread is taken on the pulse width rather than the oscillation count
+uint8_t adaptive_use_pulse_width;
+// Adaptive gate: first window statistic, running sums of the deviations from it
+int32_t adaptive_stat_first;
+int64_t adaptive_stat_sum;
+uint64_t adaptive_stat_sum_sq;
+// Adaptive gate: report index, as windows are merged
+uint16_t adaptive_report_index;
+// Reciprocal counting: number of edges from the last gate to the edge timestamped after it
+uint16_t last_edge_count_offset;
+// Reciprocal counting: TCD0 value captured at the last gate
+uint16_t reciprocal_gate_time;
+// Reciprocal counting: boolean set while waiting for the edge following the gate
+volatile uint8_t edge_timestamp_armed = FALSE;
+// Reciprocal counting: boolean set when the window waits for the edge timestamp to be published
+volatile uint8_t reciprocal_publish_pending = FALSE;
+// Boolean set when the short probe gate is used while ranging
+volatile uint8_t probe_gate_active = FALSE;
+// Boolean set by the main loop once the range is stable, to go back to the requested gate
+volatile uint8_t probe_gate_end_requested = FALSE;
+// End of the current gate window, 32MHz ticks since measurement start
+volatile uint32_t cur_window_timestamp;
+// Index of the last valid measurement window
+volatile uint16_t cur_window_index;
 // Number of consecutive freq errors
 uint8_t nb_conseq_freq_pb = 0;
 // Current counter divider
@@ -72,8 +120,64 @@ ISR(TCC0_OVF_vect)
  */
 ISR(TCC1_OVF_vect)
 {
-    // Frequency counter rolled over
-    nb_freq_overflows++;
+    // Frequency counter rolled over. If a capture is pending we can't tell if the
+    // overflow happened before or after it, let the capture interrupt decide
+    if (TCC1.INTFLAGS & TC1_CCAIF_bm)
+    {
+        nb_pending_freq_overflows++;
+    } 
+    else
+    {
+        nb_freq_overflows++;
+    }
+}
+
+/*
+ * Reciprocal counting: timestamp the first oscillator edge following the gate with TCD0
+ * @param   gate_count  TCC1 value captured at the gate
+ * @return  number of edges from the gate to the timestamped one, 0 if we couldn't arm the timestamp
+ */
+uint16_t arm_edge_timestamp(uint16_t gate_count)
+{
+    uint16_t count_before, count_after;
+    
+    reciprocal_gate_time = TCD0.CCA;
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        // Empty the edge capture buffer: if no edge came meanwhile, the next capture is the edge after count_before
+        count_before = TCC1.CNT;
+        (void)TCD0.CCB;
+        (void)TCD0.CCB;
+        TCD0.INTFLAGS = TC0_CCBIF_bm | TC0_ERRIF_bm;
+        count_after = TCC1.CNT;
+        if (count_before == count_after)
+        {
+            TCD0.INTCTRLB = TC_CCBINTLVL_HI_gc;
+            edge_timestamp_armed = TRUE;
+            return count_after - gate_count + 1;
+        }
+    }
+    
+    // Oscillating too fast to catch an edge, the gate is used as it is
+    return 0;
+}
+
+/*
+ * Channel B capture interrupt on TD0: first oscillator edge after the gate
+ * Its timestamp becomes the window timestamp
+ */
+ISR(TCD0_CCB_vect)
+{
+    uint16_t edge_delay = TCD0.CCB - reciprocal_gate_time;
+    
+    TCD0.INTCTRLB = TC_CCBINTLVL_OFF_gc;
+    edge_timestamp_armed = FALSE;
+    if (reciprocal_publish_pending == TRUE)
+    {
+        measurement_windows[(measurement_window_generation + 1) & 0x01].timestamp += edge_delay;
+        reciprocal_publish_pending = FALSE;
+        measurement_window_generation++;
+    }
 }
 
 /*
@@ -83,70 +187,116 @@ ISR(TCC1_OVF_vect)
 ISR(TCC1_CCA_vect)
 {
     uint16_t count_value = TCC1.CCA;
-    cur_freq_counter_val = 0;
+    uint8_t nb_overflows = nb_freq_overflows;
+    uint16_t edge_count_offset = 0;
+    
+    // Reciprocal counting: the edge following the last gate never came, publish the window with the gate timestamp
+    if (edge_timestamp_armed == TRUE)
+    {
+        TCD0.INTCTRLB = TC_CCBINTLVL_OFF_gc;
+        edge_timestamp_armed = FALSE;
+        if (reciprocal_publish_pending == TRUE)
+        {
+            reciprocal_publish_pending = FALSE;
+            measurement_window_generation++;
+        }
+    }
+    
+    // The main loop may be reading the last published window, fill the other one
+    volatile measurement_window_t* window = &measurement_windows[(measurement_window_generation + 1) & 0x01];
+    
+    // Overflows seen while the capture was pending happened before it if the captured value is small, after it otherwise
+    // (the interrupt latency is way smaller than 32768 oscillations)
+    if (count_value < 0x8000)
+    {
+        nb_overflows += nb_pending_freq_overflows;
+        nb_freq_overflows = 0;
+    }
+    else
+    {
+        nb_freq_overflows = nb_pending_freq_overflows;
+    }
+    nb_pending_freq_overflows = 0;
     
     // Compute frequency counter value
-    if (count_value < last_counter_val)
+    window->counter_value = ((uint32_t)nb_overflows << 16) + count_value - last_counter_val;
+    
+    // Reciprocal counting: count the edges between the edges following the last and current gates instead
+    // TCD0 wraps every 2.048ms: slower oscillations use the gate, as the edge following it could come later than that
+    if (cur_measurement_options & MES_OPT_RECIPROCAL)
     {
-        nb_freq_overflows--;
+        if ((window->counter_value << cur_gate_bit_shift) >= RECIPROCAL_MIN_OSC_FREQUENCY)
+        {
+            edge_count_offset = arm_edge_timestamp(count_value);
+        }
+        window->counter_value = window->counter_value + edge_count_offset - last_edge_count_offset;
+        last_edge_count_offset = edge_count_offset;
     }
-    cur_freq_counter_val = nb_freq_overflows * 0x10000 + (count_value - last_counter_val);
+    
+    // Add the captures the DMA collected since the last complete block
+    aggregate_pending_edge_captures();
     
     // Copy aggregates & counters, reset counters
     last_counter_val = count_value;                 // Copy current freq counter val
-    last_agg_fall = current_agg_fall;               // Copy current aggregate
-    last_agg_rise = current_agg_rise;               // Copy current aggregate
-    last_counter_fall = current_counter_fall;       // Copy current counter
-    last_counter_rise = current_counter_rise;       // Copy current counter
+    window->aggregate_fall = current_agg_fall;      // Copy current aggregate
+    window->aggregate_rise = current_agg_rise;      // Copy current aggregate
+    window->counter_fall = current_counter_fall;    // Copy current counter
+    window->counter_rise = current_counter_rise;    // Copy current counter
     current_counter_fall = 0;                       // Reset counter
     current_counter_rise = 0;                       // Reset counter
     current_agg_fall = 0;                           // Reset agg
     current_agg_rise = 0;                           // Reset agg
-    nb_freq_overflows = 0;                          // Reset overflow
+    cur_window_timestamp += cur_gate_length;        // Gate window end
+    window->counter_divider = cur_counter_divider;  // Range used during the window
+    window->resistor_index = cur_resistor_index;    // Range used during the window
+    window->gate_bit_shift = cur_gate_bit_shift;    // Gate used for the window
+    
+    // Threshold crossing timing: report the crossings instead of the T_FALL pulse widths, unless the window took too many
+    if (cur_measurement_options & MES_OPT_CROSSING_TIMING)
+    {
+        start_crossing_timing_window(window, cur_gate_bit_shift);
+    }
+    
+    // Range is stable, switch to the requested gate: the RTC just overflowed so the next window has the right length
+    // Don't wait for a register synchronization here, try again at the next probe gate if one is in progress
+    if ((probe_gate_active == TRUE) && (probe_gate_end_requested == TRUE) && ((RTC.STATUS & RTC_SYNCBUSY_bm) == 0))
+    {
+        RTC.PER = cur_freq_meas;
+        cur_gate_length = 32000000UL >> cur_freq_meas_bit_shift;
+        cur_gate_bit_shift = cur_freq_meas_bit_shift;
+        probe_gate_active = FALSE;
+        probe_gate_end_requested = FALSE;
+    }
     
     // Only do the following operation if we weren't asked to discard next measure
     if (discard_next_mes_cnt == 0)
     {
         // If we got an error flag, the oscillations are too slow and the measurement isn't valid (pulse width at around 1k)
         if (tc_error_flag == TRUE)
-        {            
-            if (cur_counter_divider < TC_CLKSEL_DIV64_gc)
+        {
+            // The main loop jumps to the range the oscillation frequency calls for, keep the window for it
+            memcpy((void*)&tc_error_window, (void*)window, sizeof(tc_error_window));
+            tc_error_window_pending = TRUE;
+            tc_error_flag = FALSE;
+        }
+        else
+        {
+            // Publish the window: the main loop will read it next, probe windows aren't reported
+            window->timestamp = cur_window_timestamp;
+            if (window->gate_bit_shift == cur_freq_meas_bit_shift)
             {
-                // Increase counter divider
-                discard_next_mes_cnt = 1;
-                TCC0.CTRLA = ++cur_counter_divider;
-                measdprintf("Count div: %d\r\n", get_val_for_counter_divider(cur_counter_divider));
-            }   
-            else if(cur_resistor_index > 0)
+                cur_window_index++;
+            }
+            window->window_index = cur_window_index;
+            if (edge_timestamp_armed == TRUE)
             {
-                // Decrease resistor value, reset counter divider
-                adjust_digital_filter(digital_filter_for_res[--cur_resistor_index]);
-                enable_res_mux(res_mux_modes[cur_resistor_index], TRUE);
-                cur_counter_divider = TC_CLKSEL_DIV1_gc;
-                TCC0.CTRLA = cur_counter_divider;
-                discard_next_mes_cnt = 1;
-                measdprintf("Count div: %d\r\n", get_val_for_counter_divider(cur_counter_divider));
-            }         
+                // Published once the edge following the gate is timestamped
+                reciprocal_publish_pending = TRUE;
+            }
             else
             {
-                if (consec_tc_error_flags++ > NB_CONSEQ_TC_ERR_FLAG_CHG_RES)
-                {
-                    // Set resistor mux to 10k, reset counter divider
-                    cur_counter_divider = TC_CLKSEL_DIV1_gc;
-                    TCC0.CTRLA = cur_counter_divider;
-                    cur_resistor_index += 2;
-                    discard_next_mes_cnt = 1;
-                    measdprintf("Count div: %d\r\n", get_val_for_counter_divider(cur_counter_divider));
-                    enable_res_mux(res_mux_modes[cur_resistor_index], TRUE);
-                    adjust_digital_filter(digital_filter_for_res[cur_resistor_index]);
-                }                
+                measurement_window_generation++;
             }
-            tc_error_flag = FALSE;
-        }
-        else
-        {
-            // New values to be read
-            new_val_flag = TRUE;
         }
     }  
     else
@@ -157,30 +307,61 @@ ISR(TCC1_CCA_vect)
 }    
 
 /*
- * Channel A capture interrupt on TC0 (pulse width counter) 
+ * Add pulse width captures collected by the DMA to the current aggregates
+ * @param   agg_fall    Fall aggregate for the block
+ * @param   nb_fall     Number of falls in the block
+ * @param   agg_rise    Rise aggregate for the block
+ * @param   nb_rise     Number of rises in the block
  */
-ISR(TCC0_CCA_vect)
+void add_pulse_width_block(uint32_t agg_fall, uint8_t nb_fall, uint32_t agg_rise, uint8_t nb_rise)
 {
-    volatile uint16_t cur_pulse_width = TCC0.CCA;    
-
-    // Aggregate depending if the voltage is rising / falling
-    if ((PORTA_IN & PIN6_bm) == 0)
+    // Also called from a lower level interrupt, the gate interrupt mustn't fire in the middle of the additions
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-        current_agg_fall += cur_pulse_width;
-        current_counter_fall++;
+        current_agg_fall += agg_fall;
+        current_counter_fall += nb_fall;
+        current_agg_rise += agg_rise;
+        current_counter_rise += nb_rise;
     }
-    else
+}
+
+/*
+ * Discard the window in progress and the next one, as pulse width captures were lost or counted twice
+ * Called from the edge capture interrupts
+ */
+void discard_corrupted_cap_measurements(void)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-        current_agg_rise += cur_pulse_width;
-        current_counter_rise++;
-    }        
+        if (discard_next_mes_cnt < 2)
+        {
+            discard_next_mes_cnt = 2;
+        }
+    }
 }
 
 /*
- * RTC overflow interrupt
+ * Get the current measurement range
+ * @return  resistor index in the upper nibble, counter divider in the lower nibble
  */
-ISR(RTC_OVF_vect)
+uint8_t get_measurement_range(void)
 {
+    return (cur_resistor_index << 4) | cur_counter_divider;
+}
+
+/*
+ * Apply the vbias regulation trim kept for a gate, to be called right after a window was published
+ * The bias voltage moves during the window in progress, which is discarded
+ */
+void trim_vbias_at_gate(void)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if ((apply_pending_vbias_trim() == TRUE) && (discard_next_mes_cnt == 0))
+        {
+            discard_next_mes_cnt = 1;
+        }
+    }
 }
 
 /*
@@ -202,75 +383,259 @@ void adjust_digital_filter(uint8_t nb_samples)
     EVSYS.CH0CTRL = nb_samples - 1;
 }
 
+/*
+ * Scale a value proportional to the resistor value to another resistor, saturating on overflow
+ * @param   value       The value
+ * @param   from_index  Resistor index the value was measured with
+ * @param   to_index    Resistor index to scale the value to
+ * @return  the scaled value
+ */
+uint32_t scale_to_resistor(uint32_t value, uint8_t from_index, uint8_t to_index)
+{
+    if (value > (0xFFFFFFFFUL / res_values_div5[to_index]))
+    {
+        return 0xFFFFFFFFUL;
+    }
+    return value * res_values_div5[to_index] / res_values_div5[from_index];
+}
+
+/*
+ * Compute the ideal measurement range for a measurement window
+ * The oscillation frequency is inversely proportional to the resistor and the pulse width proportional to it:
+ * we take the biggest resistor keeping the frequency above twice the minimum, then the smallest counter divider
+ * keeping the pulse width counter below half its maximum
+ * @param   window              Pointer to the measurement window
+ * @param   pulse_width_valid   FALSE if the pulse width counter overflowed during the window
+ * @param   res_index           Pointer to where to store the resistor index
+ * @param   counter_divider     Pointer to where to store the counter divider clock selection
+ */
+void compute_measurement_range(measurement_window_t* window, uint8_t pulse_width_valid, uint8_t* res_index, uint8_t* counter_divider)
+{
+    uint32_t osc_freq = window->counter_value << window->gate_bit_shift;
+    uint32_t pulse_width, scaled_pulse_width;
+    
+    // Pulse width in 32MHz ticks, bounded by the oscillation period if we couldn't measure it
+    if ((pulse_width_valid == TRUE) && (window->counter_fall != 0))
+    {
+        pulse_width = (window->aggregate_fall / window->counter_fall) << counter_divider_bit_shifts[window->counter_divider];
+    }
+    else if (window->counter_value != 0)
+    {
+        pulse_width = (32000000UL >> window->gate_bit_shift) / window->counter_value;
+    }
+    else
+    {
+        pulse_width = 0xFFFFFFFFUL;
+    }
+    
+    for (*res_index = sizeof(res_mux_modes) - 1; ; (*res_index)--)
+    {
+        scaled_pulse_width = scale_to_resistor(pulse_width, window->resistor_index, *res_index);
+        for (*counter_divider = TC_CLKSEL_DIV1_gc; (*counter_divider < TC_CLKSEL_DIV64_gc) && ((scaled_pulse_width >> counter_divider_bit_shifts[*counter_divider]) >= 0x8000); (*counter_divider)++);
+        
+        // Frequency high enough and pulse width fitting in the counter?
+        if ((*res_index == 0) || ((scale_to_resistor(osc_freq, *res_index, window->resistor_index) >= MIN_OSC_FREQUENCY*2) && ((scaled_pulse_width >> counter_divider_bit_shifts[*counter_divider]) < 0x8000)))
+        {
+            return;
+        }
+    }
+}
+
+/*
+ * Set the measurement range
+ * @param   res_index           Resistor index
+ * @param   counter_divider     Pulse width counter clock selection
+ */
+void set_measurement_range(uint8_t res_index, uint8_t counter_divider)
+{
+    if (res_index != cur_resistor_index)
+    {
+        cur_resistor_index = res_index;
+        adjust_digital_filter(digital_filter_for_res[cur_resistor_index]);
+        enable_res_mux(res_mux_modes[cur_resistor_index], TRUE);
+    }
+    cur_counter_divider = counter_divider;
+    TCC0.CTRLA = cur_counter_divider;
+    set_crossing_timing_divider(cur_counter_divider);
+    discard_next_mes_cnt = 1;
+    measdprintf("Count div: %d\r\n", get_val_for_counter_divider(cur_counter_divider));
+    start_probe_gate();
+    if (cur_measurement_options & MES_OPT_RESTART_GATE)
+    {
+        restart_gate();
+    }
+}
+
+/*
+ * Cut the window in progress short after a range change: it ends once the oscillator settled and is discarded,
+ * the next one is a full window
+ * Called from the main loop, as the RTC register synchronization is waited for
+ */
+void restart_gate(void)
+{
+    uint16_t elapsed_rtc_ticks;
+    
+    // Register synchronizations take up to 2 RTC clocks (~60us), wait for them with interrupts enabled
+    while (RTC.STATUS & RTC_SYNCBUSY_bm);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if (RTC.PER > GATE_RESTART_SETTLE_TICKS)
+        {
+            // The RTC overflows after counting PER: GATE_RESTART_SETTLE_TICKS are left, the gate interrupt adds a full gate length at the end of the short window
+            elapsed_rtc_ticks = RTC.CNT;
+            RTC.CNT = RTC.PER + 1 - GATE_RESTART_SETTLE_TICKS;
+            cur_window_timestamp += (((uint32_t)(elapsed_rtc_ticks + GATE_RESTART_SETTLE_TICKS) * 15625) >> 4) - cur_gate_length;
+            
+            // A gate capture still pending belongs to the previous range
+            if (TCC1.INTFLAGS & TC1_CCAIF_bm)
+            {
+                discard_next_mes_cnt = 2;
+            }
+        }
+    }
+}
+
+/*
+ * Set capacitance measurement options
+ * @param   options     Options bitmask (see enum mes_option_t)
+ * @return  TRUE if the options are supported
+ */
+uint8_t set_capacitance_measurement_options(uint8_t options)
+{
+    if (options & ~MES_OPT_ALL)
+    {
+        return FALSE;
+    }
+    
+    cur_measurement_options = options;
+    return TRUE;
+}
+
+/*
+ * Set the adaptive gate precision target: reports are sent once it is met instead of at each window
+ * @param   target_ppm  Target relative precision in ppm, 0 to report each window
+ */
+void set_capacitance_precision_target(uint16_t target_ppm)
+{
+    adaptive_gate_target_ppm = target_ppm;
+}
+
+/*
+ * Use a short gate until the range is stable, if the requested gate is longer
+ * The window in progress is cut short: it is discarded anyway after a range change
+ */
+void start_probe_gate(void)
+{
+    uint16_t elapsed_rtc_ticks;
+    
+    if (cur_freq_meas_bit_shift >= PROBE_GATE_BIT_SHIFT)
+    {
+        return;
+    }
+    
+    probe_gate_end_requested = FALSE;
+    if (probe_gate_active == TRUE)
+    {
+        return;
+    }
+    
+    // Register synchronizations take up to 2 RTC clocks (~60us), wait for them with interrupts enabled
+    while (RTC.STATUS & RTC_SYNCBUSY_bm);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        // Account for the time spent in the window we're cutting short, 32768Hz ticks are 15625/16 32MHz ticks
+        elapsed_rtc_ticks = RTC.CNT;
+        RTC.CNT = 0;
+        cur_window_timestamp += ((uint32_t)elapsed_rtc_ticks * 15625) >> 4;
+        cur_gate_length = 32000000UL >> PROBE_GATE_BIT_SHIFT;
+        cur_gate_bit_shift = PROBE_GATE_BIT_SHIFT;
+        probe_gate_active = TRUE;
+    }
+    
+    // The counter restarted with the longer period: it is way below the probe period once the period is written
+    while (RTC.STATUS & RTC_SYNCBUSY_bm);
+    RTC.PER = FREQ_128HZ;
+}
+
 /*
  * Capacitance measurement logic - change resistor, freq measurement...
+ * @param   window      Pointer to the last measurement window
  */
-void cap_measurement_logic(void)
+void cap_measurement_logic(measurement_window_t* window)
 {       
     // If a change wasn't made before coming here
     if (discard_next_mes_cnt == 0)
     {
-        // Freq divider if we were to increase our resistor value
-        uint8_t hypothetical_new_freq_div;
-        if (res_mux_modes[cur_resistor_index] == RES_470)
-        {
-            hypothetical_new_freq_div = 2;     // Close enough
-        } 
-        else
+        uint32_t osc_freq = window->counter_value << window->gate_bit_shift;
+        uint8_t res_index, counter_divider;
+        uint8_t change_range = FALSE;
+        
+        if (((window->aggregate_fall < (window->counter_fall<<7)) || (counter_divider_estimated == TRUE)) && (cur_counter_divider > TC_CLKSEL_DIV1_gc))
         {
-            hypothetical_new_freq_div = 10;
+            // If our counter value is too low (less than 128) or was estimated from the oscillation period, the counter divider may be too big
+            change_range = TRUE;
         }
-        
-        if ((cur_freq_counter_val << cur_freq_meas_bit_shift) > MIN_OSC_FREQUENCY*hypothetical_new_freq_div*2)
+        else if (((osc_freq < MIN_OSC_FREQUENCY) && (cur_resistor_index > 0)) || ((cur_resistor_index < sizeof(res_mux_modes)-1) && (scale_to_resistor(osc_freq, cur_resistor_index + 1, cur_resistor_index) > MIN_OSC_FREQUENCY*2)))
         {
-            // Check if we can increase the resistor while still getting an oscillation frequency high enough, 2 is a margin factor       
+            // Oscillating too slow, or a bigger resistor would still give an oscillation frequency high enough (2 is a margin factor)
             if (nb_conseq_freq_pb++ > NB_CONSEQ_FREQ_PB_CHG_RES)
             {
-                if(cur_resistor_index < sizeof(res_mux_modes)-1)
-                {
-                    // Decrease resistor value
-                    adjust_digital_filter(digital_filter_for_res[++cur_resistor_index]);
-                    enable_res_mux(res_mux_modes[cur_resistor_index], TRUE);
-                    cur_counter_divider = TC_CLKSEL_DIV1_gc;
-                    TCC0.CTRLA = cur_counter_divider;
-                    discard_next_mes_cnt = 1;
-                    measdprintf("Count div: %d\r\n", get_val_for_counter_divider(cur_counter_divider));
-                }      
+                change_range = TRUE;
                 nb_conseq_freq_pb = 0;
             }
         }
-        else if ((last_agg_fall < (last_counter_fall<<7)) && (cur_counter_divider > TC_CLKSEL_DIV1_gc))
+        else
         {
-            // If our counter value is too low (less than 128), decrease counter divider
-            TCC0.CTRLA = --cur_counter_divider;
-            discard_next_mes_cnt = 1;
-            measdprintf("Count div: %d\r\n", get_val_for_counter_divider(cur_counter_divider));
-        }        
-        else if ((cur_freq_counter_val << cur_freq_meas_bit_shift) < MIN_OSC_FREQUENCY)
+            nb_conseq_freq_pb = 0;
+        }
+        
+        // Jump to the ideal range in one go
+        counter_divider_estimated = FALSE;
+        if (change_range == TRUE)
         {
-            // Check that we're not oscillating too slow
-            if (nb_conseq_freq_pb++ > NB_CONSEQ_FREQ_PB_CHG_RES)
+            compute_measurement_range(window, TRUE, &res_index, &counter_divider);
+            if ((res_index != cur_resistor_index) || (counter_divider != cur_counter_divider))
             {
-                if(cur_resistor_index > 0)
-                {
-                    // Decrease resistor value, reset counter divider
-                    adjust_digital_filter(digital_filter_for_res[--cur_resistor_index]);
-                    enable_res_mux(res_mux_modes[cur_resistor_index], TRUE);
-                    cur_counter_divider = TC_CLKSEL_DIV1_gc;
-                    TCC0.CTRLA = cur_counter_divider;
-                    discard_next_mes_cnt = 1;
-                    measdprintf("Count div: %d\r\n", get_val_for_counter_divider(cur_counter_divider));
-                }
-                nb_conseq_freq_pb = 0;
+                set_measurement_range(res_index, counter_divider);
             }
         }
-        else
+        
+        // Range stable on a probe window: go back to the requested gate
+        if ((window->gate_bit_shift != cur_freq_meas_bit_shift) && (discard_next_mes_cnt == 0) && (nb_conseq_freq_pb == 0))
         {
-            nb_conseq_freq_pb = 0;
+            probe_gate_end_requested = TRUE;
         }
     }    
 }
 
+/*
+ * Capacitance measurement logic for a window with a pulse width counter overflow
+ * @param   window      Pointer to the window
+ */
+void cap_measurement_error_logic(measurement_window_t* window)
+{
+    uint8_t res_index, counter_divider;
+    
+    // The range changed since that window
+    if ((window->resistor_index != cur_resistor_index) || (window->counter_divider != cur_counter_divider))
+    {
+        return;
+    }
+    
+    // Jump to the range the oscillation frequency calls for, the pulse width isn't known
+    compute_measurement_range(window, FALSE, &res_index, &counter_divider);
+    if ((res_index != cur_resistor_index) || (counter_divider != cur_counter_divider))
+    {
+        set_measurement_range(res_index, counter_divider);
+        counter_divider_estimated = TRUE;
+    }
+    else if ((cur_resistor_index == 0) && (consec_tc_error_flags++ > NB_CONSEQ_TC_ERR_FLAG_CHG_RES))
+    {
+        // Already at the smallest resistor and biggest divider: set resistor mux to 10k, reset counter divider
+        set_measurement_range(cur_resistor_index + 2, TC_CLKSEL_DIV1_gc);
+    }
+}
+
 /*
  * Set quiescent current measurement mode
  * @param   ampl        Our measurement amplification (see enum_cur_mes_mode_t)
@@ -293,12 +658,19 @@ void disable_current_measurement_mode(void)
 
 /*
  * Set the frequency at which counter values will be returned
- * @param   bit_shift   1Hz division bit shift (0 is 1Hz, 1 is 2Hz, 2 is 4Hz...)
+ * @param   bit_shift   1Hz division bit shift (0 is 1Hz, 1 is 2Hz, 2 is 4Hz... up to 10 for 1024Hz)
+ * @return  TRUE if the frequency is supported
  */
-void set_capacitance_report_frequency(uint8_t bit_shift)
+uint8_t set_capacitance_report_frequency(uint8_t bit_shift)
 {
+    if (bit_shift > MAX_REPORT_FREQ_BIT_SHIFT)
+    {
+        return FALSE;
+    }
+    
     cur_freq_meas = (32768 >> bit_shift) - 1;
     cur_freq_meas_bit_shift = bit_shift;
+    return TRUE;
 }
 
 /*
@@ -309,8 +681,29 @@ void set_capacitance_measurement_mode(void)
     discard_next_mes_cnt = 2;                                       // Discard next measures by default
     cur_resistor_index = DEFAULT_RES_INDEX;                         // Last resistor by default
     cur_counter_divider = TC_CLKSEL_DIV1_gc;                        // Counter divider 1
-    // RTC: set period depending on measurement freq
-    RTC.PER = cur_freq_meas;                                        // Set correct RTC timer freq
+    cur_window_timestamp = 0;                                       // Timestamps start with the measurement
+    cur_window_index = 0;                                           // Window indexes start with the measurement
+    measurement_window_generation = 0;                              // No window published yet
+    counter_divider_estimated = FALSE;                              // Default counter divider
+    last_read_window_generation = 0;                                // No window published yet
+    tc_error_window_pending = FALSE;                                // No overflow seen yet
+    adaptive_nb_windows = 0;                                        // No window accumulated yet
+    adaptive_report_index = 0;                                      // Report indexes start with the measurement
+    // RTC: set period depending on measurement freq, range with a short probe gate first if it's long
+    if (cur_freq_meas_bit_shift < PROBE_GATE_BIT_SHIFT)
+    {
+        RTC.PER = FREQ_128HZ;                                       // Probe gate
+        cur_gate_bit_shift = PROBE_GATE_BIT_SHIFT;                  // Probe gate
+        probe_gate_active = TRUE;                                   // Probe gate
+    }
+    else
+    {
+        RTC.PER = cur_freq_meas;                                    // Set correct RTC timer freq
+        cur_gate_bit_shift = cur_freq_meas_bit_shift;               // Requested gate
+        probe_gate_active = FALSE;                                  // Requested gate
+    }
+    cur_gate_length = 32000000UL >> cur_gate_bit_shift;             // Gate length in 32MHz ticks
+    probe_gate_end_requested = FALSE;                               // Range not known yet
     RTC.CTRL = RTC_PRESCALER_DIV1_gc;                               // Keep the 32kHz base clock for the RTC
     EVSYS.CH1MUX = EVSYS_CHMUX_RTC_OVF_gc;                          // Event line 1 for RTC overflow
     CLK.RTCCTRL = CLK_RTCSRC_TOSC32_gc | CLK_RTCEN_bm;              // Select 32kHz crystal for the RTC, enable it
@@ -334,8 +727,13 @@ void set_capacitance_measurement_mode(void)
     TCC0.CTRLB = TC0_CCAEN_bm;                                      // Enable compare A on TCC0
     TCC0.CTRLD = TC_EVACT_PW_gc | TC_EVSEL_CH0_gc;                  // Pulse width capture on event line 0 (T_FALL)
     TCC0.INTCTRLA = TC_OVFINTLVL_HI_gc;                             // Overflow interrupt
-    TCC0.INTCTRLB = TC_CCAINTLVL_HI_gc;                             // High level interrupt on capture
     TCC0.CTRLA = cur_counter_divider;                               // Set correct counter divider
+    enable_edge_capture();                                          // Let the DMA collect the captures
+    // Pulse widths: also from the threshold crossings (TE0, event lines 3 & 4), T_FALL ones used for overloaded windows
+    if (cur_measurement_options & MES_OPT_CROSSING_TIMING)
+    {
+        enable_crossing_timing(cur_counter_divider);
+    }
     // TC1: frequency counter
     TCC1.CNT = 0;                                                   // Reset counter
     TCC1.PER = 0xFFFF;                                              // Set max period
@@ -344,6 +742,20 @@ void set_capacitance_measurement_mode(void)
     TCC1.CTRLA = TC_CLKSEL_EVCH2_gc;                                // Use event line 2 as frequency input (COMPOUT)
     TCC1.INTCTRLA = TC_OVFINTLVL_HI_gc;                             // Overflow interrupt
     TCC1.INTCTRLB = TC_CCAINTLVL_HI_gc;                             // High level interrupt on capture    
+    // TD0: reciprocal counting, timestamps the gate and the oscillator edges at 32MHz
+    last_edge_count_offset = 0;                                     // First window uses the gate
+    edge_timestamp_armed = FALSE;                                   // No edge timestamp yet
+    reciprocal_publish_pending = FALSE;                             // No edge timestamp yet
+    if (cur_measurement_options & MES_OPT_RECIPROCAL)
+    {
+        TCD0.CTRLA = TC_CLKSEL_OFF_gc;                              // Stop timer
+        TCD0.CNT = 0;                                               // Reset counter
+        TCD0.PER = 0xFFFF;                                          // Set max period
+        TCD0.CTRLB = TC0_CCAEN_bm | TC0_CCBEN_bm;                   // Enable compare A & B
+        TCD0.CTRLD = TC_EVACT_CAPT_gc | TC_EVSEL_CH1_gc;            // Capture gate (event line 1) on A, COMPOUT rising edge (event line 2) on B
+        TCD0.INTCTRLB = TC_CCBINTLVL_OFF_gc;                        // Interrupt enabled when waiting for an edge
+        TCD0.CTRLA = TC_CLKSEL_DIV1_gc;                             // 32MHz
+    }
     
     switch(cur_freq_meas)
     {
@@ -367,6 +779,21 @@ void set_capacitance_measurement_mode(void)
             measdprintf_P(PSTR("Measurement frequency set to 128Hz\r\n"));
             break;
         }
+        case FREQ_256HZ:
+        {
+            measdprintf_P(PSTR("Measurement frequency set to 256Hz\r\n"));
+            break;
+        }
+        case FREQ_512HZ:
+        {
+            measdprintf_P(PSTR("Measurement frequency set to 512Hz\r\n"));
+            break;
+        }
+        case FREQ_1KHZ:
+        {
+            measdprintf_P(PSTR("Measurement frequency set to 1024Hz\r\n"));
+            break;
+        }
         default: break;
     }
     
@@ -402,6 +829,11 @@ void disable_capacitance_measurement_mode(void)
     TCC0.INTCTRLB = 0x00;                           // Disable timer counter interrupts
     TCC1.INTCTRLA = 0x00;                           // Disable timer counter interrupts
     TCC1.INTCTRLB = 0x00;                           // Disable timer counter interrupts
+    TCD0.INTCTRLB = 0x00;                           // Disable timer counter interrupts
+    TCD0.CTRLA = 0x00;                              // Disable reciprocal counting timer
+    TCD0.CTRLD = 0x00;                              // Disable reciprocal counting timer
+    disable_edge_capture();                         // Stop collecting captures
+    disable_crossing_timing();                      // Stop timing threshold crossings
     TCC0.CTRLD = 0x00;                              // Disable counters
     TCC1.CTRLD = 0x00;                              // Disable counters
     TCC0.CNT = 0x0000;                              // Disable counters
@@ -411,45 +843,182 @@ void disable_capacitance_measurement_mode(void)
     current_agg_fall = 0;                           // Reset agg
     current_agg_rise = 0;                           // Reset agg
     nb_freq_overflows = 0;                          // Reset overflow
+    nb_pending_freq_overflows = 0;                  // Reset overflow
     last_counter_val = 0;                           // Reset last counter val
     disable_measurement_mode_io();                  // Disable measurement mode IOs
 }
 
+/*
+ * Adaptive gate: per window value whose spread tells the precision, in 1/16 tick the mean fall pulse width if we have captures,
+ * the oscillation count otherwise
+ * @param   window              The window
+ * @param   use_pulse_width     TRUE to use the mean fall pulse width
+ * @return  the value
+ */
+int32_t get_adaptive_window_statistic(measurement_window_t* window, uint8_t use_pulse_width)
+{
+    if (use_pulse_width == TRUE)
+    {
+        return (int32_t)((window->aggregate_fall << 4) / window->counter_fall);
+    }
+    else
+    {
+        return (int32_t)window->counter_value;
+    }
+}
+
+/*
+ * Adaptive gate: check if the merged windows meet the precision target, from the window to window spread
+ * The 95% confidence interval of the mean (2 sigma / sqrt(n)) must be within the target relative to the mean:
+ * 4 * var / n <= tol^2 with var * n^2 = n * sum_sq - sum^2, tol = mean * target / 1M (compared x16 here)
+ * @return  TRUE if met
+ */
+uint8_t is_adaptive_precision_met(void)
+{
+    uint8_t bit_shift = adaptive_nb_windows_bit_shift;
+    int64_t variance_n2 = (int64_t)(adaptive_stat_sum_sq << bit_shift) - adaptive_stat_sum * adaptive_stat_sum;
+    uint64_t conf_interval_sq = ((uint64_t)variance_n2 << 2) >> (3 * bit_shift);
+    uint64_t mean = adaptive_stat_first + (adaptive_stat_sum >> bit_shift);
+    uint64_t tolerance_x16 = (mean * adaptive_gate_target_ppm) / 62500;
+    
+    // Would overflow once multiplied by 256: way above any tolerance
+    if ((conf_interval_sq >> 55) != 0)
+    {
+        return FALSE;
+    }
+    return ((conf_interval_sq << 8) <= tolerance_x16 * tolerance_x16)? TRUE : FALSE;
+}
+
+/*
+ * Adaptive gate: merge a window into the next report
+ * Reports are closed at powers of two numbers of windows, once the precision target is met or the gate reaches 1s
+ * @param   window  The window
+ * @return  TRUE if the report window is complete
+ */
+uint8_t accumulate_adaptive_window(measurement_window_t* window)
+{
+    int32_t dev;
+    
+    // Start over on range changes, discarded windows and windows without pulse widths when they are used
+    if ((adaptive_nb_windows != 0) && ((window->resistor_index != adaptive_window.resistor_index) || (window->counter_divider != adaptive_window.counter_divider) || (window->window_index != (uint16_t)(adaptive_window.window_index + 1)) || ((adaptive_use_pulse_width == TRUE) && (window->counter_fall == 0))))
+    {
+        adaptive_nb_windows = 0;
+    }
+    
+    if (adaptive_nb_windows == 0)
+    {
+        memcpy((void*)&adaptive_window, (void*)window, sizeof(adaptive_window));
+        adaptive_use_pulse_width = (window->counter_fall != 0)? TRUE : FALSE;
+        adaptive_stat_first = get_adaptive_window_statistic(window, adaptive_use_pulse_width);
+        adaptive_stat_sum = 0;
+        adaptive_stat_sum_sq = 0;
+        adaptive_nb_windows_bit_shift = 0;
+    }
+    else
+    {
+        adaptive_window.counter_value += window->counter_value;
+        adaptive_window.aggregate_fall += window->aggregate_fall;
+        adaptive_window.aggregate_rise += window->aggregate_rise;
+        adaptive_window.counter_fall += window->counter_fall;
+        adaptive_window.counter_rise += window->counter_rise;
+        adaptive_window.timestamp = window->timestamp;
+        adaptive_window.window_index = window->window_index;
+        
+        // Running sums of the deviations from the first window, keeps them small
+        dev = get_adaptive_window_statistic(window, adaptive_use_pulse_width) - adaptive_stat_first;
+        adaptive_stat_sum += dev;
+        adaptive_stat_sum_sq += (int64_t)dev * dev;
+    }
+    
+    // Only check at powers of two: the report is one longer gate
+    if (++adaptive_nb_windows != (1 << adaptive_nb_windows_bit_shift))
+    {
+        return FALSE;
+    }
+    if ((adaptive_nb_windows_bit_shift < adaptive_window.gate_bit_shift) && ((adaptive_nb_windows_bit_shift < ADAPTIVE_GATE_MIN_BIT_SHIFT) || (is_adaptive_precision_met() == FALSE)))
+    {
+        adaptive_nb_windows_bit_shift++;
+        return FALSE;
+    }
+    
+    // Report the merged windows as one longer gate
+    adaptive_nb_windows = 0;
+    adaptive_window.gate_bit_shift -= adaptive_nb_windows_bit_shift;
+    adaptive_window.window_index = adaptive_report_index++;
+    return TRUE;
+}
+
 /*
  * Our main capacitance measurement loop
  * @param   cap_report  Pointer to where to store the capacitance measurement report
  */
-uint8_t cap_measurement_loop(capacitance_report_t* cap_report)
+uint8_t cap_measurement_loop(capacitance_window_report_t* cap_report)
 {
+    uint8_t generation = measurement_window_generation;
+    measurement_window_t window;
+    
+    // Range changes after a pulse width counter overflow are computed here rather than in the gate interrupt
+    if (tc_error_window_pending == TRUE)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            memcpy((void*)&window, (void*)&tc_error_window, sizeof(window));
+            tc_error_window_pending = FALSE;
+        }
+        cap_measurement_error_logic(&window);
+    }
+    
     // Check if we have a new value to report
-    if (new_val_flag == TRUE)
-    {        
-        // Store the report
-        cap_report->counter_divider = get_val_for_counter_divider(cur_counter_divider);
-        cap_report->half_res = get_half_val_for_res_mux_define(get_cur_res_mux());
-        cap_report->report_freq = get_val_for_freq_define(cur_freq_meas);
-        cap_report->second_thres = get_calib_second_thres_up();
-        cap_report->first_thres = get_calib_first_thres_up();
-        cap_report->counter_value = cur_freq_counter_val;
-        cap_report->aggregate_fall = last_agg_fall;
-        cap_report->aggregate_rise = last_agg_rise;
-        cap_report->counter_rise = last_counter_rise;
-        cap_report->counter_fall = last_counter_fall;
-        cap_report->vosc_low = get_calib_osc_low_v();
+    if (generation != last_read_window_generation)
+    {
+        // Copy the last window, start over if another one was published in the meantime
+        do
+        {
+            generation = measurement_window_generation;
+            memcpy((void*)&window, (void*)&measurement_windows[generation & 0x01], sizeof(window));
+        }
+        while (generation != measurement_window_generation);
+        last_read_window_generation = generation;
+        
+        // Probe windows are only used for ranging
+        if (window.gate_bit_shift != cur_freq_meas_bit_shift)
+        {
+            cap_measurement_logic(&window);
+            return FALSE;
+        }
         
         // Necessary to change the resistor...
-        cap_measurement_logic();
+        cap_measurement_logic(&window);
         
-        // Remove the new val flag
-        new_val_flag = FALSE;
+        // Adaptive gate: report once enough windows were merged
+        if (adaptive_gate_target_ppm != 0)
+        {
+            if (accumulate_adaptive_window(&window) == FALSE)
+            {
+                return FALSE;
+            }
+            memcpy((void*)&window, (void*)&adaptive_window, sizeof(window));
+        }
+        
+        // Store the report
+        cap_report->counter_divider = get_val_for_counter_divider(window.counter_divider);
+        cap_report->half_res = get_half_val_for_res_mux_define(res_mux_modes[window.resistor_index]);
+        cap_report->report_freq = window.gate_bit_shift;
+        cap_report->window_index = window.window_index;
+        cap_report->timestamp = window.timestamp;
+        cap_report->counter_value = window.counter_value;
+        cap_report->aggregate_fall = window.aggregate_fall;
+        cap_report->aggregate_rise = window.aggregate_rise;
+        cap_report->counter_rise = window.counter_rise;
+        cap_report->counter_fall = window.counter_fall;
         
         if (FALSE)
         {
-            //print_compute_c_formula(last_agg_fall, cur_freq_counter_val, cur_counter_divider, get_cur_res_mux());
+            //print_compute_c_formula(window.aggregate_fall, window.counter_value, cur_counter_divider, get_cur_res_mux());
             measdprintf("SYNC\r\n");
             measdprintf("%u\r\n", get_val_for_counter_divider(cur_counter_divider));
-            measdprintf("%lu\r\n", last_agg_fall);
-            measdprintf("%lu\r\n", cur_freq_counter_val);
+            measdprintf("%lu\r\n", window.aggregate_fall);
+            measdprintf("%lu\r\n", window.counter_value);
             measdprintf("%u\r\n", get_half_val_for_res_mux_define(get_cur_res_mux()));
             measdprintf("%u\r\n", get_calib_second_thres_up());
             measdprintf("%u\r\n", get_calib_first_thres_up());
@@ -483,4 +1052,38 @@ uint16_t cur_measurement_loop(uint8_t avg_bitshift)
     
     uint16_t cur_val = get_averaged_adc_value(avg_bitshift);    
     return cur_val;
+}
+
+/*
+ * Start a current measurement in the background
+ * @param   avg_bitshift    Bit shift for averaging, maximum one if a tolerance is given
+ * @param   tolerance       Tolerance on the mean in LSB to stop averaging early, 0 to always average 2^avg_bitshift samples
+ */
+void start_cur_measurement(uint8_t avg_bitshift, uint16_t tolerance)
+{    
+    // Check that the adc channel remained the same
+    if (get_configured_adc_channel() != ADC_CHANNEL_CUR)
+    {
+        configure_adc_channel(ADC_CHANNEL_CUR, get_configured_adc_ampl(), FALSE);
+    }
+    
+    start_adc_accumulation(avg_bitshift, tolerance, 0xFFFF);
+}
+
+/*
+ * Get the result of the background current measurement
+ * @param   cur_val         Where to store the averaged ADC value
+ * @param   used_bitshift   Where to store the number of samples used, in bit shift
+ * @return  TRUE if the measurement is done
+ */
+uint8_t get_cur_measurement_result(uint16_t* cur_val, uint8_t* used_bitshift)
+{
+    // The ADC may have been used for something else since
+    if ((get_adc_accumulation_state() != ADC_ACC_DONE) || (get_configured_adc_channel() != ADC_CHANNEL_CUR))
+    {
+        return FALSE;
+    }
+    
+    *cur_val = get_adc_accumulation_result(used_bitshift);
+    return TRUE;
 }
\ No newline at end of file
@@ -25,6 +25,11 @@
 #define NB_CONSEQ_FREQ_PB_CHG_RES       1       // Number of consecutive freq problem before changing resistors
 #define NB_CONSEQ_TC_ERR_FLAG_CHG_RES   3       // Number of consecutive tc error flags on smaller R before setting a higher R
 #define MIN_OSC_FREQUENCY               800UL   // Minimum oscillation frequency we want
+#define MAX_REPORT_FREQ_BIT_SHIFT       10      // Maximum report frequency, in bit shift (1024Hz)
+#define PROBE_GATE_BIT_SHIFT            7       // Gate used while ranging when the requested one is longer, in bit shift (128Hz)
+#define GATE_RESTART_SETTLE_TICKS       32      // RTC ticks (~1ms) left for the oscillator to settle when restarting the gate
+#define ADAPTIVE_GATE_MIN_BIT_SHIFT     2       // Minimum number of windows before the adaptive gate trusts their spread, in bit shift
+#define RECIPROCAL_MIN_OSC_FREQUENCY    1024UL  // Reciprocal counting needs the edge following the gate within the 2.048ms TCD0 span, with margin
 
 // typedefs
 typedef struct capacitance_report_struct
@@ -32,7 +37,7 @@ typedef struct capacitance_report_struct
     uint16_t counter_divider;                   // 32M time counter divider
     uint32_t aggregate_fall;                    // Fall aggregate
     uint32_t counter_value;                     // Counter value
-    uint8_t report_freq;                        // Report frequency
+    uint8_t report_freq;                        // Report frequency (Hz), 0 above 128Hz
     uint16_t half_res;                          // Resistor value / 2
     uint16_t second_thres;                      // Second comparison threshold
     uint16_t first_thres;                       // First comparison threshold
@@ -40,24 +45,68 @@ typedef struct capacitance_report_struct
     uint32_t counter_rise;                      // Rise counter
     uint32_t counter_fall;                      // Fall counter
     uint16_t vosc_low;                          // Oscillator low voltage
+    uint16_t window_index;                      // Measurement window index, increments for each valid window
+    uint32_t timestamp;                         // End of the measurement window, 32MHz ticks since measurement start
 } capacitance_report_t;
 
+typedef struct capacitance_window_report_struct
+{
+    uint16_t counter_divider;                   // 32M time counter divider
+    uint32_t aggregate_fall;                    // Fall aggregate
+    uint32_t counter_value;                     // Counter value
+    uint8_t report_freq;                        // Report frequency bit shift (0 is 1Hz, 1 is 2Hz...)
+    uint16_t half_res;                          // Resistor value / 2
+    uint32_t timestamp;                         // End of the measurement window, 32MHz ticks since measurement start
+    uint32_t aggregate_rise;                    // Rise aggregate
+    uint32_t counter_rise;                      // Rise counter
+    uint32_t counter_fall;                      // Fall counter
+    uint16_t window_index;                      // Measurement window index, increments for each valid window
+} capacitance_window_report_t;
+
+typedef struct measurement_window_struct
+{
+    uint32_t counter_value;                     // Oscillations counted during the window
+    uint32_t aggregate_fall;                    // Fall aggregate
+    uint32_t aggregate_rise;                    // Rise aggregate
+    uint32_t counter_fall;                      // Fall counter
+    uint32_t counter_rise;                      // Rise counter
+    uint32_t timestamp;                         // End of the window, 32MHz ticks since measurement start
+    uint16_t window_index;                      // Window index
+    uint8_t counter_divider;                    // Pulse width counter clock selection during the window
+    uint8_t resistor_index;                     // Resistor index during the window
+    uint8_t gate_bit_shift;                     // Gate length of the window, 1Hz division bit shift
+} measurement_window_t;
+
 // enums
-enum mes_freq_t     {FREQ_1HZ = (32768-1), FREQ_2HZ = ((32768/2)-1), FREQ_4HZ = ((32768/4)-1), FREQ_8HZ = ((32768/8)-1), FREQ_16HZ = ((32768/16)-1), FREQ_32HZ = ((32768/32)-1), FREQ_64HZ = ((32768/64)-1), FREQ_128HZ = ((32768/128)-1)};
+enum mes_freq_t     {FREQ_1HZ = (32768-1), FREQ_2HZ = ((32768/2)-1), FREQ_4HZ = ((32768/4)-1), FREQ_8HZ = ((32768/8)-1), FREQ_16HZ = ((32768/16)-1), FREQ_32HZ = ((32768/32)-1), FREQ_64HZ = ((32768/64)-1), FREQ_128HZ = ((32768/128)-1), FREQ_256HZ = ((32768/256)-1), FREQ_512HZ = ((32768/512)-1), FREQ_1KHZ = ((32768/1024)-1)};
 enum cur_mes_mode_t {CUR_MES_1X = 0, CUR_MES_2X = 1, CUR_MES_4X = 2, CUR_MES_8X = 3, CUR_MES_16X = 4, CUR_MES_32X = 5, CUR_MES_64X = 6};
 enum mes_mode_t     {MES_OFF = 0, MES_CONT = 1};
+enum mes_option_t   {MES_OPT_RESTART_GATE = 0x01, MES_OPT_RECIPROCAL = 0x02, MES_OPT_CROSSING_TIMING = 0x04, MES_OPT_ALL = MES_OPT_RESTART_GATE | MES_OPT_RECIPROCAL | MES_OPT_CROSSING_TIMING};
     
 // prototypes
-uint8_t cap_measurement_loop(capacitance_report_t* cap_report);
-void set_capacitance_report_frequency(uint8_t bit_shift);
+void compute_measurement_range(measurement_window_t* window, uint8_t pulse_width_valid, uint8_t* res_index, uint8_t* counter_divider);
+void add_pulse_width_block(uint32_t agg_fall, uint8_t nb_fall, uint32_t agg_rise, uint8_t nb_rise);
+uint8_t cap_measurement_loop(capacitance_window_report_t* cap_report);
+uint8_t get_cur_measurement_result(uint16_t* cur_val, uint8_t* used_bitshift);
+uint8_t set_capacitance_report_frequency(uint8_t bit_shift);
+uint8_t set_capacitance_measurement_options(uint8_t options);
+void set_capacitance_precision_target(uint16_t target_ppm);
+uint32_t scale_to_resistor(uint32_t value, uint8_t from_index, uint8_t to_index);
+void set_measurement_range(uint8_t res_index, uint8_t counter_divider);
 void discard_next_cap_measurements(uint8_t nb_samples);
+void discard_corrupted_cap_measurements(void);
+void trim_vbias_at_gate(void);
 uint16_t cur_measurement_loop(uint8_t avg_bitshift);
 void set_current_measurement_mode(uint8_t ampl);
+void start_cur_measurement(uint8_t avg_bitshift, uint16_t tolerance);
 void disable_capacitance_measurement_mode(void);
 void adjust_digital_filter(uint8_t nb_samples);
 void resume_capacitance_measurement_mode(void);
 void pause_capacitance_measurement_mode(void);
 void disable_current_measurement_mode(void);
 void set_capacitance_measurement_mode(void);
+void start_probe_gate(void);
+void restart_gate(void);
+uint8_t get_measurement_range(void);
 
 #endif /* MEASUREMENT_H_ */
\ No newline at end of file
@@ -35,7 +35,7 @@ void functional_test(void)
     
     // Start by calibrating the platform
     testdprintf_P(PSTR("Calibration in progress, please wait...\r\n"));
-    start_openended_calibration(0,0,0);
+    start_openended_calibration(0,0,0,CALIB_MODE_RAMP);
     
     testdprintf_P(PSTR("\r\n\r\n\r\n\r\n--------------------------\r\n"));
     testdprintf_P(PSTR("--- FUNCTIONAL TESTING ---\r\n"));
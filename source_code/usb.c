@@ -8,6 +8,7 @@
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <util/delay.h>
+#include <util/atomic.h>
 #include <string.h>
 #include <avr/io.h>
 #include <stdio.h>
@@ -21,7 +22,15 @@ volatile USB_EP_pair_t endpoints[2+1] __attribute__((section (".data,\"aw\",@pro
 volatile uint8_t ep0_out[RAWHID_EP0_SIZE];
 volatile uint8_t ep0_in[RAWHID_EP0_SIZE];
 volatile uint8_t ep1_out[RAWHID_RX_SIZE];
-volatile uint8_t ep2_in[RAWHID_TX_SIZE];
+volatile uint8_t ep2_in[USB_TX_QUEUE_LENGTH][RAWHID_TX_SIZE];
+/* EP2 IN queue: packet being sent, where to store the next one, number of queued packets */
+volatile uint8_t ep2_in_queue_read = 0;
+volatile uint8_t ep2_in_queue_write = 0;
+volatile uint8_t ep2_in_queue_count = 0;
+/* Packet in which the measurement reports are assembled, shared as the capacitance and current modes are exclusive */
+usb_message_t report_packet;
+/* Number of packets dropped because our queue was full */
+volatile uint16_t usb_dropped_packets = 0;
 /* Zero when we are not configured, non-zero when enumerated */
 volatile uint8_t usb_configuration = 0;
 /* Flag to set when we received data */
@@ -158,6 +167,20 @@ void flush_ep0_endpoint_contents(uint8_t size)
     send_usb_packet(0, ep0_in, size);
 }
 
+void start_ep2_in_transfer(void)
+{
+    endpoints[2].in.DATAPTR = (unsigned)ep2_in[ep2_in_queue_read];
+    endpoints[2].in.CNT = RAWHID_TX_SIZE;
+    endpoints[2].in.STATUS &= ~(USB_EP_BUSNACK0_bm | USB_EP_TRNCOMPL0_bm | USB_EP_OVF_bm);
+}
+
+void reset_ep2_in_queue(void)
+{
+    ep2_in_queue_read = 0;
+    ep2_in_queue_write = 0;
+    ep2_in_queue_count = 0;
+}
+
 void wait_for_endpoint_packet_send(uint8_t endpoint_number)
 {
     while(((endpoints[endpoint_number].in.STATUS) & USB_EP_TRNCOMPL0_bm) == 0);
@@ -178,9 +201,18 @@ ISR(USB_TRNCOMPL_vect)
 	enable_ep0_out();
 	
     usbdprintf("%02x %02x %02x %02x ", endpoints[1].out.STATUS, endpoints[1].in.STATUS, endpoints[2].out.STATUS,endpoints[2].in.STATUS);
-    // Endpoint 2 handling
-    if (ep2status & USB_EP_TRNCOMPL0_bm)
+    // Endpoint 2 handling: packet sent, send the next queued one
+    if ((ep2status & USB_EP_TRNCOMPL0_bm) && (ep2_in_queue_count != 0))
     {
+        ep2_in_queue_read = (ep2_in_queue_read + 1) & (USB_TX_QUEUE_LENGTH - 1);
+        if (--ep2_in_queue_count != 0)
+        {
+            start_ep2_in_transfer();
+        }
+        else
+        {
+            endpoints[2].in.STATUS &= ~USB_EP_TRNCOMPL0_bm;
+        }
         usbdprintf("EP2|");
     }
     // Endpoint 1 handling
@@ -294,7 +326,8 @@ ISR(USB_TRNCOMPL_vect)
                     endpoints[2].in.STATUS = USB_EP_BUSNACK0_bm;
                     endpoints[2].in.CNT = 0;
                     endpoints[2].in.CTRL = USB_EP_TYPE_BULK_gc | USB_EP_BUFSIZE_64_gc;
-                    endpoints[2].in.DATAPTR = (unsigned)ep2_in;
+                    endpoints[2].in.DATAPTR = (unsigned)ep2_in[0];
+                    reset_ep2_in_queue();
     			    flush_ep0_endpoint_contents(0);
     			    break;
 			    }
@@ -353,11 +386,68 @@ ISR(USB_TRNCOMPL_vect)
  	}
 }
 
+uint8_t usb_queue_data(uint8_t* data)
+{
+    // Only the transfer complete interrupt can free a slot in the meantime
+    if ((ep2_in_queue_count >= USB_TX_QUEUE_LENGTH) || (usb_configuration == 0))
+    {
+        return FALSE;
+    }
+    
+    // Slot isn't touched by the interrupt until we increment the count
+    memcpy((void*)ep2_in[ep2_in_queue_write], data, RAWHID_TX_SIZE);
+    ep2_in_queue_write = (ep2_in_queue_write + 1) & (USB_TX_QUEUE_LENGTH - 1);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if (ep2_in_queue_count++ == 0)
+        {
+            start_ep2_in_transfer();
+        }
+    }
+    return TRUE;
+}
+
 void usb_send_data(uint8_t* data)
 {
-    endpoints[2].in.CNT = RAWHID_TX_SIZE;
-    memcpy((void*)ep2_in, data, RAWHID_TX_SIZE);
-    endpoints[2].in.STATUS &= ~(USB_EP_BUSNACK0_bm | USB_EP_TRNCOMPL0_bm | USB_EP_OVF_bm);
+    // Wait for a free slot as long as we are enumerated, drop the packet if the host stopped draining our queue
+    for (uint16_t i = 0; usb_queue_data(data) == FALSE; i++)
+    {
+        if ((usb_configuration == 0) || (i >= USB_SEND_TIMEOUT_MS * 10))
+        {
+            usb_dropped_packets++;
+            return;
+        }
+        _delay_us(100);
+    }
+}
+
+uint8_t usb_try_send_data(uint8_t* data)
+{
+    if (usb_queue_data(data) == FALSE)
+    {
+        usb_dropped_packets++;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+uint16_t usb_get_nb_dropped_packets(void)
+{
+    uint16_t return_value;
+    
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        return_value = usb_dropped_packets;
+    }
+    return return_value;
+}
+
+void usb_reset_dropped_packets(void)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        usb_dropped_packets = 0;
+    }
 }
 
 uint8_t usb_receive_data(uint8_t* data)
@@ -13,7 +13,14 @@
 void init_usb(void);
 uint8_t is_usb_enumerated(void);
 void usb_send_data(uint8_t* data);
+uint8_t usb_queue_data(uint8_t* data);
+void usb_reset_dropped_packets(void);
+uint8_t usb_try_send_data(uint8_t* data);
 uint8_t usb_receive_data(uint8_t* data);
+uint16_t usb_get_nb_dropped_packets(void);
+
+/* Packet in which the measurement reports are assembled */
+extern usb_message_t report_packet;
 
 // USB printf
 #ifdef USB_PRINTF
@@ -45,10 +52,12 @@ typedef union USB_EP_pair
 #define RAWHID_TX_SIZE      64                  // Raw HID transmit packet size
 #define RAWHID_RX_SIZE      64                  // Raw HID receive packet size
 #define RAWHID_RX_INTERVAL  10                  // RX interval
-#define RAWHID_TX_INTERVAL  10                  // TX interval
+#define RAWHID_TX_INTERVAL  1                   // TX interval, 1ms to keep up with high report rates
 #define RAWHID_USAGE_PAGE   0xFF31              // HID usage page, after 0xFF00: vendor-defined
 #define RAWHID_USAGE        0x0074              // HID usage
 #define RAWHID_EP0_SIZE     64                  // Endpoint 0 size
+#define USB_TX_QUEUE_LENGTH 2                   // Number of packets we can queue for sending, power of 2
+#define USB_SEND_TIMEOUT_MS 50                  // How long usb_send_data() waits for a free slot before dropping the packet
 
 // Command IDs defines
 #define CMD_DEBUG               0x00
@@ -69,6 +78,16 @@ typedef union USB_EP_pair
 #define CMD_RESET_STATE         0x0F
 #define CMD_SET_EEPROM_VALS     0x10
 #define CMD_READ_EEPROM_VALS    0x11
+#define CMD_CAP_REPORT_MODE     0x12
+#define CMD_CAP_MES_BATCH       0x13
+#define CMD_CAP_MES_STREAM      0x14
+#define CMD_GET_DROPPED_REPORTS 0x15
+#define CMD_CAP_RAW_EDGES       0x16
+#define CMD_CAP_MES_OPTIONS     0x17
+#define CMD_CAP_PRECISION       0x18
+#define CMD_CUR_MES_STREAM      0x19
+#define CMD_VBIAS_REGULATION    0x1A
+#define CMD_OE_CALIB_VERIFY     0x1B
 
 #define CMD_BOOTLOADER_START    0xFF
 
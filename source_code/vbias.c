@@ -10,6 +10,7 @@
 #include <avr/io.h>
 #include <stdio.h>
 #include "conversions.h"
+#include "calibration.h"
 #include "meas_io.h"
 #include "vbias.h"
 #include "dac.h"
@@ -20,6 +21,41 @@ uint16_t last_measured_vbias;
 uint16_t cur_set_vbias_voltage;
 // Current vbias dac_val
 uint16_t cur_vbias_dac_val;
+// Current vbias state machine state
+uint8_t vbias_state = VBIAS_STATE_IDLE;
+// Bias voltage we want to reach
+uint16_t vbias_target_mv;
+// Bias voltage to reach when decreasing, before ramping up
+uint16_t vbias_decrease_target_mv;
+// Last bias voltage measured by the state machine
+uint16_t vbias_measured_mv;
+// DAC value to jump to at the start of the decrease, VBIAS_LUT_NO_PREDICTION if none
+uint16_t vbias_jump_dac_val = VBIAS_LUT_NO_PREDICTION;
+// Fine approach phase
+uint8_t vbias_precise_phase;
+// Background measurement averaging and max peak to peak
+uint8_t vbias_mes_bit_shift;
+uint16_t vbias_mes_max_pp;
+// State machine wait start and length, in TCD1 ticks
+uint16_t vbias_wait_start;
+uint16_t vbias_wait_ticks;
+// Settling detection: last measurement, its time and number of consecutive intervals below the max slope
+uint16_t vbias_settle_last_mv;
+uint16_t vbias_settle_last_ticks;
+uint8_t vbias_settle_nb_slow_intervals;
+// Background regulation band (mV), 0 when disabled
+uint16_t vbias_reg_band_mv = 0;
+// Boolean set while a background regulation measurement is running
+uint8_t vbias_reg_measuring = FALSE;
+// Time of the last background regulation measurement, in TCD1 ticks
+uint16_t vbias_reg_last_ticks;
+// Background regulation report
+vbias_reg_report_t vbias_reg_report;
+// Background regulation DAC step waiting for a capacitance measurement gate, 0 when none
+int8_t vbias_reg_pending_step = 0;
+// Time the last settling took, time the final settling of the last change took, in TCD1 ticks
+uint16_t vbias_settling_ticks;
+uint16_t vbias_last_change_settling_ticks;
 
 
 /*
@@ -85,46 +121,274 @@ void wait_for_0v_bias(void)
 }
 
 /*
- * Enable bias voltage
- * @param   val     bias voltage in mV
- * @return  Actual mV value set
+ * Start the vbias timebase if it isn't running
  */
-uint16_t enable_bias_voltage(uint16_t val_mv)
+void start_vbias_timebase(void)
 {
-    // Check if the bias voltage isn't already enabled
-    if (is_ldo_enabled() == FALSE)
+    // TCD1 free runs at 32MHz/1024, 31.25 ticks per ms
+    if (TCD1.CTRLA == TC_CLKSEL_OFF_gc)
     {
-        disable_vbias_quenching();                          // Disable quenching
-        last_measured_vbias = VBIAS_MIN_V-1;                // Set min vbias voltage by default
-        cur_set_vbias_voltage = VBIAS_MIN_V-1;              // Set min vbias voltage by default
-        cur_vbias_dac_val = VBIAS_MIN_DAC_VAL;              // Set min vbias voltage by default
-        configure_adc_channel(ADC_CHANNEL_VBIAS, 0, TRUE);  // Enable ADC for vbias monitoring
-        setup_vbias_dac(cur_vbias_dac_val);                 // Start with lowest voltage possible
-        enable_ldo();                                       // Enable ldo
-        _delay_ms(100);                                     // Soft start wait
+        TCD1.CTRLB = TC_WGMODE_NORMAL_gc;
+        TCD1.PER = 0xFFFF;
+        TCD1.CTRLA = TC_CLKSEL_DIV1024_gc;
+    }
+}
+
+/*
+ * Start a vbias state machine wait
+ * @param   wait_ms     How many ms to wait
+ */
+void start_vbias_wait(uint16_t wait_ms)
+{
+    start_vbias_timebase();
+    vbias_wait_start = TCD1.CNT;
+    vbias_wait_ticks = (uint16_t)(((uint32_t)wait_ms * 125) >> 2);
+}
+
+/*
+ * Check if the current vbias state machine wait is over
+ * @return  TRUE if it is over
+ */
+uint8_t is_vbias_wait_over(void)
+{
+    if ((uint16_t)(TCD1.CNT - vbias_wait_start) >= vbias_wait_ticks)
+    {
+        return TRUE;
+    } 
+    else
+    {
+        return FALSE;
+    }
+}
+
+/*
+ * Start a vbias measurement in the background
+ * @param   avg_bit_shift   Bit shift for the averaging
+ * @param   max_pp          Maximum peak to peak for the samples
+ */
+void start_vbias_measurement(uint8_t avg_bit_shift, uint16_t max_pp)
+{
+    // Another command may have used the ADC in the meantime
+    if (get_configured_adc_channel() != ADC_CHANNEL_VBIAS)
+    {
+        configure_adc_channel(ADC_CHANNEL_VBIAS, 0, FALSE);
+    }
+    vbias_mes_bit_shift = avg_bit_shift;
+    vbias_mes_max_pp = max_pp;
+    start_adc_accumulation(avg_bit_shift, 0, max_pp);
+}
+
+/*
+ * Check if the background vbias measurement is done, start it over when it was aborted or too noisy
+ * @param   measured_vbias  Where to store the measured vbias
+ * @return  TRUE if the measurement is done
+ */
+uint8_t get_vbias_measurement(uint16_t* measured_vbias)
+{
+    uint8_t used_bit_shift;
+    
+    // Another ADC user may have reconfigured the channel in the meantime, its result isn't a vbias
+    if (get_configured_adc_channel() != ADC_CHANNEL_VBIAS)
+    {
+        start_vbias_measurement(vbias_mes_bit_shift, vbias_mes_max_pp);
+        return FALSE;
     }
     
-    return update_bias_voltage(val_mv);                     // Return the actual voltage that was set
+    switch (get_adc_accumulation_state())
+    {
+        case ADC_ACC_RUNNING: return FALSE;
+        case ADC_ACC_DONE:
+        {
+            *measured_vbias = compute_vbias_for_adc_value(get_adc_accumulation_result(&used_bit_shift));
+            return TRUE;
+        }
+        default:
+        {
+            start_vbias_measurement(vbias_mes_bit_shift, vbias_mes_max_pp);
+            return FALSE;
+        }
+    }
 }
 
 /*
- * Disable bias voltage
+ * Start waiting for the bias voltage to settle
+ * @param   max_wait_ms     Maximum settling time (ms)
  */
-void disable_bias_voltage(void)
+void start_vbias_settling(uint16_t max_wait_ms)
 {
-    vbiasdprintf_P(PSTR("Disabling bias voltage\r\n")); // Debug
-    disable_ldo();                                      // Disable LDO
-    disable_stepup();                                   // Disable stepup
-    disable_vbias_dac();                                // Disable DAC controlling the ldo
-    wait_for_0v4_bias();                                // Wait bias voltage to be at 0v
+    start_vbias_wait(max_wait_ms);
+    vbias_settle_last_ticks = vbias_wait_start;
+    vbias_settle_last_mv = 0xFFFF;
+    vbias_settle_nb_slow_intervals = 0;
+    start_vbias_measurement(BIT_AVG_SETTLE, 0xFFFF);
 }
 
 /*
- * Update bias voltage
+ * Check if the bias voltage settled: its slope stayed below VBIAS_SETTLE_MAX_SLOPE for VBIAS_SETTLE_NB_SLOW intervals
+ * @return  TRUE if it settled or the maximum settling time elapsed
+ */
+uint8_t is_vbias_settled(void)
+{
+    uint16_t measured_vbias;
+    uint16_t cur_ticks;
+    uint16_t elapsed_ticks;
+    uint16_t delta_mv;
+    
+    // Give up after the maximum settling time
+    if (is_vbias_wait_over() == TRUE)
+    {
+        vbias_settling_ticks = vbias_wait_ticks;
+        return TRUE;
+    }
+    
+    if (get_vbias_measurement(&measured_vbias) == FALSE)
+    {
+        return FALSE;
+    }
+    
+    // Compare with the previous measurement once an interval elapsed
+    cur_ticks = TCD1.CNT;
+    elapsed_ticks = cur_ticks - vbias_settle_last_ticks;
+    if (elapsed_ticks >= VBIAS_SETTLE_INTERVAL)
+    {
+        if (measured_vbias > vbias_settle_last_mv)
+        {
+            delta_mv = measured_vbias - vbias_settle_last_mv;
+        } 
+        else
+        {
+            delta_mv = vbias_settle_last_mv - measured_vbias;
+        }
+        
+        // delta_mv / elapsed_ms <= VBIAS_SETTLE_MAX_SLOPE, with 31.25 ticks per ms
+        if ((vbias_settle_last_mv != 0xFFFF) && ((uint32_t)delta_mv * 125 <= (uint32_t)VBIAS_SETTLE_MAX_SLOPE * elapsed_ticks * 4))
+        {
+            vbias_settle_nb_slow_intervals++;
+        } 
+        else
+        {
+            vbias_settle_nb_slow_intervals = 0;
+        }
+        vbias_settle_last_mv = measured_vbias;
+        vbias_settle_last_ticks = cur_ticks;
+        
+        if (vbias_settle_nb_slow_intervals >= VBIAS_SETTLE_NB_SLOW)
+        {
+            vbias_settling_ticks = cur_ticks - vbias_wait_start;
+            return TRUE;
+        }
+    }
+    
+    start_vbias_measurement(BIT_AVG_SETTLE, 0xFFFF);
+    return FALSE;
+}
+
+/*
+ * Get the time it took for the bias voltage to settle after the last change
+ * @return  Settling time in us
+ */
+uint32_t get_last_vbias_settling_time(void)
+{
+    // 32us per TCD1 tick
+    return (uint32_t)vbias_last_change_settling_ticks << 5;
+}
+
+/*
+ * Start the decrease part of a bias voltage change
+ */
+void start_vbias_decrease_step(void)
+{
+    // Update DAC (jump to the predicted value first if we have one), wait and get measured vbias
+    if (vbias_jump_dac_val != VBIAS_LUT_NO_PREDICTION)
+    {
+        cur_vbias_dac_val = vbias_jump_dac_val;
+        vbias_jump_dac_val = VBIAS_LUT_NO_PREDICTION;
+    } 
+    else
+    {
+        cur_vbias_dac_val += 20;
+    }
+    if (cur_vbias_dac_val > DAC_MAX_VAL)
+    {
+        cur_vbias_dac_val = DAC_MAX_VAL;
+    }
+    update_vbias_dac(cur_vbias_dac_val);
+    _delay_us(20);
+    start_vbias_measurement(BIT_AVG_APPROACH + 1, 4);
+    vbias_state = VBIAS_STATE_DECREASE;
+}
+
+/*
+ * Do one step of the increase part of a bias voltage change
+ */
+void start_vbias_increase_step(void)
+{
+    // Adjust peak-peak & averaging depending on how close we are
+    if (((vbias_target_mv - vbias_measured_mv) < MV_APPROCH) && (vbias_precise_phase == FALSE))
+    {
+        vbias_precise_phase = TRUE;
+    }
+    
+    // Update DAC, wait and get measured vbias
+    update_vbias_dac(--cur_vbias_dac_val);
+    _delay_us(10);
+    if (vbias_precise_phase == FALSE)
+    {
+        start_vbias_measurement(BIT_AVG_APPROACH, 0xFFFF);
+        vbias_state = VBIAS_STATE_INCREASE;
+    } 
+    else
+    {
+        start_vbias_settling(VBIAS_SETTLE_MAX_MS);
+        vbias_state = VBIAS_STATE_FINE_SETTLE;
+    }
+}
+
+/*
+ * Start ramping up the bias voltage, jumping to the DAC value predicted by the lookup table if we have one
+ */
+void start_vbias_ramp_up(void)
+{
+    uint16_t jump_dac_val = get_vbias_lut_dac_value(vbias_target_mv - VBIAS_LUT_MARGIN_MV);
+    
+    // Open loop jump to slightly below the requested voltage, the closed loop does the last millivolts
+    if ((jump_dac_val != VBIAS_LUT_NO_PREDICTION) && (jump_dac_val < cur_vbias_dac_val))
+    {
+        vbiasdprintf("Jumping to DAC value %u\r\n", jump_dac_val);
+        cur_vbias_dac_val = jump_dac_val;
+        update_vbias_dac(cur_vbias_dac_val);
+        start_vbias_settling(VBIAS_SETTLE_MAX_MS);
+        vbias_state = VBIAS_STATE_JUMP_SETTLE;
+    } 
+    else
+    {
+        start_vbias_increase_step();
+    }
+}
+
+/*
+ * Start the increase part of a bias voltage change
+ */
+void start_vbias_increase(void)
+{
+    // Check if we need to activate the stepup
+    if ((cur_set_vbias_voltage < STEPUP_ACTIV_V) && (vbias_target_mv >= STEPUP_ACTIV_V))
+    {
+        enable_stepup();                                    // Enable stepup
+        start_vbias_wait(10);                               // Step up start takes around 1.5ms (oscilloscope)
+        vbias_state = VBIAS_STATE_STEPUP_START;
+    }
+    else
+    {
+        start_vbias_ramp_up();
+    }
+}
+
+/*
+ * Start a bias voltage change, vbias_state_machine_step() then needs to be called until it returns FALSE
  * @param   val     bias voltage in mV
- * @return  Actual mV value set
  */
-uint16_t update_bias_voltage(uint16_t val_mv)
+void start_bias_voltage_change(uint16_t val_mv)
 {
     /******************* INTERVAL ARITHMETIC *******************/
     // 0.1% resistors
@@ -143,8 +407,8 @@ uint16_t update_bias_voltage(uint16_t val_mv)
     // Vbias = VALadc * 16740.0837 (+-0.45%) / 4095 +- 12mV (+-0.45%)
     
     vbiasdprintf("Vbias call for %umV\r\n", val_mv);
-    uint16_t measured_vbias = last_measured_vbias;
-    uint8_t precise_phase = FALSE;
+    vbias_measured_mv = last_measured_vbias;
+    vbias_precise_phase = FALSE;
     
     // Check that the ADC channel remained the same
     if (get_configured_adc_channel() != ADC_CHANNEL_VBIAS)
@@ -158,12 +422,14 @@ uint16_t update_bias_voltage(uint16_t val_mv)
         vbiasdprintf("Value too low, setting it to %dmV!\r\n", VBIAS_MIN_V);
         val_mv = VBIAS_MIN_V;
     }
+    vbias_target_mv = val_mv;
     
-    // Same voltage requested, return last measured vbias
+    // Same voltage requested, last measured vbias stays
     if (cur_set_vbias_voltage == val_mv)
     {
         vbiasdprintf_P(PSTR("Same val requested!\r\n"));
-        return last_measured_vbias;
+        vbias_state = VBIAS_STATE_IDLE;
+        return;
     }
     
     // Voltage lower than the previous one requested, lower voltage then ramp up again
@@ -177,72 +443,386 @@ uint16_t update_bias_voltage(uint16_t val_mv)
         }
         
         // Compute voltage to reach
-        uint16_t voltage_to_reach;
         if (val_mv > VBIAS_MIN_V + 4*MV_APPROCH)
         {
-            voltage_to_reach = val_mv - 4*MV_APPROCH;
+            vbias_decrease_target_mv = val_mv - 4*MV_APPROCH;
         } 
         else
         {
-            voltage_to_reach = VBIAS_MIN_V;
+            vbias_decrease_target_mv = VBIAS_MIN_V;
         }        
         
+        // If the lookup table can predict it, jump close to the requested voltage instead
+        vbias_jump_dac_val = get_vbias_lut_dac_value(val_mv - VBIAS_LUT_MARGIN_MV);
+        if ((vbias_jump_dac_val != VBIAS_LUT_NO_PREDICTION) && (vbias_jump_dac_val > cur_vbias_dac_val))
+        {
+            vbiasdprintf("Jumping to DAC value %u\r\n", vbias_jump_dac_val);
+            vbias_decrease_target_mv = val_mv - VBIAS_LUT_MARGIN_MV/2;
+        } 
+        else
+        {
+            vbias_jump_dac_val = VBIAS_LUT_NO_PREDICTION;
+        }
+        
         // Our voltage decreasing loop
         enable_vbias_quenching();
-        do
-        {                        
-            // Update DAC, wait and get measured vbias
-            cur_vbias_dac_val += 20;
-            if (cur_vbias_dac_val > DAC_MAX_VAL)
+        start_vbias_decrease_step();
+    }
+    else
+    {
+        start_vbias_increase();
+    }
+}
+
+/*
+ * Start enabling the bias voltage, vbias_state_machine_step() then needs to be called until it returns FALSE
+ * @param   val     bias voltage in mV
+ */
+void start_bias_voltage_enable(uint16_t val_mv)
+{
+    // Finish the previous change first, a pending regulation trim is obsolete
+    while (vbias_state_machine_step() == TRUE);
+    vbias_reg_pending_step = 0;
+    
+    // Check if the bias voltage isn't already enabled
+    if (is_ldo_enabled() == FALSE)
+    {
+        disable_vbias_quenching();                          // Disable quenching
+        last_measured_vbias = VBIAS_MIN_V-1;                // Set min vbias voltage by default
+        cur_set_vbias_voltage = VBIAS_MIN_V-1;              // Set min vbias voltage by default
+        cur_vbias_dac_val = VBIAS_MIN_DAC_VAL;              // Set min vbias voltage by default
+        configure_adc_channel(ADC_CHANNEL_VBIAS, 0, TRUE);  // Enable ADC for vbias monitoring
+        setup_vbias_dac(cur_vbias_dac_val);                 // Start with lowest voltage possible
+        enable_ldo();                                       // Enable ldo
+        vbias_target_mv = val_mv;                           // Voltage to set after the soft start
+        start_vbias_settling(VBIAS_SETTLE_MAX_MS);          // Soft start wait
+        vbias_state = VBIAS_STATE_SOFT_START;
+    }
+    else
+    {
+        start_bias_voltage_change(val_mv);
+    }
+}
+
+/*
+ * Start disabling the bias voltage, vbias_state_machine_step() then needs to be called until it returns FALSE
+ */
+void start_bias_voltage_disable(void)
+{
+    // Finish the previous change first, a pending regulation trim is obsolete
+    while (vbias_state_machine_step() == TRUE);
+    vbias_reg_pending_step = 0;
+    
+    vbiasdprintf_P(PSTR("Disabling bias voltage\r\n")); // Debug
+    disable_ldo();                                      // Disable LDO
+    disable_stepup();                                   // Disable stepup
+    disable_vbias_dac();                                // Disable DAC controlling the ldo
+    
+    // Wait for bias voltage to be under ~400mV
+    configure_adc_channel(ADC_CHANNEL_VBIAS, 0, TRUE);
+    enable_vbias_quenching();
+    start_vbias_measurement(8, 0xFFFF);
+    vbias_state = VBIAS_STATE_DISCHARGE;
+}
+
+/*
+ * Step the vbias state machine, to be called from the main loop
+ * @return  TRUE if a vbias change is still in progress
+ */
+uint8_t vbias_state_machine_step(void)
+{
+    switch (vbias_state)
+    {
+        case VBIAS_STATE_SOFT_START:
+        {
+            if (is_vbias_settled() == TRUE)
             {
-                cur_vbias_dac_val = DAC_MAX_VAL;
-            }            
-            update_vbias_dac(cur_vbias_dac_val);
-            _delay_us(20);
-            measured_vbias = compute_vbias_for_adc_value(get_averaged_stabilized_adc_value(BIT_AVG_APPROACH + 1, 4, FALSE));
+                start_bias_voltage_change(vbias_target_mv);
+            }
+            break;
         }
-        while ((measured_vbias > voltage_to_reach) && (cur_vbias_dac_val != DAC_MAX_VAL));
-        disable_vbias_quenching();
+        case VBIAS_STATE_DECREASE:
+        {
+            if (get_vbias_measurement(&vbias_measured_mv) == TRUE)
+            {
+                if ((vbias_measured_mv > vbias_decrease_target_mv) && (cur_vbias_dac_val != DAC_MAX_VAL))
+                {
+                    start_vbias_decrease_step();
+                } 
+                else
+                {
+                    disable_vbias_quenching();
+                    start_vbias_increase();
+                }
+            }
+            break;
+        }
+        case VBIAS_STATE_STEPUP_START:
+        {
+            if (is_vbias_wait_over() == TRUE)
+            {
+                start_vbias_ramp_up();
+            }
+            break;
+        }
+        case VBIAS_STATE_JUMP_SETTLE:
+        {
+            if (is_vbias_settled() == TRUE)
+            {
+                start_vbias_measurement(BIT_AVG_APPROACH, 0xFFFF);
+                vbias_state = VBIAS_STATE_INCREASE;
+            }
+            break;
+        }
+        case VBIAS_STATE_FINE_SETTLE:
+        {
+            if (is_vbias_settled() == TRUE)
+            {
+                start_vbias_measurement(BIT_AVG_FINE, 0xFFFF);
+                vbias_state = VBIAS_STATE_INCREASE;
+            }
+            break;
+        }
+        case VBIAS_STATE_INCREASE:
+        {
+            if (get_vbias_measurement(&vbias_measured_mv) == TRUE)
+            {
+                if ((vbias_measured_mv < vbias_target_mv - VBIAS_OVERSHOOT_MV) && (cur_vbias_dac_val != 0))
+                {
+                    start_vbias_increase_step();
+                } 
+                else
+                {
+                    // Wait for the bias voltage to settle before continuing
+                    start_vbias_settling(VBIAS_SETTLE_MAX_MS);
+                    vbias_state = VBIAS_STATE_FINAL_SETTLE;
+                }
+            }
+            break;
+        }
+        case VBIAS_STATE_FINAL_SETTLE:
+        {
+            if (is_vbias_settled() == TRUE)
+            {
+                // Report the settled measurement, the last step measurement if the settling timed out before the first one
+                cur_set_vbias_voltage = vbias_target_mv;
+                if (vbias_settle_last_mv != 0xFFFF)
+                {
+                    last_measured_vbias = vbias_settle_last_mv;
+                } 
+                else
+                {
+                    last_measured_vbias = vbias_measured_mv;
+                }
+                vbias_last_change_settling_ticks = vbias_settling_ticks;
+                vbiasdprintf("Vbias set, actual value: %umV\r\n", last_measured_vbias);
+                vbiasdprintf("Settling time: %luus\r\n", get_last_vbias_settling_time());
+                vbias_state = VBIAS_STATE_IDLE;
+            }
+            break;
+        }
+        case VBIAS_STATE_DISCHARGE:
+        {
+            uint8_t used_bit_shift;
+            if (get_vbias_measurement(&vbias_measured_mv) == TRUE)
+            {
+                // Compare the raw ADC value, as wait_for_0v4_bias() does
+                if (get_adc_accumulation_result(&used_bit_shift) > 60)
+                {
+                    start_vbias_measurement(8, 0xFFFF);
+                } 
+                else
+                {
+                    vbiasdprintf_P(PSTR("Bias voltage at 0.4V\r\n"));
+                    vbias_state = VBIAS_STATE_IDLE;
+                }
+            }
+            break;
+        }
+        default: break;
+    }
+    
+    if (vbias_state == VBIAS_STATE_IDLE)
+    {
+        return FALSE;
     } 
-       
-    // Check if we need to activate the stepup
-    if ((cur_set_vbias_voltage < STEPUP_ACTIV_V) && (val_mv >= STEPUP_ACTIV_V))
-    {            
-        enable_stepup();                                    // Enable stepup
-        _delay_ms(10);                                      // Step up start takes around 1.5ms (oscilloscope)
+    else
+    {
+        return TRUE;
     }
-        
-    // Our voltage increasing loop (takes 400ms to reach vmax)
-    do
+}
+
+/*
+ * Enable bias voltage
+ * @param   val     bias voltage in mV
+ * @return  Actual mV value set
+ */
+uint16_t enable_bias_voltage(uint16_t val_mv)
+{
+    start_bias_voltage_enable(val_mv);
+    while (vbias_state_machine_step() == TRUE);
+    return last_measured_vbias;                             // Return the actual voltage that was set
+}
+
+/*
+ * Disable bias voltage
+ */
+void disable_bias_voltage(void)
+{
+    start_bias_voltage_disable();
+    while (vbias_state_machine_step() == TRUE);
+}
+
+/*
+ * Update bias voltage
+ * @param   val     bias voltage in mV
+ * @return  Actual mV value set
+ */
+uint16_t update_bias_voltage(uint16_t val_mv)
+{
+    while (vbias_state_machine_step() == TRUE);
+    start_bias_voltage_change(val_mv);
+    while (vbias_state_machine_step() == TRUE);
+    return last_measured_vbias;
+}
+
+/*
+ * Set the background vbias regulation
+ * @param   band_mv     Vbias is trimmed when it deviates more than band_mv from the set voltage, 0 disables the regulation
+ */
+void set_vbias_regulation(uint16_t band_mv)
+{
+    start_vbias_timebase();
+    vbias_reg_band_mv = band_mv;
+    vbias_reg_measuring = FALSE;
+    vbias_reg_pending_step = 0;
+    vbias_reg_last_ticks = TCD1.CNT;
+    vbias_reg_report.dac_correction = 0;
+    vbias_reg_report.nb_corrections = 0;
+    vbias_reg_report.last_error = 0;
+}
+
+/*
+ * Get the background vbias regulation report
+ * @param   buffer      Where to store the report (see vbias_reg_report_t)
+ * @return  The report length
+ */
+uint8_t get_vbias_regulation_report(uint8_t* buffer)
+{
+    vbias_reg_report.measured_vbias = last_measured_vbias;
+    vbias_reg_report.dac_value = cur_vbias_dac_val;
+    memcpy((void*)buffer, (void*)&vbias_reg_report, sizeof(vbias_reg_report));
+    return sizeof(vbias_reg_report);
+}
+
+/*
+ * Trim the vbias DAC by one LSB for the background regulation
+ * @param   step    1 to lower vbias, -1 to raise it
+ */
+void apply_vbias_regulation_step(int8_t step)
+{
+    cur_vbias_dac_val += step;
+    update_vbias_dac(cur_vbias_dac_val);
+    vbias_reg_report.dac_correction += step;
+    vbias_reg_report.nb_corrections++;
+}
+
+/*
+ * Apply the background regulation trim kept for a capacitance measurement gate, if any
+ * @return  TRUE if the DAC value changed
+ */
+uint8_t apply_pending_vbias_trim(void)
+{
+    if (vbias_reg_pending_step == 0)
     {
-        // Adjust peak-peak & averaging depending on how close we are
-        if (((val_mv - measured_vbias) < MV_APPROCH) && (precise_phase == FALSE))
+        return FALSE;
+    }
+    apply_vbias_regulation_step(vbias_reg_pending_step);
+    vbias_reg_pending_step = 0;
+    return TRUE;
+}
+
+/*
+ * Background vbias regulation, to be called from the main loop when no measurement uses the ADC
+ * Every VBIAS_REG_PERIOD, vbias is measured and the DAC trimmed by one LSB if vbias is out of the band
+ * @param   trim_at_gate    TRUE to keep the trim for the next capacitance measurement gate (see apply_pending_vbias_trim())
+ */
+void vbias_regulation_loop(uint8_t trim_at_gate)
+{
+    uint16_t measured_vbias;
+    int16_t error_mv;
+    int8_t step;
+    
+    // Only when the bias voltage is enabled and not changing
+    if ((vbias_reg_band_mv == 0) || (vbias_state != VBIAS_STATE_IDLE) || (is_ldo_enabled() == FALSE))
+    {
+        vbias_reg_measuring = FALSE;
+        vbias_reg_pending_step = 0;
+        return;
+    }
+    
+    // A trim is waiting for a gate: apply it right away if we're out of capacitance measurement, measure again once applied
+    if (vbias_reg_pending_step != 0)
+    {
+        if (trim_at_gate == FALSE)
         {
-            precise_phase = TRUE;
-            //enable_cur_meas_mos();
+            apply_pending_vbias_trim();
         }
-            
-        // Update DAC, wait and get measured vbias
-        update_vbias_dac(--cur_vbias_dac_val);
-        _delay_us(10);
-        if (precise_phase == FALSE)
-        {
-            measured_vbias = compute_vbias_for_adc_value(get_averaged_adc_value(BIT_AVG_APPROACH));
-        } 
-        else
+        return;
+    }
+    
+    // Start a measurement every period
+    if (vbias_reg_measuring == FALSE)
+    {
+        if ((uint16_t)(TCD1.CNT - vbias_reg_last_ticks) >= VBIAS_REG_PERIOD)
         {
-            _delay_ms(CONV_DELAY_FINE);
-            measured_vbias = compute_vbias_for_adc_value(get_averaged_adc_value(BIT_AVG_FINE));
-        }            
-    }
-    while ((measured_vbias < val_mv - VBIAS_OVERSHOOT_MV) && (cur_vbias_dac_val != 0));       
-    
-    // Wait before continuing
-    _delay_ms(10);
-    cur_set_vbias_voltage = val_mv;      
-    last_measured_vbias = measured_vbias + VBIAS_OVERSHOOT_MV;                           
-    vbiasdprintf("Vbias set, actual value: %umV\r\n", measured_vbias + VBIAS_OVERSHOOT_MV);
-    return measured_vbias + VBIAS_OVERSHOOT_MV;
+            vbias_reg_last_ticks = TCD1.CNT;
+            start_vbias_measurement(BIT_AVG_REG, 0xFFFF);
+            vbias_reg_measuring = TRUE;
+        }
+        return;
+    }
+    
+    // A measurement took over the ADC, try again next period
+    if ((get_configured_adc_channel() != ADC_CHANNEL_VBIAS) || (get_adc_accumulation_state() == ADC_ACC_ABORTED))
+    {
+        vbias_reg_measuring = FALSE;
+        return;
+    }
+    if (get_vbias_measurement(&measured_vbias) == FALSE)
+    {
+        return;
+    }
+    vbias_reg_measuring = FALSE;
+    
+    // Compare the raw measurement with the setpoint, which is also a raw measurement after force_vbias_dac_change()
+    last_measured_vbias = measured_vbias;
+    error_mv = (int16_t)(measured_vbias - cur_set_vbias_voltage);
+    vbias_reg_report.last_error = error_mv;
+    
+    // Vbias decreases when the DAC value increases
+    if ((error_mv > (int16_t)vbias_reg_band_mv) && (cur_vbias_dac_val < DAC_MAX_VAL))
+    {
+        step = 1;
+    } 
+    else if ((error_mv < -(int16_t)vbias_reg_band_mv) && (cur_vbias_dac_val > VBIAS_MAX_DAC_VAL))
+    {
+        step = -1;
+    }
+    else
+    {
+        return;
+    }
+    
+    // A trim in the middle of a capacitance measurement window would corrupt it
+    if (trim_at_gate == TRUE)
+    {
+        vbias_reg_pending_step = step;
+    } 
+    else
+    {
+        apply_vbias_regulation_step(step);
+    }
 }
 
 /*
@@ -274,8 +854,9 @@ uint16_t force_vbias_dac_change(uint16_t dac_value, uint16_t wait_ms)
         _delay_ms(1);
     }
     
-    // Update vbias dac
+    // Update vbias dac, a pending regulation trim is obsolete
     update_vbias_dac(dac_value);
+    vbias_reg_pending_step = 0;
     
     // Wait for the given amount of ms
     for (uint16_t i = 0; i < wait_ms; i++)
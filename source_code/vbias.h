@@ -21,6 +21,9 @@
     #define vbiasdprintf_P
 #endif
 
+// enums
+enum vbias_state_t      {VBIAS_STATE_IDLE = 0, VBIAS_STATE_SOFT_START, VBIAS_STATE_DECREASE, VBIAS_STATE_STEPUP_START, VBIAS_STATE_FINE_SETTLE, VBIAS_STATE_INCREASE, VBIAS_STATE_FINAL_SETTLE, VBIAS_STATE_DISCHARGE, VBIAS_STATE_JUMP_SETTLE};
+
 // Defines
 #define VBIAS_MIN_DAC_VAL       DAC_MAX_VAL - 66      // Bit less than 700mV
 #define VBIAS_MAX_DAC_VAL       DAC_MIN_VAL           // Around 15300mV
@@ -29,17 +32,42 @@
 #define STEPUP_ACTIV_DAC_V      3070                  // Around 4350mV
 #define BIT_AVG_APPROACH        3                     // Bit averaging for approach
 #define BIT_AVG_FINE            13                    // Bit averaging for fine approach
-#define CONV_DELAY_FINE         1                     // How long we should wait before launching a conversion (ms)
 #define VBIAS_OVERSHOOT_MV      10                    // The overshoot we want (due to the capacitors)
 #define MV_APPROCH              50+VBIAS_OVERSHOOT_MV // When to start fine approach
+#define VBIAS_LUT_MARGIN_MV     30                    // How far below the requested voltage the lookup table jumps go
+#define VBIAS_SETTLE_MAX_MS     200                   // Maximum time we wait for vbias to settle (ms)
+#define VBIAS_SETTLE_MAX_SLOPE  8                     // Vbias is settled below this slope (mV/ms)
+#define VBIAS_SETTLE_INTERVAL   16                    // Interval between two slope measurements, in TCD1 ticks (512us)
+#define VBIAS_SETTLE_NB_SLOW    2                     // Number of consecutive intervals below the max slope
+#define BIT_AVG_SETTLE          5                     // Bit averaging for the slope measurements
+#define BIT_AVG_REG             8                     // Bit averaging for the background regulation
+#define VBIAS_REG_PERIOD        312                   // Interval between two background regulation measurements, in TCD1 ticks (10ms)
+
+// Typedefs
+typedef struct vbias_reg_report_struct
+{
+    uint16_t measured_vbias;                // Last measured vbias (mV)
+    uint16_t dac_value;                     // Current vbias DAC value
+    int16_t dac_correction;                 // DAC correction applied since the regulation was set, positive lowers vbias
+    uint16_t nb_corrections;                // Number of corrections applied since the regulation was set
+    int16_t last_error;                     // Last measured deviation from the set voltage (mV)
+} vbias_reg_report_t;
 
 // Prototypes
 uint16_t force_vbias_dac_change(uint16_t dac_value, uint16_t wait_ms);
 uint16_t update_bias_voltage(uint16_t val_mv);
 uint16_t enable_bias_voltage(uint16_t val_mv);
 uint16_t get_current_vbias_dac_value(void);
+uint8_t get_vbias_regulation_report(uint8_t* buffer);
 uint16_t get_last_measured_vbias(void);
+uint8_t apply_pending_vbias_trim(void);
+void set_vbias_regulation(uint16_t band_mv);
+uint32_t get_last_vbias_settling_time(void);
+void start_bias_voltage_enable(uint16_t val_mv);
+uint8_t vbias_state_machine_step(void);
+void start_bias_voltage_disable(void);
 void disable_bias_voltage(void);
+void vbias_regulation_loop(uint8_t trim_at_gate);
 void wait_for_0v4_bias(void);
 void wait_for_0v_bias(void);
 